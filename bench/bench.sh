@@ -0,0 +1,152 @@
+#!/usr/bin/env sh
+
+# Generate synthetic archives with bench/lzbench and time lounzip on
+# them, with the page cache warm and cold. Every run is printed as one
+# JSON object per line: label, seconds, user, sys, max_rss_kb, bytes,
+# files, mb_s, files_s and status.
+#
+# usage: bench/bench.sh [work dir]
+#
+# The archives are kept in the work directory and only generated once,
+# remove them to make them again. Set SCENARIOS, COMMANDS and VARIANTS
+# to run a part of the suite, and TINY_FILES, HUGE_FILES and HUGE_SIZE
+# to change the size of the big archives.
+
+LOUNZIP=${LOUNZIP:-./lounzip}
+LZBENCH=${LZBENCH:-./bench/lzbench}
+WORK=${1:-${WORK:-./bench/work}}
+SCENARIOS=${SCENARIOS:-"tiny huge stored deflate bzip2 encrypted deep"}
+COMMANDS=${COMMANDS:-"x l t r d"}
+CACHES=${CACHES:-"warm cold"}
+TINY_FILES=${TINY_FILES:-1000000}
+HUGE_FILES=${HUGE_FILES:-2}
+HUGE_SIZE=${HUGE_SIZE:-2G}
+# Extraction switches to compare, one "name switches..." per line.
+VARIANTS=${VARIANTS:-"default
+j0 -j 0
+uring --io-uring
+buf4m --buffer-size 4M"}
+
+usage() {
+    printf "usage: %s [work dir]\n" "$0"
+    exit 1
+}
+
+[ $# -le 1 ] || usage
+for PROGRAM in "$LOUNZIP" "$LZBENCH"
+do
+    if [ ! -x "$PROGRAM" ]
+    then
+        printf "error: '%s' was not found, run ./build.sh bench.\n" \
+            "$PROGRAM" 1>&2
+        exit 1
+    fi
+done
+mkdir -p "$WORK" || exit 1
+# The password of the encrypted archive, see lzbench.c.
+printf "lzbench\n" > "$WORK/password" || exit 1
+
+# Fill the page cache with a file, or drop it from there.
+cache() {
+    if [ "$1" = "warm" ]
+    then
+        cat "$2" > /dev/null
+    else
+        "$LZBENCH" evict "$2"
+    fi
+}
+
+# run LABEL BYTES CACHE FILE COMMAND...
+run() {
+    LABEL=$1
+    BYTES=$2
+    CACHE=$3
+    FILE=$4
+    shift 4
+    cache "$CACHE" "$FILE"
+    "$LZBENCH" run "$LABEL/$CACHE" "$BYTES" "$FILES" "$@"
+}
+
+for SCENARIO in $SCENARIOS
+do
+    ARCHIVE=$WORK/$SCENARIO.zip
+    INFO=$WORK/$SCENARIO.info
+    if [ ! -f "$ARCHIVE" ] || [ ! -f "$INFO" ]
+    then
+        case $SCENARIO in
+        tiny) ARGS=$TINY_FILES ;;
+        huge) ARGS="$HUGE_FILES $HUGE_SIZE" ;;
+        *)    ARGS= ;;
+        esac
+        # shellcheck disable=SC2086
+        if ! "$LZBENCH" gen "$SCENARIO" "$ARCHIVE" $ARGS > "$INFO"
+        then
+            rm -f "$ARCHIVE" "$INFO"
+            printf "warning: skipping %s.\n" "$SCENARIO" 1>&2
+            continue
+        fi
+    fi
+    read -r FILES BYTES FIRST < "$INFO"
+    SIZE=$(wc -c < "$ARCHIVE")
+    OUT=$WORK/out
+    COPY=$WORK/copy.zip
+    PASSWORD=
+    [ "$SCENARIO" = "encrypted" ] &&
+        PASSWORD="--password-file $WORK/password"
+
+    for COMMAND in $COMMANDS
+    do
+        for CACHE in $CACHES
+        do
+            case $COMMAND in
+            x)
+                # Not a pipe, so that exit leaves the suite and not
+                # only a subshell. The runs don't read the variants.
+                while read -r NAME FLAGS
+                do
+                    rm -rf "$OUT" && mkdir -p "$OUT" || exit 1
+                    # shellcheck disable=SC2086
+                    run "$SCENARIO/x/$NAME" "$BYTES" "$CACHE" "$ARCHIVE" \
+                        "$LOUNZIP" x "$ARCHIVE" -o "$OUT" -y \
+                        $PASSWORD $FLAGS < /dev/null
+                done <<EOF
+$VARIANTS
+EOF
+                rm -rf "$OUT"
+                ;;
+            l)
+                run "$SCENARIO/l" "$BYTES" "$CACHE" "$ARCHIVE" \
+                    "$LOUNZIP" l "$ARCHIVE"
+                ;;
+            t)
+                # shellcheck disable=SC2086
+                run "$SCENARIO/t/default" "$BYTES" "$CACHE" "$ARCHIVE" \
+                    "$LOUNZIP" t $PASSWORD "$ARCHIVE"
+                # shellcheck disable=SC2086
+                run "$SCENARIO/t/j0" "$BYTES" "$CACHE" "$ARCHIVE" \
+                    "$LOUNZIP" t -j 0 $PASSWORD "$ARCHIVE"
+                ;;
+            r|d)
+                # Edits go to a copy, and the whole archive is counted
+                # since that is what a rewrite goes through.
+                for MODE in rewrite --in-place
+                do
+                    cp "$ARCHIVE" "$COPY" || exit 1
+                    FLAG=
+                    [ "$MODE" = "--in-place" ] && FLAG=$MODE
+                    if [ "$COMMAND" = "r" ]
+                    then
+                        set -- "$FIRST" "$FIRST.renamed"
+                    else
+                        set -- "$FIRST"
+                    fi
+                    # shellcheck disable=SC2086
+                    run "$SCENARIO/$COMMAND/${MODE#--}" "$SIZE" "$CACHE" \
+                        "$COPY" "$LOUNZIP" "$COMMAND" $FLAG "$COPY" "$@"
+                done
+                rm -f "$COPY"
+                ;;
+            esac
+        done
+    done
+done
@@ -0,0 +1,58 @@
+#!/usr/bin/env sh
+
+# Extract an archive once per buffer size and print the throughput,
+# to pick a --buffer-size for a given storage tier.
+#
+# usage: bench/buffer-size.sh archive.zip [output dir] [sizes...]
+#
+# The files go to a directory of its own made by mktemp, in the output
+# dir if one is given, which is the only thing removed afterwards.
+
+LOUNZIP=${LOUNZIP:-./lounzip}
+
+usage() {
+    printf "usage: %s archive.zip [output dir] [sizes...]\n" "$0"
+    exit 1
+}
+
+now() {
+    date +%s.%N
+}
+
+[ $# -ge 1 ] || usage
+ARCHIVE=$1
+shift
+PARENT=${1:-${TMPDIR:-/tmp}}
+[ $# -ge 1 ] && shift
+SIZES=${*:-"4K 16K 64K 256K 1M 2M 4M 8M 16M"}
+
+if [ ! -f "$ARCHIVE" ]
+then
+    printf "error: archive '%s' does not exist.\n" "$ARCHIVE"
+    exit 1
+fi
+OUT=$(mktemp -d "$PARENT/lounzip-bench.XXXXXX") || exit 1
+trap 'rm -rf "$OUT"' EXIT
+trap 'exit 1' INT TERM
+
+# Only count the bytes of the files, the way they end up on the disk.
+TOTAL=$($LOUNZIP l "$ARCHIVE" | sed -n 's/.*(\([0-9]*\) bytes)$/\1/p' |
+    awk '{ s += $1 } END { print s + 0 }')
+
+printf "%-10s %10s %12s\n" "buffer" "seconds" "MB/s"
+for SIZE in $SIZES
+do
+    RUN=$(mktemp -d "$OUT/run.XXXXXX") || exit 1
+    # The archive comes from the page cache for every run, so only
+    # the extraction itself is measured.
+    cat "$ARCHIVE" > /dev/null
+    START=$(now)
+    $LOUNZIP x "$ARCHIVE" -o "$RUN" -y --buffer-size "$SIZE" > /dev/null ||
+        exit 1
+    END=$(now)
+    rm -rf "$RUN"
+    awk -v s="$START" -v e="$END" -v b="$TOTAL" -v n="$SIZE" 'BEGIN {
+        t = e - s
+        printf "%-10s %10.3f %12.1f\n", n, t, (t > 0 ? b / t / 1e6 : 0)
+    }'
+done
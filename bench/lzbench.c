@@ -0,0 +1,675 @@
+/* lzbench - synthetic archives and timed runs, for benchmarking
+   lounzip. See bench/bench.sh for how the pieces are put together. */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#ifdef HAVE_BZIP2
+# include <bzlib.h>
+#endif
+
+/* Compression methods, as in the zip format. */
+#define CM_STORE           (0)
+#define CM_DEFLATE         (8)
+#define CM_BZIP2           (12)
+
+/* Signatures and sizes of the zip records. */
+#define SIG_LOCAL          (0x04034b50)
+#define SIG_CENTRAL        (0x02014b50)
+#define SIG_EOCD           (0x06054b50)
+#define SIG_EOCD64         (0x06064b50)
+#define SIG_EOCD64_LOC     (0x07064b50)
+#define LOCAL_HDR_SIZE     (30)
+#define CENTRAL_HDR_SIZE   (46)
+
+/* Entries from this size on get ZIP64 sizes, leaving room for the
+   compressed data to be a little bigger than the data. */
+#define ZIP64_SIZE         (0xf0000000ULL)
+
+/* Data is made and written this much at a time. */
+#define CHUNK              (256 * 1024)
+
+/* 2020-01-01 00:00, in MS-DOS time and date. */
+#define DOS_TIME           (0)
+#define DOS_DATE           ((40 << 9) | (1 << 5) | 1)
+
+/* Password of the encrypted entries. */
+#define PASSWORD           "lzbench"
+
+/* An archive being written, its central directory is kept in memory
+   until the end. */
+struct zwriter {
+	int fd;
+	uint64_t off;
+	unsigned char *cd;
+	size_t cdlen;
+	size_t cdmax;
+	uint64_t n;
+	uint64_t bytes;		/* Sum of the sizes of the entries. */
+	char *first;		/* Name of the first file. */
+	unsigned char *in, *out;
+};
+
+/* Keys of the traditional PKWARE encryption. */
+struct zcrypt {
+	uint32_t k0, k1, k2;
+};
+
+/* A few words for text-like data, which deflate shrinks about as
+   much as source code or documentation. */
+static const char *words[] = {
+	"the", "archive", "entry", "of", "data", "and", "file", "to",
+	"static", "int", "return", "buffer", "size", "struct", "void",
+	"for", "if", "char", "const", "zip", "inflate", "while", "in",
+	"directory", "name", "offset", "header", "central", "a", "is",
+	"compressed", "length"
+};
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, (uint16_t)v);
+	put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, (uint32_t)v);
+	put32(p + 4, (uint32_t)(v >> 32));
+}
+
+/* xorshift64*, the same seed always makes the same archive. */
+static uint64_t next_random(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return (*s * 0x2545f4914f6cdd1dULL);
+}
+
+/* Fill buf with random bytes, or with text made of words. */
+static void fill(unsigned char *buf, size_t n, uint64_t *seed, int text)
+{
+	uint64_t r;
+	size_t i, len;
+	const char *w;
+
+	if (text == 0) {
+		for (i = 0; i + 8 <= n; i += 8) {
+			r = next_random(seed);
+			memcpy(buf + i, &r, 8);
+		}
+		for (r = next_random(seed); i < n; i++, r >>= 8)
+			buf[i] = (unsigned char)r;
+		return;
+	}
+
+	for (i = 0; i < n; i += len) {
+		r = next_random(seed);
+		w = words[r % (sizeof(words) / sizeof(words[0]))];
+		len = strlen(w);
+		if (len > n - i)
+			len = n - i;
+		memcpy(buf + i, w, len);
+		if (i + len < n)
+			buf[i + len++] = (r >> 32) % 11 == 0 ? '\n' : ' ';
+	}
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p;
+	ssize_t n;
+
+	for (p = buf; len > 0; p += n, len -= (size_t)n) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno != EINTR)
+				return (-1);
+			n = 0;
+		}
+	}
+	return (0);
+}
+
+static void zcrypt_update(struct zcrypt *z, const uint32_t *tab,
+			  unsigned char c)
+{
+	z->k0 = tab[(z->k0 ^ c) & 0xff] ^ (z->k0 >> 8);
+	z->k1 = (z->k1 + (z->k0 & 0xff)) * 134775813 + 1;
+	z->k2 = tab[(z->k2 ^ (z->k1 >> 24)) & 0xff] ^ (z->k2 >> 8);
+}
+
+static void zcrypt_init(struct zcrypt *z, const uint32_t *tab,
+			const char *passw)
+{
+	z->k0 = 0x12345678;
+	z->k1 = 0x23456789;
+	z->k2 = 0x34567890;
+	for (; *passw != '\0'; passw++)
+		zcrypt_update(z, tab, (unsigned char)*passw);
+}
+
+static void zcrypt_encrypt(struct zcrypt *z, const uint32_t *tab,
+			   unsigned char *buf, size_t n)
+{
+	unsigned t;
+	unsigned char c;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		t = (z->k2 | 2) & 0xffff;
+		c = buf[i];
+		buf[i] ^= (unsigned char)((t * (t ^ 1)) >> 8);
+		zcrypt_update(z, tab, c);
+	}
+}
+
+static void zwriter_open(struct zwriter *w, const char *path)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w->fd == -1)
+		err(EXIT_FAILURE, "open(): %s", path);
+	w->in = malloc(CHUNK);
+	w->out = malloc(CHUNK);
+	if (w->in == NULL || w->out == NULL)
+		err(EXIT_FAILURE, "malloc()");
+}
+
+/* Write out what a compressor made, encrypting it first if needed. */
+static void zwriter_emit(struct zwriter *w, struct zcrypt *z,
+			 const uint32_t *tab, unsigned char *buf, size_t n,
+			 uint64_t *comp)
+{
+	if (z)
+		zcrypt_encrypt(z, tab, buf, n);
+	if (write_all(w->fd, buf, n) == -1)
+		err(EXIT_FAILURE, "write()");
+	*comp += n;
+}
+
+/* Add an entry of size bytes made by fill() from seed. */
+static void zwriter_add(struct zwriter *w, const char *name, int method,
+			int encrypt, uint64_t size, uint64_t seed, int text)
+{
+	unsigned char lh[LOCAL_HDR_SIZE + 20], *c, x[28];
+	const uint32_t *tab;
+	struct zcrypt zc, *z;
+	z_stream zs;
+#ifdef HAVE_BZIP2
+	bz_stream bz;
+	int br;
+#endif
+	uint64_t lho, left, comp, s;
+	uint32_t crc;
+	size_t n, nlen, xlen, cap;
+	int zip64, flush, zr;
+
+	tab = (const uint32_t *)get_crc_table();
+	nlen = strlen(name);
+	zip64 = size >= ZIP64_SIZE;
+	lho = w->off;
+	if (w->first == NULL && (w->first = strdup(name)) == NULL)
+		err(EXIT_FAILURE, "strdup()");
+
+	/* The crc and sizes are filled in once the data is written. */
+	memset(lh, 0, sizeof(lh));
+	put32(lh, SIG_LOCAL);
+	put16(lh + 4, zip64 ? 45 : 20);
+	put16(lh + 6, encrypt ? 1 : 0);
+	put16(lh + 8, (uint16_t)method);
+	put16(lh + 10, DOS_TIME);
+	put16(lh + 12, DOS_DATE);
+	put16(lh + 26, (uint16_t)nlen);
+	put16(lh + 28, zip64 ? 20 : 0);
+	if (zip64) {
+		put32(lh + 18, 0xffffffff);
+		put32(lh + 22, 0xffffffff);
+		put16(lh + 30, 0x0001);
+		put16(lh + 32, 16);
+	}
+	if (write_all(w->fd, lh, LOCAL_HDR_SIZE) == -1 ||
+	    write_all(w->fd, name, nlen) == -1 ||
+	    (zip64 && write_all(w->fd, lh + LOCAL_HDR_SIZE, 20) == -1))
+		err(EXIT_FAILURE, "write()");
+
+	/* The header of an encrypted entry ends with the high byte of
+	   the crc, so the data is made once more to get it first. */
+	z = NULL;
+	comp = 0;
+	crc = (uint32_t)crc32(0L, Z_NULL, 0);
+	if (encrypt) {
+		for (s = seed, left = size; left > 0; left -= n) {
+			n = left < CHUNK ? (size_t)left : CHUNK;
+			fill(w->in, n, &s, text);
+			crc = (uint32_t)crc32(crc, w->in, (uInt)n);
+		}
+		z = &zc;
+		zcrypt_init(z, tab, PASSWORD);
+		s = seed ^ 0x9e3779b97f4a7c15ULL;
+		fill(x, 11, &s, 0);
+		x[11] = (unsigned char)(crc >> 24);
+		zwriter_emit(w, z, tab, x, 12, &comp);
+		crc = (uint32_t)crc32(0L, Z_NULL, 0);
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (method == CM_DEFLATE &&
+	    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+			 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		errx(EXIT_FAILURE, "deflateInit2() failed.");
+#ifdef HAVE_BZIP2
+	memset(&bz, 0, sizeof(bz));
+	if (method == CM_BZIP2 && BZ2_bzCompressInit(&bz, 9, 0, 0) != BZ_OK)
+		errx(EXIT_FAILURE, "BZ2_bzCompressInit() failed.");
+#endif
+
+	left = size;
+	do {
+		n = left < CHUNK ? (size_t)left : CHUNK;
+		fill(w->in, n, &seed, text);
+		crc = (uint32_t)crc32(crc, w->in, (uInt)n);
+		left -= n;
+		flush = left == 0;
+
+		switch (method) {
+		case CM_STORE:
+			zwriter_emit(w, z, tab, w->in, n, &comp);
+			break;
+
+		case CM_DEFLATE:
+			zs.next_in = w->in;
+			zs.avail_in = (uInt)n;
+			do {
+				zs.next_out = w->out;
+				zs.avail_out = CHUNK;
+				zr = deflate(&zs, flush ? Z_FINISH : Z_NO_FLUSH);
+				if (zr == Z_STREAM_ERROR)
+					errx(EXIT_FAILURE, "deflate() failed.");
+				zwriter_emit(w, z, tab, w->out,
+					     CHUNK - zs.avail_out, &comp);
+			} while (zs.avail_out == 0 ||
+				 (flush && zr != Z_STREAM_END));
+			break;
+
+#ifdef HAVE_BZIP2
+		case CM_BZIP2:
+			bz.next_in = (char *)w->in;
+			bz.avail_in = (unsigned)n;
+			do {
+				bz.next_out = (char *)w->out;
+				bz.avail_out = CHUNK;
+				br = BZ2_bzCompress(&bz, flush ? BZ_FINISH : BZ_RUN);
+				if (br < 0)
+					errx(EXIT_FAILURE,
+					     "BZ2_bzCompress() failed.");
+				zwriter_emit(w, z, tab, w->out,
+					     CHUNK - bz.avail_out, &comp);
+			} while (bz.avail_out == 0 ||
+				 (flush && br != BZ_STREAM_END));
+			break;
+#endif
+		}
+	} while (left > 0);
+
+	if (method == CM_DEFLATE)
+		deflateEnd(&zs);
+#ifdef HAVE_BZIP2
+	if (method == CM_BZIP2)
+		BZ2_bzCompressEnd(&bz);
+#endif
+
+	/* Go back to the local header for the crc and sizes. */
+	put32(lh + 14, crc);
+	if (zip64) {
+		put64(lh + 34, size);
+		put64(lh + 42, comp);
+	} else {
+		put32(lh + 18, (uint32_t)comp);
+		put32(lh + 22, (uint32_t)size);
+	}
+	if (pwrite(w->fd, lh + 14, 12, (off_t)lho + 14) != 12 ||
+	    (zip64 && pwrite(w->fd, lh + 34, 16,
+			     (off_t)(lho + LOCAL_HDR_SIZE + nlen + 4)) != 16))
+		err(EXIT_FAILURE, "pwrite()");
+	w->off = lho + LOCAL_HDR_SIZE + nlen + (zip64 ? 20 : 0) + comp;
+
+	/* The central record, with the ZIP64 fields it needs. */
+	xlen = 0;
+	if (zip64 || lho >= 0xffffffffULL) {
+		xlen = 4;
+		if (zip64) {
+			put64(x + xlen, size);
+			put64(x + xlen + 8, comp);
+			xlen += 16;
+		}
+		if (lho >= 0xffffffffULL) {
+			put64(x + xlen, lho);
+			xlen += 8;
+		}
+		put16(x, 0x0001);
+		put16(x + 2, (uint16_t)(xlen - 4));
+	}
+	if (w->cdlen + CENTRAL_HDR_SIZE + nlen + xlen > w->cdmax) {
+		cap = w->cdmax ? w->cdmax * 2 : 1024 * 1024;
+		while (cap < w->cdlen + CENTRAL_HDR_SIZE + nlen + xlen)
+			cap *= 2;
+		c = realloc(w->cd, cap);
+		if (c == NULL)
+			err(EXIT_FAILURE, "realloc()");
+		w->cd = c;
+		w->cdmax = cap;
+	}
+	c = w->cd + w->cdlen;
+	memset(c, 0, CENTRAL_HDR_SIZE);
+	put32(c, SIG_CENTRAL);
+	put16(c + 4, 3 << 8 | (zip64 ? 45 : 20));
+	put16(c + 6, zip64 ? 45 : 20);
+	put16(c + 8, encrypt ? 1 : 0);
+	put16(c + 10, (uint16_t)method);
+	put16(c + 12, DOS_TIME);
+	put16(c + 14, DOS_DATE);
+	put32(c + 16, crc);
+	put32(c + 20, zip64 ? 0xffffffff : (uint32_t)comp);
+	put32(c + 24, zip64 ? 0xffffffff : (uint32_t)size);
+	put16(c + 28, (uint16_t)nlen);
+	put16(c + 30, (uint16_t)xlen);
+	put32(c + 38, (uint32_t)0100644 << 16);
+	put32(c + 42, lho >= 0xffffffffULL ? 0xffffffff : (uint32_t)lho);
+	memcpy(c + CENTRAL_HDR_SIZE, name, nlen);
+	memcpy(c + CENTRAL_HDR_SIZE + nlen, x, xlen);
+	w->cdlen += CENTRAL_HDR_SIZE + nlen + xlen;
+	w->n++;
+	w->bytes += size;
+}
+
+/* Write the central directory and the end records, then tell the
+   number of files, their bytes and the name of the first one. */
+static void zwriter_close(struct zwriter *w)
+{
+	unsigned char e[56 + 20 + 22];
+	uint64_t at;
+	size_t len;
+	int zip64;
+
+	at = w->off;
+	if (write_all(w->fd, w->cd, w->cdlen) == -1)
+		err(EXIT_FAILURE, "write()");
+
+	zip64 = w->n >= 0xffff || at >= 0xffffffffULL ||
+		w->cdlen >= 0xffffffffULL;
+	memset(e, 0, sizeof(e));
+	len = 0;
+	if (zip64) {
+		put32(e, SIG_EOCD64);
+		put64(e + 4, 56 - 12);
+		put16(e + 12, 3 << 8 | 45);
+		put16(e + 14, 45);
+		put64(e + 24, w->n);
+		put64(e + 32, w->n);
+		put64(e + 40, w->cdlen);
+		put64(e + 48, at);
+		put32(e + 56, SIG_EOCD64_LOC);
+		put64(e + 64, at + w->cdlen);
+		put32(e + 72, 1);
+		len = 56 + 20;
+	}
+	put32(e + len, SIG_EOCD);
+	put16(e + len + 8, zip64 ? 0xffff : (uint16_t)w->n);
+	put16(e + len + 10, zip64 ? 0xffff : (uint16_t)w->n);
+	put32(e + len + 12, zip64 ? 0xffffffff : (uint32_t)w->cdlen);
+	put32(e + len + 16, zip64 ? 0xffffffff : (uint32_t)at);
+	if (write_all(w->fd, e, len + 22) == -1 || close(w->fd) == -1)
+		err(EXIT_FAILURE, "write()");
+
+	printf("%llu %llu %s\n", (unsigned long long)w->n,
+	       (unsigned long long)w->bytes, w->first ? w->first : "-");
+	free(w->cd);
+	free(w->first);
+	free(w->in);
+	free(w->out);
+}
+
+/* Parse a count or a size, with an optional K, M or G suffix. */
+static uint64_t parse_number(const char *s, uint64_t dflt)
+{
+	char *end;
+	unsigned long long n;
+
+	if (s == NULL)
+		return (dflt);
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (errno == 0 && end != s) {
+		switch (*end) {
+		case 'k': case 'K':
+			n <<= 10;
+			end++;
+			break;
+		case 'm': case 'M':
+			n <<= 20;
+			end++;
+			break;
+		case 'g': case 'G':
+			n <<= 30;
+			end++;
+			break;
+		}
+	}
+	if (errno != 0 || end == s || *end != '\0')
+		errx(EXIT_FAILURE, "invalid number '%s'.", s);
+	return ((uint64_t)n);
+}
+
+/* lzbench gen KIND OUT.zip [COUNT] [SIZE] */
+static void gen(int argc, char **argv)
+{
+	struct zwriter w;
+	const char *kind;
+	char name[4096];
+	uint64_t i, count, size, seed;
+	size_t len;
+	int k, method;
+
+	if (argc < 4)
+		errx(EXIT_FAILURE, "usage: lzbench gen kind out.zip "
+		     "[count] [size]");
+	kind = argv[2];
+	seed = 0x5eed;
+
+	if (strcmp(kind, "tiny") == 0) {
+		/* Many small text files, a thousand per directory. */
+		count = parse_number(argc > 4 ? argv[4] : NULL, 1000000);
+		zwriter_open(&w, argv[3]);
+		for (i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "tiny/%04llu/%06llu.txt",
+				 (unsigned long long)(i / 1000),
+				 (unsigned long long)i);
+			zwriter_add(&w, name, CM_DEFLATE, 0,
+				    16 + next_random(&seed) % 2048,
+				    seed + i, 1);
+		}
+	} else if (strcmp(kind, "huge") == 0) {
+		/* A few big members, half text and half random. */
+		count = parse_number(argc > 4 ? argv[4] : NULL, 2);
+		size = parse_number(argc > 5 ? argv[5] : NULL, 2ULL << 30);
+		zwriter_open(&w, argv[3]);
+		for (i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "huge/%llu.bin",
+				 (unsigned long long)i);
+			zwriter_add(&w, name, CM_DEFLATE, 0, size, seed + i,
+				    (int)(i % 2 == 0));
+		}
+	} else if (strcmp(kind, "stored") == 0 ||
+		   strcmp(kind, "deflate") == 0 ||
+		   strcmp(kind, "bzip2") == 0) {
+		/* The same files with each method, to compare them. */
+		method = kind[0] == 's' ? CM_STORE :
+			kind[0] == 'd' ? CM_DEFLATE : CM_BZIP2;
+#ifndef HAVE_BZIP2
+		if (method == CM_BZIP2)
+			errx(EXIT_FAILURE, "built without bzip2.");
+#endif
+		count = parse_number(argc > 4 ? argv[4] : NULL, 256);
+		size = parse_number(argc > 5 ? argv[5] : NULL, 1 << 20);
+		zwriter_open(&w, argv[3]);
+		for (i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "%s/%04llu.dat", kind,
+				 (unsigned long long)i);
+			zwriter_add(&w, name, method, 0, size, seed + i, 1);
+		}
+	} else if (strcmp(kind, "encrypted") == 0) {
+		count = parse_number(argc > 4 ? argv[4] : NULL, 256);
+		size = parse_number(argc > 5 ? argv[5] : NULL, 256 << 10);
+		zwriter_open(&w, argv[3]);
+		for (i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "encrypted/%04llu.dat",
+				 (unsigned long long)i);
+			zwriter_add(&w, name, CM_DEFLATE, 1, size, seed + i, 1);
+		}
+	} else if (strcmp(kind, "deep") == 0) {
+		/* Files at every level of a few deep branches. The
+		   size argument is the depth. */
+		count = parse_number(argc > 4 ? argv[4] : NULL, 10000);
+		size = parse_number(argc > 5 ? argv[5] : NULL, 64);
+		if (size == 0 || size > 200)
+			errx(EXIT_FAILURE, "the depth goes from 1 to 200.");
+		zwriter_open(&w, argv[3]);
+		for (i = 0; i < count; i++) {
+			len = (size_t)snprintf(name, sizeof(name), "deep/b%llu",
+					       (unsigned long long)(i % 8));
+			for (k = 0; k < (int)(i / 8 % size); k++)
+				len += (size_t)snprintf(name + len,
+							sizeof(name) - len,
+							"/d%d", k);
+			snprintf(name + len, sizeof(name) - len, "/%llu.txt",
+				 (unsigned long long)i);
+			zwriter_add(&w, name, CM_DEFLATE, 0,
+				    16 + next_random(&seed) % 4096,
+				    seed + i, 1);
+		}
+	} else {
+		errx(EXIT_FAILURE, "unknown kind '%s', use tiny, huge, "
+		     "stored, deflate, bzip2, encrypted or deep.", kind);
+	}
+	zwriter_close(&w);
+}
+
+/* lzbench evict FILE... drops the files from the page cache, for
+   runs with a cold cache without being root. */
+static void evict(int argc, char **argv)
+{
+	int i, fd;
+
+	for (i = 2; i < argc; i++) {
+		fd = open(argv[i], O_RDONLY);
+		if (fd == -1)
+			err(EXIT_FAILURE, "open(): %s", argv[i]);
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+/* Print s as a JSON string. */
+static void json_string(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		if ((unsigned char)*s >= 0x20)
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* lzbench run LABEL BYTES FILES COMMAND... runs a command with its
+   output thrown away, and prints a JSON object with its times, peak
+   resident memory and rates. */
+static void run(int argc, char **argv)
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+	uint64_t bytes, files;
+	double secs;
+	pid_t pid;
+	int status, fd;
+
+	if (argc < 6)
+		errx(EXIT_FAILURE, "usage: lzbench run label bytes files "
+		     "command...");
+	bytes = parse_number(argv[3], 0);
+	files = parse_number(argv[4], 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork()");
+	if (pid == 0) {
+		fd = open("/dev/null", O_RDWR);
+		if (fd != -1) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+		}
+		execvp(argv[5], argv + 5);
+		err(127, "execvp(): %s", argv[5]);
+	}
+	while (wait4(pid, &status, 0, &ru) == -1)
+		if (errno != EINTR)
+			err(EXIT_FAILURE, "wait4()");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (double)(t1.tv_sec - t0.tv_sec) +
+		(double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fputs("{\"label\":", stdout);
+	json_string(argv[2]);
+	printf(",\"seconds\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+	       "\"max_rss_kb\":%ld,\"bytes\":%llu,\"files\":%llu,"
+	       "\"mb_s\":%.2f,\"files_s\":%.1f,\"status\":%d}\n",
+	       secs,
+	       (double)ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+	       (double)ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+	       ru.ru_maxrss, (unsigned long long)bytes,
+	       (unsigned long long)files,
+	       secs > 0 ? (double)bytes / secs / 1e6 : 0.0,
+	       secs > 0 ? (double)files / secs : 0.0,
+	       WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		errx(EXIT_FAILURE, "usage: lzbench gen|evict|run ...");
+
+	if (strcmp(argv[1], "gen") == 0)
+		gen(argc, argv);
+	else if (strcmp(argv[1], "evict") == 0)
+		evict(argc, argv);
+	else if (strcmp(argv[1], "run") == 0)
+		run(argc, argv);
+	else
+		errx(EXIT_FAILURE, "unknown command '%s'.", argv[1]);
+	exit(EXIT_SUCCESS);
+}
@@ -14,8 +14,33 @@ build() {
 
     PROGRAM=lounzip.c
     LIB=zip
-    cc $PROGRAM -o ${PROGRAM%%.c} -l$LIB
+    # zstd members for the c command, when libzstd is there.
+    ZSTD=
+    if printf "#include <zstd.h>\nint main(void) { return 0; }\n" |
+        cc -x c - -o /dev/null -lzstd 2>/dev/null
+    then
+        ZSTD="-DHAVE_ZSTD -lzstd"
+    fi
+    cc $PROGRAM -o ${PROGRAM%%.c} -l$LIB -lz -lm -pthread $ZSTD
+}
+
+# The benchmark tool, with bzip2 archives when libbz2 is there.
+build_bench() {
+    BZIP2=
+    if printf "#include <bzlib.h>\nint main(void) { return 0; }\n" |
+        cc -x c - -o /dev/null -lbz2 2>/dev/null
+    then
+        BZIP2="-DHAVE_BZIP2 -lbz2"
+    fi
+    cc -O2 bench/lzbench.c -o bench/lzbench -lz $BZIP2
 }
 
 build
 
+if [ "$1" = "bench" ]
+then
+    build_bench || exit 1
+    shift
+    exec sh bench/bench.sh "$@"
+fi
+
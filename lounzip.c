@@ -1,3 +1,8 @@
+/* For copy_file_range() and the other Linux interfaces. */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,9 +13,50 @@
 #include <errno.h>
 #include <limits.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <termios.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <math.h>
+#include <zlib.h>
 #include <zip.h>
 
+/* The c command writes zstd members when lounzip is built with
+   HAVE_ZSTD, see build.sh. */
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+/* The io_uring backend talks to the kernel directly, it only needs
+   headers recent enough to know every operation it uses. */
+#ifdef __linux__
+# include <stdint.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+# include <linux/fs.h>
+# if defined (__NR_io_uring_setup) && defined (IORING_FEAT_CQE_SKIP)
+#  define HAVE_IO_URING
+# endif
+#endif
+
+/* The crc of files on the disk is computed with carry-less multiplies
+   on x86-64 processors that have them, see crc32_clmul(). The crc32
+   instruction of SSE4.2 can't be used, it computes CRC-32C. */
+#if defined (__x86_64__) && (defined (__GNUC__) || defined (__clang__))
+# include <wmmintrin.h>
+# include <smmintrin.h>
+# define HAVE_CLMUL
+#endif
+
 /* For compatibility with C90. */
 #ifndef PATH_MAX
 # define PATH_MAX          (1024)
@@ -22,15 +68,35 @@
 # define ECHOKE            (1)
 #endif
 
-/* Maximum amount of buffer that will be read, and then
-   will be written on the disk. */
-#define ZBUF_MAX           (1024)
+/* Amount of data that is read, and then written to the disk at
+   once. It can be changed with --buffer-size, but always stays a
+   multiple of ZBUF_ALIGN, which is also the alignment of buffers. */
+#define ZBUF_DEFAULT       (1024 * 1024)
+#define ZBUF_ALIGN         (4096)
+#define ZBUF_LIMIT         (1024L * 1024 * 1024)
+
+/* Sizes of the io_uring backend. Files up to URING_FILE_MAX bytes are
+   inflated into a shared arena and written out URING_BATCH at a time,
+   with two submissions per batch. */
+#define URING_ENTRIES      (512)
+#define URING_BATCH        (URING_ENTRIES / 2)
+#define URING_ARENA        (8 * 1024 * 1024)
+#define URING_FILE_MAX     (64 * 1024)
+
+/* What a completion of the io_uring backend belongs to. */
+#define URING_UNLINK       (0)
+#define URING_OPEN         (1)
+#define URING_WRITE        (2)
+#define URING_CLOSE        (3)
 
 /* Fancy constants for zip_open() and zip_get_num_entries(). */
 #undef ZIP_NONE
 #undef ZIP_FL_NONE
 #define ZIP_NONE           (0)
 #define ZIP_FL_NONE        (0)
+#ifndef ZIP_CM_ZSTD
+# define ZIP_CM_ZSTD       (93)
+#endif
 
 /* Constants for take_stdin_args() function. */
 #define REPLACE_YES        (1)
@@ -42,9 +108,156 @@
 #define REPLACE_ERROR      (7)
 #define REPLACE_OVERFLOW   (8)
 
+/* Signatures and sizes of the zip records that are read straight
+   from the archive, as libzip doesn't tell where the data lives. */
+#define SIG_LOCAL          (0x04034b50)
+#define SIG_CENTRAL        (0x02014b50)
+#define SIG_EOCD           (0x06054b50)
+#define SIG_EOCD64         (0x06064b50)
+#define SIG_EOCD64_LOC     (0x07064b50)
+#define SIG_DATA_DESC      (0x08074b50)
+#define LOCAL_HDR_SIZE     (30)
+#define CENTRAL_HDR_SIZE   (46)
+#define EOCD_SIZE          (22)
+#define EOCD64_SIZE        (56)
+#define EOCD64_LOC_SIZE    (20)
+#define EOCD_MAX_COMMENT   (65535)
+
+/* Data of upcoming entries the kernel is asked to read ahead, and the
+   gap between entries that still counts as reading on. */
+#define RA_WINDOW          (16 * 1024 * 1024)
+#define SEEK_SLACK         (128 * 1024)
+
+/* Directories kept open at most while extracting, see dircache_init(). */
+#define DIRCACHE_FDS       (4096)
+#define DIRCACHE_NOFD      (-2)
+
+/* Files are preallocated from PREALLOC_MIN bytes on. With --sparse,
+   every all-zero SPARSE_BLOCK of a file is left as a hole. */
+#define PREALLOC_MIN       (64 * 1024)
+#define SPARSE_BLOCK       (4096)
+
+/* Sizes of the ustar format. */
+#define TAR_BLOCK          (512)
+#define TAR_NAME_MAX       (100)
+#define TAR_PREFIX_MAX     (155)
+
+/* Modes of --update and --freshen. */
+#define UPDATE_NONE        (0)
+#define UPDATE_NEW         (1)
+#define UPDATE_FRESHEN     (2)
+
+/* Modes of --dedup, and how much of two entries is compared at once
+   to tell that their data is the same. */
+#define DEDUP_NONE         (0)
+#define DEDUP_CLONE        (1)
+#define DEDUP_LINK         (2)
+#define DEDUP_CHUNK        (64 * 1024)
+
+/* Modes of --stats. */
+#define STATS_NONE         (0)
+#define STATS_HUMAN        (1)
+#define STATS_JSON         (2)
+
+/* Phases timed by --stats, see phase_names. */
+#define PHASE_OPEN         (0)	/* zip_open(). */
+#define PHASE_STAT         (1)	/* zip_stat_index(). */
+#define PHASE_PROMPT       (2)	/* Waiting on the terminal. */
+#define PHASE_MKDIR        (3)	/* Creating the directories. */
+#define PHASE_CREATE       (4)	/* unlink(), open() and fallocate(). */
+#define PHASE_INFLATE      (5)	/* zip_fread(), or testing an entry. */
+#define PHASE_COPY         (6)	/* Copying a stored entry. */
+#define PHASE_WRITE        (7)	/* write() of what was inflated. */
+#define PHASE_CLOSE        (8)	/* Setting the time and close(). */
+#define PHASES             (9)
+
+/* Histogram buckets of --stats, bucket k counts values from 2^(k-1)
+   up to 2^k, the last one everything above. */
+#define STATS_BUCKETS      (40)
+
+/* --progress is redrawn at most every PROGRESS_NS on a terminal, and
+   printed every PROGRESS_LOG_NS otherwise. */
+#define PROGRESS_NS        (250 * 1000000ULL)
+#define PROGRESS_LOG_NS    (5 * 1000000000ULL)
+
+/* Size of the buffer of standard output, the lines of the files are
+   written out a buffer at a time. */
+#define OUT_BUFFER         (64 * 1024)
+
+/* Archives extracted at once use at most 1/ARCHIVES_MEM_SHARE of the
+   memory for their buffers, and keep at least ARCHIVE_DIRFDS of their
+   directories open. */
+#define ARCHIVES_MEM_SHARE (4)
+#define ARCHIVE_DIRFDS     (16)
+
 /* Maximum size that can be for a password. */
 #define MAX_PASSWD_SIZE    (82)
 
+/* The password is taken from this variable when it is not given by
+   --password-file or --password-fd. A password typed on the terminal
+   can be tried PASSWORD_TRIES times, and PASSWORD_PROBE bytes of the
+   first encrypted entry are inflated to check it. */
+#define PASSWORD_ENV       "LOUNZIP_PASSWORD"
+#define PASSWORD_TRIES     (3)
+#define PASSWORD_PROBE     (64 * 1024)
+
+/* The a command cuts files in chunks of ADD_CHUNK that are deflated by
+   different threads, each primed with the ADD_DICT bytes before it so
+   that little is lost at the seams. Every thread has at most
+   ADD_WINDOW chunks in memory ahead of the writer. Files from
+   ADD_ZIP64 on get a ZIP64 local header, as their compressed size is
+   only known once they are written. */
+#define ADD_CHUNK          (1024 * 1024)
+#define ADD_DICT           (32 * 1024)
+#define ADD_WINDOW         (4)
+#define ADD_ZIP64          (0xff000000ULL)
+
+/* The c command guesses from the first RECOMP_SAMPLE bytes of a member
+   whether it is worth compressing: at RECOMP_ENTROPY bits per byte or
+   more, it is copied as it is. The new data of a member is kept in
+   memory up to RECOMP_SPILL, and in a temporary file past that. Every
+   thread works at most RECOMP_WINDOW members ahead of the writer. */
+#define RECOMP_SAMPLE      (64 * 1024)
+#define RECOMP_ENTROPY     (7.5)
+#define RECOMP_SPILL       (4 * 1024 * 1024)
+#define RECOMP_WINDOW      (4)
+#define RECOMP_OUT         (256 * 1024)
+
+/* The sidecar index of an archive is kept next to it, under its name
+   with LZIDX_SUFFIX, see lzidx_open(). */
+#define LZIDX_SUFFIX       ".lzidx"
+#define LZIDX_MAGIC        "LZIDX02"
+#define LZIDX_ENDIAN       (0x01020304)
+#define LZIDX_TAIL_MAX     (1024 * 1024)
+
+/* The daemon of the serve command listens on a Unix socket, given by
+   --socket or SERVE_SOCKET_ENV to the clients. It keeps up to
+   SERVE_CACHE archives open, whose central directories and name
+   indexes take up to SERVE_CACHE_BYTES, each with up to SERVE_HANDLES
+   idle libzip handles, and SERVE_QUEUE connections wait for a worker.
+   A request is at most SERVE_REQ_MAX bytes and has SERVE_TIMEOUT
+   seconds to come in. */
+#define SERVE_SOCKET_ENV   "LOUNZIP_SOCKET"
+#define SERVE_MAGIC        "LZSERVE1"
+#define SERVE_CACHE        (256)
+#define SERVE_CACHE_BYTES  (1024 * 1024 * 1024)
+#define SERVE_HANDLES      (4)
+#define SERVE_QUEUE        (64)
+#define SERVE_REQ_MAX      (1024 * 1024)
+#define SERVE_TIMEOUT      (10)
+
+/* The answer of the daemon to a request. */
+#define SERVE_OK           (0)
+#define SERVE_FAILED       (1)
+#define SERVE_LOCAL        (2)	/* Not for the daemon, run it here. */
+
+/* What the c command makes of a member. */
+#define RECOMP_KEEP        (0)	/* Copied as it is. */
+#define RECOMP_STORE       (1)
+#define RECOMP_DEFLATE     (2)
+#define RECOMP_ZSTD        (3)
+#define RECOMP_KINDS       (4)
+
 /* Use the compiler extension instead of language feature. */
 #if defined (__GNUC__) || defined (__clang__)
 # define NORETURN           __attribute__((noreturn))
@@ -89,6 +302,548 @@ static const char *zip_proper_error[33] = {
 	"ongoing operation was cancelled.", /* 32 */
 };
 
+/* Held while asking for a password, archives extracted at once by
+   unzip_archives() take turns at the terminal. */
+static pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Options of the extraction commands. */
+struct unzip_opts {
+	int all_ok;		/* -y, never ask before overwriting. */
+	long jobs;		/* -j, number of extraction threads. */
+	int no_crc;		/* --no-crc, skip the crc of copied entries. */
+	size_t bufsize;		/* --buffer-size, size of each I/O buffer. */
+	int io_uring;		/* --io-uring, batch small files. */
+	int sparse;		/* --sparse, leave blocks of zeros as holes. */
+	int update;		/* --update or --freshen, see UPDATE_*. */
+	int check_crc;		/* --check-crc, also compare the data. */
+	int test;		/* t, check the entries instead. */
+	int dedup;		/* --dedup or --dedup-link, see DEDUP_*. */
+	int stats;		/* --stats, see STATS_*. */
+	int quiet;		/* -q, don't tell about every file. */
+	int progress;		/* --progress, show a progress line. */
+	const char *passw;	/* Given without the terminal, or NULL. */
+	size_t dirfds;		/* Directories kept open, 0 for the default. */
+	struct name_query *include; /* --include, NULL for everything. */
+	struct name_query *exclude; /* --exclude, NULL for nothing. */
+};
+
+#ifdef HAVE_IO_URING
+/* The mapped rings of an io_uring instance. */
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned tail;		/* Our copy of the submission tail. */
+	unsigned queued;	/* Queued but not yet submitted. */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+/* A small file waiting in a batch, its data is in the arena. */
+struct uring_file {
+	const struct unzip_job *job;
+	size_t off;
+	size_t len;
+	int fd;
+	int wres;		/* Results of the write and the close. */
+	int cres;
+	int error;
+	const char *what;	/* The call that failed. */
+};
+
+struct uring_batch {
+	struct uring ring;
+	char *arena;
+	size_t used;
+	struct uring_file *files;
+	size_t nfiles;
+	FILE *out;		/* Where files are told, NULL with -q. */
+	struct unzip_stats *stats;
+};
+#endif
+
+/* Files and bytes written or skipped while extracting an archive. */
+struct unzip_tally {
+	zip_uint64_t written, written_bytes;
+	zip_uint64_t skipped, skipped_bytes;
+	zip_uint64_t holes;	/* Bytes left as holes, see --sparse. */
+	zip_uint64_t failed;	/* Entries that failed the t command. */
+	zip_uint64_t deduped, deduped_bytes;
+	zip_uint64_t shared_bytes; /* Of those, linked or cloned. */
+};
+
+/* Shared progress of the jobs of an archive, see progress_add(). */
+struct progress {
+	const char *name;
+	zip_uint64_t files, total_files;
+	zip_uint64_t bytes, total_bytes;
+	zip_uint64_t start;
+	zip_uint64_t next;	/* When it is drawn again. */
+	int tty;
+	pthread_mutex_t lock;
+};
+
+/* Where the time of an extraction went, with --stats. Threads add
+   to their own and the totals are summed at the end. */
+struct unzip_stats {
+	zip_uint64_t ns[PHASES];
+	zip_uint64_t calls[PHASES];
+	zip_uint64_t entries;
+	zip_uint64_t bytes;
+	zip_uint64_t max_ns;	/* The slowest entry. */
+	zip_uint64_t latency[STATS_BUCKETS]; /* Of each entry, in us. */
+	zip_uint64_t size[STATS_BUCKETS];    /* Of each entry, in bytes. */
+	long threads;
+};
+
+/* The I/O buffers of one extracting thread. While one of them is
+   being filled, the other one may be written by a writer thread. */
+struct unzip_io {
+	char *buf[2];
+	size_t size;
+	struct unzip_writer *writer;	/* Started by the first big entry. */
+	int sparse;
+	struct unzip_tally tally;	/* What this thread did. */
+	struct unzip_stats *stats;	/* &timing, only with --stats. */
+	struct unzip_stats timing;
+	struct progress *progress;	/* Only with --progress. */
+	zip_uint64_t counted;	/* Bytes of this entry in progress. */
+	int err;		/* Where warnings go, see dwarn(). */
+#ifdef HAVE_IO_URING
+	struct uring_batch *batch;	/* Only with --io-uring. */
+#endif
+};
+
+/* The writer thread of an extracting thread, owning the half of the
+   buffers that is full. It lives as long as the buffers; everything
+   but io, tid and done is per entry, and reset by inflate_entry() while
+   both buffers are empty. */
+struct unzip_writer {
+	const struct unzip_io *io;
+	pthread_t tid;
+	int fd;
+	size_t len[2];
+	int full[2];
+	int next;		/* The buffer to be written next. */
+	int done;		/* The buffers are being freed, exit. */
+	int error;		/* errno of a failed write. */
+	zip_uint64_t holes;
+	zip_uint64_t write_ns;	/* With --stats. */
+	zip_uint64_t writes;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* A slot of a name table, empty while key is NULL. */
+struct nameslot {
+	const char *key;
+	zip_uint64_t hash;
+	zip_uint64_t val;
+};
+
+/* A hash table of names, see nametab_put(). */
+struct nametab {
+	struct nameslot *slots;
+	size_t cap;		/* Always a power of two. */
+	size_t len;
+};
+
+/* A growable list of strings. */
+struct strlist {
+	char **v;
+	size_t n;
+	size_t max;
+	int owned;		/* The strings are freed with the list. */
+};
+
+/* An entry of an archive, by name. */
+struct name_ent {
+	const char *name;
+	zip_uint64_t idx;
+};
+
+/* The names of an archive, hashed for exact lookups and sorted for
+   prefix queries, see name_index_finish(). */
+struct name_index {
+	struct name_ent *v;	/* Sorted by name, then by index. */
+	size_t n;
+	struct nametab tab;	/* Name to its first position in v. */
+};
+
+/* Names asked for by the user, see name_query_init(). */
+struct name_query {
+	struct strlist req;	/* Owns the strings. */
+	unsigned char *hit;	/* Whether each of them matched. */
+	regex_t *re;		/* With --regex, each of them compiled. */
+	struct nametab lits;	/* The plain names, to their position. */
+};
+
+/* An archive read from a pipe, see unzip_zip_stream(). */
+struct zstream {
+	int fd;
+	unsigned char *buf;
+	size_t size;
+	size_t pos;		/* Unread data is from pos to len. */
+	size_t len;
+	zip_uint64_t off;	/* Offset of pos in the archive. */
+	int eof;
+};
+
+/* An entry of a stream, with what its headers say it should be
+   (want_*) and what it turned out to be. */
+struct zstream_entry {
+	char *name;
+	size_t nlen;
+	zip_uint64_t lho;
+	zip_uint64_t data;	/* Offset of its data. */
+	zip_uint64_t comp_size;
+	zip_uint64_t size;
+	zip_uint64_t want_comp;
+	zip_uint64_t want_size;
+	zip_uint32_t crc;
+	zip_uint32_t want_crc;
+	zip_uint32_t hash;	/* crc of the name. */
+	zip_uint16_t flags;
+	zip_uint16_t method;
+	int zip64;		/* Its data descriptor has 64-bit sizes. */
+};
+
+/* What is kept of the entries of a stream, to check the central
+   directory against: sums of a hash of each entry, which don't depend
+   on their order, see zstream_fold(). */
+struct zstream_digest {
+	size_t n;
+	zip_uint64_t sum;
+	zip_uint64_t xor;
+};
+
+/* Buffered output of the p and a commands. */
+struct zpipe {
+	int fd;
+	int err;		/* Where warnings go, see dwarn(). */
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+/* An entry to rename, see rename_plan(). */
+struct rename_op {
+	zip_uint64_t idx;
+	char *name;
+};
+
+/* An entry as recorded in the central directory. */
+struct cdir_entry {
+	zip_uint64_t lho;	/* Offset of the local file header. */
+	zip_uint64_t comp_size;
+	zip_uint64_t size;
+	zip_uint32_t crc;
+	zip_uint16_t method;
+	zip_uint16_t flags;
+	size_t rec;		/* The record, within cdir.raw. */
+	size_t rec_len;
+	const char *name;	/* Only if the records were kept. */
+	const char *new_name;	/* Set to rename it on cdir_write(). */
+	int deleted;		/* Set to leave it out on cdir_write(). */
+};
+
+/* The central directory, read without libzip. */
+struct cdir {
+	zip_uint64_t nentries;
+	zip_uint64_t offset;	/* Where the central directory starts. */
+	zip_uint64_t size;
+	zip_uint64_t eocd;	/* Where the EOCD record starts. */
+	int zip64;		/* It has ZIP64 end records. */
+	struct cdir_entry *e;
+	unsigned char *raw;	/* The records as they are on the disk. */
+	char *names;
+	unsigned char *comment;
+	size_t comment_len;
+};
+
+/* A single entry that is going to be extracted. Everything that
+   needs a terminal is settled before the job is created. */
+struct unzip_job {
+	zip_uint64_t idx;
+	zip_stat_t zs;
+	char *path;		/* Where the file will be created. */
+	int dfd;		/* Directory to create it in, */
+	const char *leaf;	/* under this name, see dircache_place(). */
+	char *passw;		/* Of the archive, shared by its jobs. */
+	const char *label;	/* Name printed while inflating. */
+	int renamed;		/* Path was given on the rename prompt. */
+	int verify;		/* Unchanged, unless its crc differs. */
+	int same_dfd;		/* With --dedup, the file that has the */
+	const char *same_leaf;	/* same data, or NULL. */
+	zip_uint64_t lho;	/* Where its data is, to schedule it. */
+	int first;		/* Big enough to be handed out first. */
+};
+
+/* Read-ahead state of a list of jobs, see readahead_jobs(). */
+struct readahead {
+	int fd;
+	const struct unzip_job *jobs;
+	size_t njobs;
+	size_t next;		/* First job not advised yet. */
+	zip_uint64_t ahead;	/* Bytes advised past the current job. */
+};
+
+/* Directories created below the destination, see dircache_dir(). */
+struct dircache {
+	int root;		/* The destination itself. */
+	struct nametab tab;	/* Relative path to its fd. */
+	struct strlist keys;	/* Owns the paths in tab. */
+	size_t nfds;
+	size_t maxfds;
+};
+
+/* State shared by everything extracting from one archive. */
+struct unzip_ctx {
+	const char *zfile;
+	const struct unzip_opts *opts;
+	int zfd;		/* The archive, for copying stored entries. */
+	struct cdir *cd;	/* NULL if it couldn't be read. */
+	struct unzip_tally tally;
+	FILE *out;		/* Where progress goes, see unzip_archives(). */
+	double secs;		/* Time the jobs took. */
+	struct unzip_stats *stats; /* Only with --stats. */
+	struct progress *progress; /* Only with --progress. */
+};
+
+/* Shared state of the extraction worker threads. */
+struct unzip_pool {
+	const struct unzip_ctx *ctx;
+	struct unzip_job *jobs;
+	size_t njobs;
+	size_t next;		/* Next job to hand out. */
+	struct readahead ra;
+	int failed;
+	struct unzip_tally tally;
+	pthread_mutex_t lock;
+};
+
+/* An archive waiting in unzip_archives(). */
+struct archive_job {
+	const char *zfile;
+	off_t size;
+};
+
+/* Shared state of the threads extracting whole archives. */
+struct archive_pool {
+	const char *dpath;
+	const struct unzip_opts *opts;
+	struct archive_job *arcs;
+	size_t narcs;
+	size_t next;		/* Next archive to hand out. */
+	size_t failed;
+	pthread_mutex_t lock;	/* Also held to print an archive. */
+};
+
+/* A file or directory to add, see add_walk(). */
+struct add_member {
+	char *path;		/* On the disk. */
+	char *name;		/* In the archive, directories end with /. */
+	zip_uint64_t size;
+	time_t mtime;
+	mode_t mode;
+	zip_uint64_t nchunks;
+	int replaces;		/* An entry of the archive has its name. */
+	int store;		/* See add_incompressible(). */
+	/* Filled in by the writer. */
+	zip_uint64_t lho;
+	zip_uint64_t comp_size;
+	zip_uint32_t crc;
+	zip_uint16_t method;
+};
+
+/* The files and directories to add, in archive order. */
+struct add_list {
+	struct add_member *v;
+	size_t n;
+	size_t cap;
+};
+
+/* A piece of a member, compressed on its own by add_worker(). */
+struct add_chunk {
+	size_t member;
+	zip_uint64_t off;
+	size_t len;
+	int last;		/* Of its member, ends the deflate stream. */
+	unsigned char *out;	/* What goes into the archive. */
+	size_t out_len;
+	zip_uint32_t crc;
+	int stored;		/* out is the data as it is. */
+	int done;
+	const char *error;
+	int errnum;
+};
+
+/* Header of a sidecar index. It belongs to the archive with that size,
+   time of modification and end records. The entries follow in central
+   directory order, then their positions sorted by name, then the
+   names. */
+struct lzidx_head {
+	char magic[8];
+	zip_uint32_t endian;
+	zip_uint32_t tail_crc;	/* Of the end records and the comment. */
+	zip_uint64_t size;
+	zip_int64_t mtime;
+	zip_int64_t mtime_ns;
+	zip_uint64_t tail;	/* Where the end records start. */
+	zip_uint64_t nentries;
+	zip_uint64_t names_len;
+};
+
+/* An entry of a sidecar index. */
+struct lzidx_entry {
+	zip_uint64_t lho;
+	zip_uint64_t comp_size;
+	zip_uint64_t size;
+	zip_uint64_t name;	/* Offset in the names. */
+	zip_uint32_t crc;
+	zip_uint32_t dos_time;	/* The date in the high half. */
+	zip_uint16_t method;
+	zip_uint16_t flags;
+	zip_uint16_t mode;	/* See cdir_rec_mode(). */
+	zip_uint32_t nlen;
+};
+
+/* A sidecar index mapped in memory. */
+struct lzidx {
+	void *map;
+	size_t len;
+	const struct lzidx_head *head;
+	const struct lzidx_entry *e;
+	const zip_uint32_t *sorted;	/* Entries by name. */
+	const char *names;
+};
+
+/* A member rewritten by the c command. */
+struct recomp_job {
+	struct cdir_entry *ce;
+	zip_uint64_t idx;	/* For libzip. */
+	int shared;		/* Its local header is the previous one's. */
+	int kind;		/* RECOMP_*, what it became. */
+	unsigned char *buf;	/* The new data, up to RECOMP_SPILL, */
+	size_t len;
+	size_t cap;
+	int spill;		/* then in this file, or -1. */
+	zip_uint64_t comp;	/* Size of the new data. */
+	zip_uint64_t read_ns;	/* Reading the old data. */
+	zip_uint64_t encode_ns;
+	zip_uint64_t check_ns;	/* Reading the new data back. */
+	const char *error;
+	int done;
+};
+
+/* Shared state of the threads of the c command. */
+struct recomp_pool {
+	const char *zfile;
+	const char *spill;	/* Template of the spill files. */
+	const struct cdir *cd;
+	struct recomp_job *jobs;
+	size_t njobs;
+	size_t next;		/* Next member to hand out. */
+	size_t written;		/* Members the writer is done with. */
+	size_t window;
+	int kind;		/* What members that compress become. */
+	int level;
+	int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* A member is done, or one is written. */
+};
+
+/* A stream compressor of the c command, and its output buffer. */
+struct recomp_enc {
+	int kind;
+	z_stream z;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zc;
+#endif
+	unsigned char *out;
+};
+
+/* Shared state of the compressing threads. The chunks in flight are
+   in a ring of window slots, chunk c in slot c % window. */
+struct add_pool {
+	const struct add_member *members;
+	struct add_chunk *ring;
+	zip_uint64_t window;
+	zip_uint64_t nchunks;
+	zip_uint64_t next;	/* Next chunk to hand out, */
+	size_t member;		/* which is in this member */
+	zip_uint64_t off;	/* at this offset. */
+	zip_uint64_t written;	/* Chunks the writer is done with. */
+	int level;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* A chunk is done, or one is written. */
+};
+
+/* The head of a request to the daemon. The working directory of the
+   client follows, then its arguments, each ending with a NUL. */
+struct serve_req {
+	char magic[8];
+	zip_uint32_t argc;
+	zip_uint32_t len;
+};
+
+/* An archive kept open by the daemon, with its central directory. */
+struct serve_arc {
+	char *path;		/* As given by realpath(). */
+	struct stat st;		/* Of the archive when it was opened. */
+	int zfd;
+	struct cdir *cd;
+	struct name_index ni;
+	zip_uint64_t bytes;	/* What cd and ni take, see serve_arc_open(). */
+	zip_t *zips[SERVE_HANDLES]; /* Idle libzip handles. */
+	size_t nzips;
+	int refs;		/* Requests using it. */
+	int gone;		/* Out of the cache, the last user frees it. */
+	struct serve_arc *prev, *next; /* Most recently used first. */
+};
+
+/* Counters of the daemon, see serve_report(). */
+struct serve_stats {
+	zip_uint64_t requests, failed, local;
+	zip_uint64_t hits, misses, reloads, evictions;
+	zip_uint64_t handles;	/* libzip handles opened. */
+};
+
+/* Shared state of the daemon and its workers. */
+struct serve {
+	int lfd;
+	long nthreads;
+	size_t max;		/* --cache, archives kept open. */
+	zip_uint64_t max_bytes;	/* --cache-size, what they take. */
+	int queue[SERVE_QUEUE];	/* Connections waiting for a worker. */
+	size_t head, queued;
+	int stop;
+	struct serve_arc *lru, *tail;
+	size_t narcs;
+	zip_uint64_t bytes;
+	struct serve_stats st;
+	zip_uint64_t start;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;	/* A connection is queued, or stop. */
+	pthread_cond_t room;	/* The queue has room again. */
+};
+
+/* A worker of the daemon and the request it is serving. */
+struct serve_conn {
+	struct serve *sv;
+	int out, err;		/* Standard output and error of the client. */
+	const char *cwd;	/* Where the client runs. */
+	int argc;
+	char **argv;
+	struct zpipe zp;
+	unsigned char *in;
+	struct unzip_io io;
+};
+
 /* Get the base of a path. */
 static const char *pathbase(const char *path)
 {
@@ -134,6 +889,77 @@ static int take_stdin_args(void)
 	}
 }
 
+/* Read a password from the first line of fd, which is left open. */
+static char *read_password_fd(int fd)
+{
+	FILE *fp;
+	char *line;
+	size_t cap;
+	ssize_t len;
+	int dfd;
+
+	dfd = dup(fd);
+	if (dfd == -1 || (fp = fdopen(dfd, "r")) == NULL) {
+		if (dfd != -1)
+			close(dfd);
+		return (NULL);
+	}
+	line = NULL;
+	cap = 0;
+	len = getline(&line, &cap, fp);
+	fclose(fp);
+	if (len == -1) {
+		free(line);
+		errno = EINVAL;
+		return (NULL);
+	}
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		line[--len] = '\0';
+	return (line);
+}
+
+/* Take the password given by --password-fd, --password-file or the
+   environment, in that order. Returns NULL if none is given. */
+static char *take_password_source(const char *fdarg, const char *path)
+{
+	const char *env;
+	char *passw, *end;
+	long fd;
+	int pfd;
+
+	if (fdarg) {
+		errno = 0;
+		fd = strtol(fdarg, &end, 10);
+		if (errno != 0 || end == fdarg || *end != '\0' || fd < 0 ||
+		    fd > INT_MAX)
+			errx(EXIT_FAILURE, "invalid file descriptor '%s'.",
+			     fdarg);
+		passw = read_password_fd((int)fd);
+		if (passw == NULL)
+			err(EXIT_FAILURE, "read(): password fd %ld", fd);
+		return (passw);
+	}
+
+	if (path) {
+		pfd = open(path, O_RDONLY);
+		if (pfd == -1)
+			err(EXIT_FAILURE, "open(): %s", path);
+		passw = read_password_fd(pfd);
+		close(pfd);
+		if (passw == NULL)
+			err(EXIT_FAILURE, "read(): %s", path);
+		return (passw);
+	}
+
+	env = getenv(PASSWORD_ENV);
+	if (env == NULL || *env == '\0')
+		return (NULL);
+	passw = strdup(env);
+	if (passw == NULL)
+		err(EXIT_FAILURE, "strdup()");
+	return (passw);
+}
+
 static char *take_stdin_password(void)
 {
 	int fd;
@@ -267,451 +1093,9116 @@ static int ignore_only_spaces(const char *s)
 	return (0);
 }
 
-static void extract_file_from_zip(zip_t *zip, zip_stat_t zs, zip_uint64_t idx,
-				  zip_uint16_t encrypted, int do_rename,
-				  char *passw, char *path)
+/* Map a libzip error to one of our error strings, falling back to
+   libzip's own description for codes we don't know about. */
+static const char *zip_error_string(zip_error_t *ze)
 {
-	zip_file_t *zfp;
-	int fd;
-	char zbuf[ZBUF_MAX], *renm;
-	size_t bytes, alen;
-	zip_int64_t reads;
+	int ec;
 
-	if (encrypted) {
-		/* Open an encrypted zip file. */
-		zfp = zip_fopen_index_encrypted(zip, idx, 0, passw);
-		if (zfp == NULL) {
-		        free(passw);
-			free(path);
-			zip_basic_error_exit(zip, 0);
+	ec = zip_error_code_zip(ze);
+	if (ec < 0 || (size_t)ec >= sizeof(zip_proper_error) /
+	    sizeof(zip_proper_error[0]) || zip_proper_error[ec][0] == '\0')
+		return (zip_error_strerror(ze));
+	return (zip_proper_error[ec]);
+}
+
+/* Little-endian readers for the on-disk zip records. */
+static zip_uint16_t get16(const unsigned char *p)
+{
+	return ((zip_uint16_t)(p[0] | p[1] << 8));
+}
+
+static zip_uint32_t get32(const unsigned char *p)
+{
+	return ((zip_uint32_t)get16(p) | (zip_uint32_t)get16(p + 2) << 16);
+}
+
+static zip_uint64_t get64(const unsigned char *p)
+{
+	return ((zip_uint64_t)get32(p) | (zip_uint64_t)get32(p + 4) << 32);
+}
+
+/* Read exactly len bytes at off. */
+static int pread_full(int fd, void *buf, size_t len, zip_uint64_t off)
+{
+	ssize_t n;
+	char *p;
+
+	for (p = buf; len > 0; p += n, len -= (size_t)n, off += (zip_uint64_t)n) {
+		n = pread(fd, p, len, (off_t)off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
 		}
-	} else {
-		/* Open a generic zip file. */
-		zfp = zip_fopen_index(zip, idx, 0);
-		if (zfp == NULL) {
-			free(passw);
-			free(path);
-			zip_basic_error_exit(zip, 0);
-	        }
+		if (n <= 0)
+			return (-1);
 	}
+	return (0);
+}
 
-	/* It doesn't really do renaming of an existing file,
-	   rather it just changes the file path that will be
-	   created for that new file to live. */
-	if (do_rename) {
-		for (;;) {
-			fputs("new name: ", stdout);
-			fflush(stdout);
+/* Read the sizes that didn't fit in 32 bits from a ZIP64 extra field.
+   They come in this exact order, each only if its 32-bit field is all
+   ones. lho is NULL for a local header, which has no offset. Returns
+   whether there was such a field. */
+static int zip64_extra(const unsigned char *x, size_t elen,
+		       zip_uint64_t *size, zip_uint64_t *comp_size,
+		       zip_uint64_t *lho)
+{
+	const unsigned char *end;
+	size_t off, len;
 
-			/* Take standard input from the terminal/tty. */
-			renm = take_stdin_rename();
-			if (renm == NULL) {
-				free(passw);
-				free(path);
-				zip_fclose(zfp);
-				errx(EXIT_FAILURE, "cannot take standard input.");
-			}
-			
-			/* Check if string length is zero. */
-			alen = strlen(renm);
-			if (alen == 0) {
-				fputs("path name cannot be empty.\n", stderr);
-				continue;
-			}
+	for (end = x + elen; x + 4 <= end; x += 4 + get16(x + 2)) {
+		if (get16(x) != 0x0001)
+			continue;
+		len = get16(x + 2);
+		if (x + 4 + len > end)
+			return (0);
+		off = 4;
+		if (*size == 0xffffffff && off + 8 <= 4 + len) {
+			*size = get64(x + off);
+			off += 8;
+		}
+		if (*comp_size == 0xffffffff && off + 8 <= 4 + len) {
+			*comp_size = get64(x + off);
+			off += 8;
+		}
+		if (lho && *lho == 0xffffffff && off + 8 <= 4 + len)
+			*lho = get64(x + off);
+		return (1);
+	}
+	return (0);
+}
 
-			/* Check if a same file exists with that input name. */
-			if (access(renm, F_OK) == 0) {
-				fprintf(stdout,
-					"similar file with name '%s' exists...\n",
-					renm);
-				continue;
-			}
+static void cdir_free(struct cdir *cd)
+{
+	if (cd) {
+		free(cd->e);
+		free(cd->raw);
+		free(cd->names);
+		free(cd->comment);
+		free(cd);
+	}
+}
 
-		        /* Ignore inputs, that consists of a single or multiple spaces
-			   and no other keyword. Don't use isascii() as we don't know
-			   the locale.*/
-			if (ignore_only_spaces(renm) == 0) {
-				fputs("invalid path name.\n", stderr);
-				continue;
-			}
+/* Read the central directory of the archive behind fd. The entries
+   are in the same order as libzip's indexes for an archive that
+   hasn't been modified. With keep, the records themselves, the names
+   and the archive comment are kept as well, to write them back later.
+   Returns NULL if the archive can't be parsed, callers are expected
+   to fall back to libzip in that case. */
+static struct cdir *cdir_read(int fd, int keep)
+{
+	struct stat st;
+	struct cdir *cd;
+	struct cdir_entry *ce;
+	unsigned char *tail, *rec, z64[EOCD64_SIZE];
+	size_t tlen, pos, nlen, elen, clen, npos;
+	zip_uint64_t i, off;
+	long at;
+
+	if (fstat(fd, &st) == -1 || st.st_size < EOCD_SIZE)
+		return (NULL);
+
+	/* The end of central directory record is somewhere within the
+	   last 64 KiB, as it may be followed by a comment. */
+	tlen = (zip_uint64_t)st.st_size < EOCD_SIZE + EOCD_MAX_COMMENT ?
+		(size_t)st.st_size : EOCD_SIZE + EOCD_MAX_COMMENT;
+	tail = malloc(tlen);
+	if (tail == NULL)
+		return (NULL);
+	if (pread_full(fd, tail, tlen, (zip_uint64_t)st.st_size - tlen) == -1) {
+		free(tail);
+		return (NULL);
+	}
 
-			/* Fill the path with zeros. */
-			memset(path, '\0', strlen(path));
-			/* Copy the new (path) name to the path. */
-			memcpy(path, renm, alen);
+	for (at = (long)(tlen - EOCD_SIZE); at >= 0; at--) {
+		if (get32(tail + at) == SIG_EOCD &&
+		    (size_t)at + EOCD_SIZE + get16(tail + at + 20) == tlen)
 			break;
+	}
+	if (at < 0) {
+		free(tail);
+		return (NULL);
+	}
+
+	cd = calloc(1, sizeof(*cd));
+	if (cd == NULL) {
+		free(tail);
+		return (NULL);
+	}
+	cd->nentries = get16(tail + at + 10);
+	cd->size = get32(tail + at + 12);
+	cd->offset = get32(tail + at + 16);
+	cd->eocd = (zip_uint64_t)st.st_size - tlen + (zip_uint64_t)at;
+
+	if (keep) {
+		cd->comment_len = get16(tail + at + 20);
+		cd->comment = malloc(cd->comment_len + 1);
+		if (cd->comment == NULL) {
+			free(tail);
+			cdir_free(cd);
+			return (NULL);
 		}
-		/* Print the renamed name string. */
-		fprintf(stdout, " inflating: %s .. ", renm);
-		free(renm);
-	} else {
-	        /* Remove the older file to not to cause data
-		   corruption by appending on the older file. */
-	        if (unlink(path) == -1) {
-			if (errno != ENOENT) {
-				warn("unlink()");
-				fputs("if unlink() failed to remove the older files, "
-				      "you may notice corrupted output files.\n", stderr);
-			}
+		memcpy(cd->comment, tail + at + EOCD_SIZE, cd->comment_len);
+	}
+
+	/* ZIP64 archives keep the real values in another record, which
+	   is found through a locator right before the EOCD. */
+	if (at >= EOCD64_LOC_SIZE &&
+	    get32(tail + at - EOCD64_LOC_SIZE) == SIG_EOCD64_LOC) {
+		off = get64(tail + at - EOCD64_LOC_SIZE + 8);
+		if (pread_full(fd, z64, sizeof(z64), off) == -1 ||
+		    get32(z64) != SIG_EOCD64) {
+			free(tail);
+			cdir_free(cd);
+			return (NULL);
 		}
+		cd->nentries = get64(z64 + 32);
+		cd->size = get64(z64 + 40);
+		cd->offset = get64(z64 + 48);
+		cd->zip64 = 1;
+	}
+	free(tail);
 
-		/* Print the original file name. */
-		fprintf(stdout, " inflating: %s .. ", zs.name);
+	if (cd->offset + cd->size > (zip_uint64_t)st.st_size ||
+	    cd->nentries > cd->size / CENTRAL_HDR_SIZE) {
+		cdir_free(cd);
+		return (NULL);
 	}
-	fflush(stdout);
 
-	/* Open a file descriptor for writing. */
-	fd = open(path, O_WRONLY | O_CREAT, 0644);
-	if (fd == -1) {
-		zip_fclose(zfp);
-		zip_close(zip);
-		free(passw);
-		free(path);
-		err(EXIT_FAILURE, "open()");
+	cd->raw = malloc(cd->size ? (size_t)cd->size : 1);
+	cd->e = calloc(cd->nentries ? (size_t)cd->nentries : 1,
+		       sizeof(*cd->e));
+	if (keep)
+		cd->names = malloc((size_t)cd->size + 1);
+	if (cd->raw == NULL || cd->e == NULL || (keep && cd->names == NULL) ||
+	    pread_full(fd, cd->raw, (size_t)cd->size, cd->offset) == -1) {
+		cdir_free(cd);
+		return (NULL);
 	}
 
-	bytes = 0;
-	while (bytes != zs.size) {
-		/* Read the file content and store it to zbuf. */
-		reads = zip_fread(zfp, zbuf, sizeof(zbuf));
-		if (reads == (zip_int64_t)-1) {
-			zip_fclose(zfp);
-		        free(passw);
-			free(path);
-			close(fd);
-			zip_basic_error_exit(zip, 0);
-		}
+	for (i = 0, pos = 0, npos = 0; i < cd->nentries; i++) {
+		rec = cd->raw + pos;
+		if (pos + CENTRAL_HDR_SIZE > cd->size ||
+		    get32(rec) != SIG_CENTRAL)
+			break;
 
-		/* Write the contents that's in zbuf. */
-		if (write(fd, zbuf, (size_t)reads) == -1) {
-			zip_fclose(zfp);
-			zip_close(zip);
-			free(passw);
-			free(path);
-			close(fd);
-			err(EXIT_FAILURE, "write()");
+		nlen = get16(rec + 28);
+		elen = get16(rec + 30);
+		clen = get16(rec + 32);
+		if (pos + CENTRAL_HDR_SIZE + nlen + elen + clen > cd->size)
+			break;
+
+		ce = &cd->e[i];
+		ce->flags = get16(rec + 8);
+		ce->method = get16(rec + 10);
+		ce->crc = get32(rec + 16);
+		ce->comp_size = get32(rec + 20);
+		ce->size = get32(rec + 24);
+		ce->lho = get32(rec + 42);
+		ce->rec = pos;
+		ce->rec_len = CENTRAL_HDR_SIZE + nlen + elen + clen;
+
+		zip64_extra(rec + CENTRAL_HDR_SIZE + nlen, elen,
+			    &ce->size, &ce->comp_size, &ce->lho);
+
+		if (keep) {
+			memcpy(cd->names + npos, rec + CENTRAL_HDR_SIZE, nlen);
+			cd->names[npos + nlen] = '\0';
+			ce->name = cd->names + npos;
+			npos += nlen + 1;
 		}
 
-		bytes += (size_t)reads;
+		pos += ce->rec_len;
 	}
 
-	close(fd);
-	zip_fclose(zfp);
-
-	/* Append a "ok" for parity. It doesn't say anything,
-	   e.g. whether the file inflating was successful or
-	   not. As if anything wrong  happens, it either will
-	   get ignored or will be caught in error guards. */
-	fputs("[ok]\n", stdout);
+	if (i != cd->nentries) {
+		cdir_free(cd);
+		return (NULL);
+	}
+	if (keep == 0) {
+		free(cd->raw);
+		cd->raw = NULL;
+	}
+	return (cd);
+}
 
-	/* Note: passw and path will be free'd in the parent function. */ 
+/* The Unix permissions of an entry from its central directory record,
+   or 0 if it wasn't made on Unix. */
+static zip_uint16_t cdir_rec_mode(const unsigned char *rec)
+{
+	if (rec[5] != ZIP_OPSYS_UNIX)
+		return (0);
+	return ((zip_uint16_t)(get32(rec + 38) >> 16 & 07777));
 }
 
-static void unzip_zip_archive(const char *dpath, const char *zfile, int all_ok)
+/* Find where the data of an entry starts, which is right after its
+   local header. The local header has its own name and extra field
+   lengths, which don't have to match the central directory. */
+static int cdir_data_offset(int fd, const struct cdir_entry *ce,
+			    zip_uint64_t *off)
 {
-	zip_t *zip;
-	zip_int64_t entries;
-	zip_uint64_t i;
-        zip_stat_t zs;
-        char *p, *r, *passw;
-	size_t zlen, dlen, mlen, tlen;
-	int ret, rename_ok, in_loop, eptr;
+	unsigned char lh[LOCAL_HDR_SIZE];
 
-	/* Check whether the source path (zip) file exists or not. */
-	if (access(zfile, F_OK) == -1)
-		errx(EXIT_FAILURE,
-		     "error: file '%s' does not exists.", zfile);
+	if (pread_full(fd, lh, sizeof(lh), ce->lho) == -1 ||
+	    get32(lh) != SIG_LOCAL)
+		return (-1);
+
+	*off = ce->lho + LOCAL_HDR_SIZE + get16(lh + 26) + get16(lh + 28);
+	return (0);
+}
+
+/* Little-endian writers, the other half of get16() and friends. */
+static void put16(unsigned char *p, zip_uint16_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+}
+
+static void put32(unsigned char *p, zip_uint32_t v)
+{
+	put16(p, (zip_uint16_t)v);
+	put16(p + 2, (zip_uint16_t)(v >> 16));
+}
+
+static void put64(unsigned char *p, zip_uint64_t v)
+{
+	put32(p, (zip_uint32_t)v);
+	put32(p + 4, (zip_uint32_t)(v >> 32));
+}
+
+/* Write exactly len bytes at off. */
+static int pwrite_full(int fd, const void *buf, size_t len, zip_uint64_t off)
+{
+	const char *p;
+	ssize_t n;
+
+	for (p = buf; len > 0; p += n, len -= (size_t)n, off += (zip_uint64_t)n) {
+		n = pwrite(fd, p, len, (off_t)off);
+		if (n == -1) {
+			if (errno != EINTR)
+				return (-1);
+			n = 0;
+		}
+	}
+	return (0);
+}
+
+static int is_ascii(const char *s)
+{
+	for (; *s != '\0'; s++) {
+		if ((unsigned char)*s >= 0x80)
+			return (0);
+	}
+	return (1);
+}
+
+/* Point the record of an entry at a new local header offset, either
+   in the record itself or in its ZIP64 extra field. */
+static void cdir_set_lho(struct cdir *cd, const struct cdir_entry *ce,
+			 zip_uint64_t lho)
+{
+	unsigned char *rec, *x, *end;
+	size_t off, len;
+
+	rec = cd->raw + ce->rec;
+	if (get32(rec + 42) != 0xffffffff) {
+		put32(rec + 42, (zip_uint32_t)lho);
+		return;
+	}
+
+	x = rec + CENTRAL_HDR_SIZE + get16(rec + 28);
+	end = x + get16(rec + 30);
+	for (; x + 4 <= end; x += 4 + len) {
+		len = get16(x + 2);
+		if (x + 4 + len > end)
+			return;
+		if (get16(x) != 0x0001)
+			continue;
+		off = 4;
+		if (get32(rec + 24) == 0xffffffff)
+			off += 8;
+		if (get32(rec + 20) == 0xffffffff)
+			off += 8;
+		if (off + 8 <= 4 + len)
+			put64(x + off, lho);
+		return;
+	}
+}
+
+/* Lay out the central directory for offset at: the kept records, with
+   new names where asked, then the end records and the comment. */
+static unsigned char *cdir_build(const struct cdir *cd, zip_uint64_t at,
+				 size_t *len)
+{
+	const struct cdir_entry *ce;
+	const unsigned char *rec;
+	unsigned char *buf, *p;
+	zip_uint64_t i, kept, size;
+	size_t nlen, old_nlen, total;
+	zip_uint16_t flags;
+	int zip64;
+
+	total = 0;
+	for (i = 0, kept = 0; i < cd->nentries; i++) {
+		ce = &cd->e[i];
+		if (ce->deleted)
+			continue;
+		total += ce->rec_len;
+		if (ce->new_name)
+			total += strlen(ce->new_name) - strlen(ce->name);
+		kept++;
+	}
+	size = total;
+
+	zip64 = cd->zip64 || kept >= 0xffff || size >= 0xffffffff ||
+		at >= 0xffffffff;
+	total += (zip64 ? EOCD64_SIZE + EOCD64_LOC_SIZE : 0) + EOCD_SIZE +
+		cd->comment_len;
+
+	buf = malloc(total);
+	if (buf == NULL)
+		return (NULL);
+
+	for (i = 0, p = buf; i < cd->nentries; i++) {
+		ce = &cd->e[i];
+		if (ce->deleted)
+			continue;
+
+		rec = cd->raw + ce->rec;
+		if (ce->new_name == NULL) {
+			memcpy(p, rec, ce->rec_len);
+			p += ce->rec_len;
+			continue;
+		}
+
+		/* Same record, but with another name in the middle. Names
+		   that aren't ASCII are marked as UTF-8 (bit 11). */
+		old_nlen = get16(rec + 28);
+		nlen = strlen(ce->new_name);
+		memcpy(p, rec, CENTRAL_HDR_SIZE);
+		flags = get16(rec + 8);
+		if (is_ascii(ce->new_name) == 0)
+			flags |= 1 << 11;
+		put16(p + 8, flags);
+		put16(p + 28, (zip_uint16_t)nlen);
+		memcpy(p + CENTRAL_HDR_SIZE, ce->new_name, nlen);
+		memcpy(p + CENTRAL_HDR_SIZE + nlen,
+		       rec + CENTRAL_HDR_SIZE + old_nlen,
+		       ce->rec_len - CENTRAL_HDR_SIZE - old_nlen);
+		p += ce->rec_len - old_nlen + nlen;
+	}
+
+	if (zip64) {
+		put32(p, SIG_EOCD64);
+		put64(p + 4, EOCD64_SIZE - 12);
+		put16(p + 12, 45);
+		put16(p + 14, 45);
+		put32(p + 16, 0);
+		put32(p + 20, 0);
+		put64(p + 24, kept);
+		put64(p + 32, kept);
+		put64(p + 40, size);
+		put64(p + 48, at);
+		p += EOCD64_SIZE;
+
+		put32(p, SIG_EOCD64_LOC);
+		put32(p + 4, 0);
+		put64(p + 8, at + size);
+		put32(p + 16, 1);
+		p += EOCD64_LOC_SIZE;
+	}
+
+	/* Values that don't fit are only in the ZIP64 record. */
+	put32(p, SIG_EOCD);
+	put16(p + 4, 0);
+	put16(p + 6, 0);
+	put16(p + 8, kept >= 0xffff ? 0xffff : (zip_uint16_t)kept);
+	put16(p + 10, kept >= 0xffff ? 0xffff : (zip_uint16_t)kept);
+	put32(p + 12, size >= 0xffffffff ? 0xffffffff : (zip_uint32_t)size);
+	put32(p + 16, at >= 0xffffffff ? 0xffffffff : (zip_uint32_t)at);
+	put16(p + 20, (zip_uint16_t)cd->comment_len);
+	memcpy(p + EOCD_SIZE, cd->comment, cd->comment_len);
+
+	*len = total;
+	return (buf);
+}
+
+/* Write the central directory again and cut the archive right after
+   it. The members themselves are not touched, so this costs as much
+   as the central directory, not the archive. The live one is never
+   overwritten: the new one is first written after the end of the
+   file, and only then moved back where the old one was, if it fits
+   before its copy. Wherever this stops, the archive ends with a
+   whole central directory. cd->offset is set to where it ends up. */
+static int cdir_write(int fd, struct cdir *cd)
+{
+	struct stat st;
+	unsigned char *buf, *copy;
+	zip_uint64_t end;
+	size_t len, clen;
+
+	if (fstat(fd, &st) == -1)
+		return (-1);
+	end = (zip_uint64_t)st.st_size;
+	buf = cdir_build(cd, cd->offset, &len);
+	if (buf == NULL)
+		return (-1);
+
+	if (end > cd->offset) {
+		copy = cdir_build(cd, end, &clen);
+		if (copy == NULL || pwrite_full(fd, copy, clen, end) == -1 ||
+		    fsync(fd) == -1) {
+			free(copy);
+			free(buf);
+			return (-1);
+		}
+		free(copy);
+
+		/* Too big to move back: the copy stays, and the old
+		   one is dead space until compact. Edits in place keep
+		   the size of the directory or shrink it, and a leaves
+		   room for the new one, so this is only a last resort:
+		   the dead directory would stop readers that go by the
+		   local headers. */
+		if (cd->offset + len > end) {
+			free(buf);
+			cd->offset = end;
+			return (0);
+		}
+	}
+
+	if (pwrite_full(fd, buf, len, cd->offset) == -1 || fsync(fd) == -1 ||
+	    ftruncate(fd, (off_t)(cd->offset + len)) == -1 ||
+	    fsync(fd) == -1) {
+		free(buf);
+		return (-1);
+	}
+	free(buf);
+	return (0);
+}
+
+/* Whether the local header of an entry has room for name, which then
+   takes the place of the old one. Readers check that it matches the
+   central directory, so a rename in place needs that. Returns 1 if it
+   has, 0 if not, and -1 if it can't be read. */
+static int cdir_local_name_fits(int fd, const struct cdir_entry *ce,
+				const char *name)
+{
+	unsigned char lh[LOCAL_HDR_SIZE];
+
+	if (pread_full(fd, lh, sizeof(lh), ce->lho) == -1 ||
+	    get32(lh) != SIG_LOCAL)
+		return (-1);
+	return (get16(lh + 26) == strlen(name));
+}
+
+/* Give the local header of a renamed entry the new name as well, see
+   cdir_local_name_fits(). */
+static int cdir_patch_local_name(int fd, const struct cdir_entry *ce)
+{
+	unsigned char lh[LOCAL_HDR_SIZE];
+	size_t nlen;
+	zip_uint16_t flags;
+
+	nlen = strlen(ce->new_name);
+	if (pread_full(fd, lh, sizeof(lh), ce->lho) == -1 ||
+	    get32(lh) != SIG_LOCAL)
+		return (-1);
+	if (get16(lh + 26) != nlen)
+		return (-1);
+
+	flags = get16(lh + 6);
+	if (is_ascii(ce->new_name) == 0 && (flags & 1 << 11) == 0) {
+		put16(lh + 6, flags | 1 << 11);
+		if (pwrite_full(fd, lh + 6, 2, ce->lho + 6) == -1)
+			return (-1);
+	}
+	return (pwrite_full(fd, ce->new_name, nlen,
+			    ce->lho + LOCAL_HDR_SIZE));
+}
+
+/* Size of everything that belongs to an entry in the archive: local
+   header, data and data descriptor. */
+static int cdir_entry_span(int fd, const struct cdir_entry *ce,
+			   zip_uint64_t *span)
+{
+	unsigned char lh[LOCAL_HDR_SIZE], *extra, *x, dd[4];
+	zip_uint64_t data;
+	size_t elen, len;
+	int zip64;
+
+	if (pread_full(fd, lh, sizeof(lh), ce->lho) == -1 ||
+	    get32(lh) != SIG_LOCAL)
+		return (-1);
+
+	elen = get16(lh + 28);
+	data = LOCAL_HDR_SIZE + get16(lh + 26) + elen;
+	*span = data + ce->comp_size;
+	if ((get16(lh + 6) & 1 << 3) == 0)
+		return (0);
+
+	/* The data descriptor has 64-bit sizes if the local header has
+	   a ZIP64 extra field, and may or may not have a signature. */
+	zip64 = 0;
+	extra = malloc(elen + 1);
+	if (extra == NULL ||
+	    pread_full(fd, extra, elen, ce->lho + data - elen) == -1) {
+		free(extra);
+		return (-1);
+	}
+	for (x = extra; x + 4 <= extra + elen; x += 4 + len) {
+		len = get16(x + 2);
+		if (x + 4 + len > extra + elen)
+			break;
+		if (get16(x) == 0x0001)
+			zip64 = 1;
+	}
+	free(extra);
+
+	if (pread_full(fd, dd, sizeof(dd), ce->lho + *span) == -1)
+		return (-1);
+	*span += (get32(dd) == SIG_DATA_DESC && ce->crc != SIG_DATA_DESC ?
+		  4 : 0) + 4 + (zip64 ? 16 : 8);
+	return (0);
+}
+
+/* Return the central directory entry of a job if its data can be
+   read straight from the archive: not encrypted, and matching what
+   libzip says about it. */
+static const struct cdir_entry *raw_entry(const struct unzip_ctx *ctx,
+					  const struct unzip_job *job)
+{
+	const struct cdir_entry *ce;
+
+	if (ctx->cd == NULL || job->idx >= ctx->cd->nentries ||
+	    job->zs.encryption_method != ZIP_EM_NONE)
+		return (NULL);
+
+	ce = &ctx->cd->e[job->idx];
+	if ((ce->flags & 1) || ce->method != job->zs.comp_method ||
+	    ce->comp_size != job->zs.comp_size ||
+	    ce->size != job->zs.size || ce->crc != job->zs.crc)
+		return (NULL);
+	return (ce);
+}
+
+/* Return the central directory entry of a job if its data can be
+   copied as it is. With --sparse, everything is looked at instead. */
+static const struct cdir_entry *stored_entry(const struct unzip_ctx *ctx,
+					     const struct unzip_job *job)
+{
+	if (ctx->opts->sparse || job->zs.comp_method != ZIP_CM_STORE)
+		return (NULL);
+	return (raw_entry(ctx, job));
+}
+
+/* Format a byte count for people, e.g. "1.5 MiB". */
+static const char *human_size(char *buf, size_t len, zip_uint64_t n)
+{
+	static const char *const units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	double v;
+	size_t u;
+
+	for (v = (double)n, u = 0; v >= 1024 && u + 1 < 5; u++)
+		v /= 1024;
+	if (u == 0)
+		snprintf(buf, len, "%llu B", (unsigned long long)n);
+	else
+		snprintf(buf, len, "%.1f %s", v, units[u]);
+	return (buf);
+}
+
+/* Phases as --stats names them. */
+static const char *const phase_names[PHASES] = {
+	"open", "stat", "prompt", "mkdir", "create", "inflate", "copy",
+	"write", "close"
+};
+
+/* Nanoseconds of the monotonic clock. */
+static zip_uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((zip_uint64_t)ts.tv_sec * 1000000000ULL +
+		(zip_uint64_t)ts.tv_nsec);
+}
+
+/* Start timing a phase. Without --stats st is NULL and the clock
+   is never read, which keeps the cost down to a test. */
+static zip_uint64_t stats_start(const struct unzip_stats *st)
+{
+	return (st ? clock_ns() : 0);
+}
+
+/* Count a phase started at t0. */
+static void stats_stop(struct unzip_stats *st, int phase, zip_uint64_t t0)
+{
+	if (st) {
+		st->ns[phase] += clock_ns() - t0;
+		st->calls[phase]++;
+	}
+}
+
+static int stats_bucket(zip_uint64_t v)
+{
+	int k;
+
+	for (k = 0; v != 0 && k < STATS_BUCKETS - 1; k++)
+		v >>= 1;
+	return (k);
+}
+
+/* Count an entry of size bytes, started at t0. */
+static void stats_entry(struct unzip_stats *st, zip_uint64_t size,
+			zip_uint64_t t0)
+{
+	zip_uint64_t ns;
+
+	if (st == NULL)
+		return;
+	ns = clock_ns() - t0;
+	st->entries++;
+	st->bytes += size;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	st->latency[stats_bucket(ns / 1000)]++;
+	st->size[stats_bucket(size)]++;
+}
+
+static void stats_add(struct unzip_stats *to, const struct unzip_stats *st)
+{
+	int k;
+
+	if (to == NULL || st == NULL)
+		return;
+	for (k = 0; k < PHASES; k++) {
+		to->ns[k] += st->ns[k];
+		to->calls[k] += st->calls[k];
+	}
+	for (k = 0; k < STATS_BUCKETS; k++) {
+		to->latency[k] += st->latency[k];
+		to->size[k] += st->size[k];
+	}
+	to->entries += st->entries;
+	to->bytes += st->bytes;
+	if (st->max_ns > to->max_ns)
+		to->max_ns = st->max_ns;
+}
+
+/* Format a duration in seconds as h:mm:ss. */
+static const char *human_eta(char *buf, size_t len, double secs)
+{
+	unsigned long s;
+
+	s = secs > 0 ? (unsigned long)(secs + 0.5) : 0;
+	snprintf(buf, len, "%lu:%02lu:%02lu", s / 3600, s / 60 % 60, s % 60);
+	return (buf);
+}
+
+/* Draw the progress line, with its lock held. The time left goes by
+   the bytes done so far, or by the files if there are no bytes. */
+static void progress_draw(const struct progress *pg, zip_uint64_t now)
+{
+	char b1[32], b2[32], b3[32], b4[32];
+	double secs, left;
+
+	secs = (double)(now - pg->start) / 1e9;
+	left = 0;
+	if (pg->total_bytes > 0 && pg->bytes > 0)
+		left = pg->total_bytes > pg->bytes ? secs *
+			(double)(pg->total_bytes - pg->bytes) /
+			(double)pg->bytes : 0;
+	else if (pg->files > 0)
+		left = secs * (double)(pg->total_files - pg->files) /
+			(double)pg->files;
+
+	fprintf(stderr, "%s %s: %llu/%llu files, %s of %s, %s/s, ETA %s%s",
+		pg->tty ? "\r" : "", pg->name,
+		(unsigned long long)pg->files,
+		(unsigned long long)pg->total_files,
+		human_size(b1, sizeof(b1), pg->bytes),
+		human_size(b2, sizeof(b2), pg->total_bytes),
+		human_size(b3, sizeof(b3), secs > 0 ?
+			   (zip_uint64_t)((double)pg->bytes / secs) : 0),
+		human_eta(b4, sizeof(b4), left), pg->tty ? "\033[K" : "\n");
+}
+
+/* Count files and bytes done, and draw the line if it is time. Any
+   thread may call it, the line is only drawn a few times a second. */
+static void progress_add(struct progress *pg, zip_uint64_t files,
+			 zip_uint64_t bytes)
+{
+	zip_uint64_t now;
+
+	pthread_mutex_lock(&pg->lock);
+	pg->files += files;
+	pg->bytes += bytes;
+	now = clock_ns();
+	if (now >= pg->next) {
+		progress_draw(pg, now);
+		pg->next = now + (pg->tty ? PROGRESS_NS : PROGRESS_LOG_NS);
+	}
+	pthread_mutex_unlock(&pg->lock);
+}
+
+/* Set the totals from the central directory, as planned in jobs. */
+static void progress_start(struct progress *pg, const char *name,
+			   const struct unzip_job *jobs, size_t njobs)
+{
+	size_t i;
+
+	pg->name = name;
+	pg->files = pg->bytes = 0;
+	pg->total_files = njobs;
+	for (i = 0, pg->total_bytes = 0; i < njobs; i++)
+		pg->total_bytes += jobs[i].zs.size;
+	pg->tty = isatty(STDERR_FILENO);
+	pg->start = pg->next = clock_ns();
+	pthread_mutex_init(&pg->lock, NULL);
+}
+
+/* Draw the line a last time, with everything done. */
+static void progress_end(struct progress *pg)
+{
+	progress_draw(pg, clock_ns());
+	if (pg->tty)
+		fputc('\n', stderr);
+	pthread_mutex_destroy(&pg->lock);
+}
+
+/* Count bytes of the entry being extracted by io. */
+static void progress_bytes(struct unzip_io *io, zip_uint64_t n)
+{
+	if (io->progress) {
+		progress_add(io->progress, 0, n);
+		io->counted += n;
+	}
+}
+
+/* Count an entry of size bytes as done, less what was counted of it
+   while it was inflated. */
+static void progress_entry(struct unzip_io *io, zip_uint64_t size)
+{
+	if (io->progress) {
+		progress_add(io->progress, 1,
+			     size > io->counted ? size - io->counted : 0);
+		io->counted = 0;
+	}
+}
+
+/* warn() and warnx() to fd rather than our standard error, for what
+   may run for a client of serve. The line is written at once, so the
+   lines of different threads don't get mixed up. */
+static void vdwarn(int fd, int errnum, const char *fmt, va_list ap)
+{
+	char msg[1024];
+
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	if (errnum)
+		dprintf(fd, "%s: %s: %s\n", program_invocation_short_name,
+			msg, strerror(errnum));
+	else
+		dprintf(fd, "%s: %s\n", program_invocation_short_name, msg);
+}
+
+static void dwarn(int fd, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static void dwarnx(int fd, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void dwarn(int fd, const char *fmt, ...)
+{
+	va_list ap;
+	int errnum;
+
+	errnum = errno;
+	va_start(ap, fmt);
+	vdwarn(fd, errnum, fmt, ap);
+	va_end(ap);
+}
+
+static void dwarnx(int fd, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vdwarn(fd, 0, fmt, ap);
+	va_end(ap);
+}
+
+/* Write all of buf, continuing after short writes. */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p;
+	ssize_t n;
+
+	for (p = buf; len > 0; p += n, len -= (size_t)n) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno != EINTR)
+				return (-1);
+			n = 0;
+		}
+	}
+	return (0);
+}
+
+/* Whether a block is all zeros. The words are or'ed together eight
+   at a time, which compilers turn into vector instructions; buf has
+   to be aligned to a word. */
+static int is_zero_block(const void *buf, size_t len)
+{
+	const unsigned long *w;
+	const unsigned char *p;
+	unsigned long acc;
+	size_t i, n;
+
+	w = buf;
+	n = len / sizeof(*w);
+	for (i = 0, acc = 0; i + 8 <= n; i += 8) {
+		acc |= w[i] | w[i + 1] | w[i + 2] | w[i + 3] |
+			w[i + 4] | w[i + 5] | w[i + 6] | w[i + 7];
+		if (acc != 0)
+			return (0);
+	}
+	for (; i < n; i++)
+		acc |= w[i];
+	p = (const unsigned char *)(w + n);
+	for (; p < (const unsigned char *)buf + len; p++)
+		acc |= *p;
+	return (acc == 0);
+}
+
+/* Write buf, seeking over the blocks of zeros in it instead of writing
+   them, so they become holes. The caller sets the size of the file at
+   the end, in case it ends with a hole. */
+static int write_sparse(int fd, const char *buf, size_t len,
+			zip_uint64_t *holes)
+{
+	size_t off, end;
+	int zero;
+
+	for (off = 0; off < len; off = end) {
+		zero = len - off >= SPARSE_BLOCK &&
+			is_zero_block(buf + off, SPARSE_BLOCK);
+		/* Take every following block of the same kind along. */
+		for (end = off + SPARSE_BLOCK; end < len; end += SPARSE_BLOCK) {
+			if (len - end < SPARSE_BLOCK)
+				break;
+			if (is_zero_block(buf + end, SPARSE_BLOCK) != zero)
+				break;
+		}
+		if (end > len || (zero == 0 && len - end < SPARSE_BLOCK))
+			end = len;
+
+		if (zero == 0) {
+			if (write_all(fd, buf + off, end - off) == -1)
+				return (-1);
+		} else {
+			if (lseek(fd, (off_t)(end - off), SEEK_CUR) == -1)
+				return (-1);
+			*holes += end - off;
+		}
+	}
+	return (0);
+}
+
+/* Move len bytes at off of the archive to the current position of
+   fd without bringing them to user space. copy_file_range() is tried
+   first, which on XFS and btrfs may also share the blocks (reflink)
+   instead of copying them, then sendfile(), and at last a plain
+   read()/write() loop. */
+static int copy_archive_range(int zfd, zip_uint64_t off, int fd,
+			      zip_uint64_t len, const struct unzip_io *io)
+{
+	off_t in;
+	ssize_t n;
+	size_t chunk;
+	int how;
+
+	in = (off_t)off;
+	how = 0;
+	while (len > 0) {
+		chunk = len > (zip_uint64_t)SSIZE_MAX ? SSIZE_MAX : (size_t)len;
+		switch (how) {
+		case 0:
+			n = copy_file_range(zfd, &in, fd, NULL, chunk, 0);
+			break;
+		case 1:
+			n = sendfile(fd, zfd, &in, chunk);
+			break;
+		default:
+			n = pread(zfd, io->buf[0], chunk < io->size ?
+				  chunk : io->size, in);
+			if (n > 0) {
+				if (write_all(fd, io->buf[0], (size_t)n) == -1)
+					return (-1);
+				in += n;
+			}
+			break;
+		}
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			/* The kernel or filesystem can't do it this way. */
+			if (how < 2 && (errno == EXDEV || errno == EINVAL ||
+					errno == ENOSYS || errno == EOPNOTSUPP ||
+					errno == EBADF)) {
+				how++;
+				continue;
+			}
+			return (-1);
+		}
+		if (n == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		len -= (zip_uint64_t)n;
+	}
+	return (0);
+}
+
+#ifdef HAVE_CLMUL
+/* CRC-32 of len bytes, folding 64 bytes at a time with PCLMULQDQ as
+   in Intel's "Fast CRC Computation for Generic Polynomials Using
+   PCLMULQDQ Instruction", with the constants of Chromium's zlib. crc
+   is taken and returned inverted, len is at least 64 and a multiple
+   of 16. */
+__attribute__((target("pclmul,sse4.1")))
+static zip_uint32_t crc32_clmul(const unsigned char *buf, size_t len,
+				zip_uint32_t crc)
+{
+	static const zip_uint64_t __attribute__((aligned(16)))
+		k1k2[] = { 0x0154442bd4ULL, 0x01c6e41596ULL },
+		k3k4[] = { 0x01751997d0ULL, 0x00ccaa009eULL },
+		k5k0[] = { 0x0163cd6124ULL, 0x0000000000ULL },
+		poly[] = { 0x01db710641ULL, 0x01f7011641ULL };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	/* Fold four blocks of 16 in parallel. */
+	for (; len >= 64; buf += 64, len -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+	}
+
+	/* Fold the four into one. */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold the blocks of 16 that are left. */
+	for (; len >= 16; buf += 16, len -= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	}
+
+	/* Fold 128 bits to 64. */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits. */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return ((zip_uint32_t)_mm_extract_epi32(x1, 1));
+}
+#endif
+
+/* Same as crc32() of zlib, but with crc32_clmul() for the bulk of
+   the data when the processor can do it. */
+static uLong crc32_fast(uLong crc, const unsigned char *buf, size_t len)
+{
+#ifdef HAVE_CLMUL
+	size_t n;
+
+	if (len >= 64 && __builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1")) {
+		n = len & ~(size_t)15;
+		crc = ~crc32_clmul(buf, n, ~(zip_uint32_t)crc);
+		buf += n;
+		len -= n;
+	}
+#endif
+	for (; len > UINT_MAX; buf += UINT_MAX, len -= UINT_MAX)
+		crc = crc32(crc, buf, UINT_MAX);
+	return (crc32(crc, buf, (uInt)len));
+}
+
+/* Compute the crc of what was written to fd, for entries whose data
+   never went through our own buffers. */
+static int crc_of_fd(int fd, zip_uint64_t len, const struct unzip_io *io,
+		     zip_uint32_t *crc)
+{
+	zip_uint64_t off;
+	ssize_t n;
+	uLong c;
+
+	c = crc32(0L, Z_NULL, 0);
+	for (off = 0; off < len; off += (zip_uint64_t)n) {
+		n = pread(fd, io->buf[0], len - off < io->size ?
+			  (size_t)(len - off) : io->size, (off_t)off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			return (-1);
+		c = crc32_fast(c, (const unsigned char *)io->buf[0], (size_t)n);
+	}
+	*crc = (zip_uint32_t)c;
+	return (0);
+}
+
+/* Whether a file on the disk looks like an entry, see --update. */
+static int same_file(const struct stat *st, const zip_stat_t *zs)
+{
+	return (S_ISREG(st->st_mode) && (zs->valid & ZIP_STAT_SIZE) &&
+		(zs->valid & ZIP_STAT_MTIME) &&
+		(zip_uint64_t)st->st_size == zs->size &&
+		st->st_mtime == zs->mtime);
+}
+
+/* Open the directory of path below dfd one component at a time,
+   never following a symbolic link, and point *leaf to the last
+   component. This is for paths that dircache_place() leaves whole
+   because their directory isn't kept open. Returns dfd itself if
+   path has no slash, otherwise an fd to close with close_beneath(),
+   or -1. */
+static int open_beneath(int dfd, const char *path, const char **leaf)
+{
+	const char *p, *slash;
+	char part[NAME_MAX + 1];
+	size_t len;
+	int fd, next, e;
+
+	fd = dfd;
+	for (p = path; (slash = strchr(p, '/')) != NULL; p = slash + 1) {
+		len = (size_t)(slash - p);
+		next = -1;
+		if (len > NAME_MAX) {
+			errno = ENAMETOOLONG;
+		} else {
+			memcpy(part, p, len);
+			part[len] = '\0';
+			next = openat(fd, part, O_RDONLY | O_DIRECTORY |
+				      O_NOFOLLOW | O_CLOEXEC);
+		}
+		if (fd != dfd) {
+			e = errno;
+			close(fd);
+			errno = e;
+		}
+		if (next == -1)
+			return (-1);
+		fd = next;
+	}
+	*leaf = p;
+	return (fd);
+}
+
+/* Close what open_beneath() opened, keeping errno. */
+static void close_beneath(int fd, int dfd)
+{
+	int e;
+
+	if (fd >= 0 && fd != dfd) {
+		e = errno;
+		close(fd);
+		errno = e;
+	}
+}
+
+/* fstatat() of a path below dfd, through open_beneath(). */
+static int stat_beneath(int dfd, const char *path, struct stat *st)
+{
+	const char *leaf;
+	int fd, ret;
+
+	fd = open_beneath(dfd, path, &leaf);
+	if (fd == -1)
+		return (-1);
+	ret = fstatat(fd, leaf, st, AT_SYMLINK_NOFOLLOW);
+	close_beneath(fd, dfd);
+	return (ret);
+}
+
+/* Whether the file of a job already holds its data, by its crc. */
+static int same_data(const struct unzip_job *job, const struct unzip_io *io)
+{
+	zip_uint32_t crc;
+	const char *leaf;
+	int dfd, fd, ret;
+
+	dfd = open_beneath(job->dfd, job->leaf, &leaf);
+	if (dfd == -1)
+		return (0);
+	fd = openat(dfd, leaf, O_RDONLY | O_NOFOLLOW);
+	close_beneath(dfd, job->dfd);
+	if (fd == -1)
+		return (0);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	ret = crc_of_fd(fd, job->zs.size, io, &crc) == 0 &&
+		crc == job->zs.crc;
+	close(fd);
+	return (ret);
+}
+
+/* Give an extracted file the modification time of its entry, which
+   is what tells --update later that it is unchanged. Without fd, the
+   file is looked up by name. */
+static void stamp_mtime(int fd, const struct unzip_job *job)
+{
+	struct timespec ts[2];
+
+	if ((job->zs.valid & ZIP_STAT_MTIME) == 0)
+		return;
+	ts[0].tv_sec = 0;
+	ts[0].tv_nsec = UTIME_OMIT;
+	ts[1].tv_sec = job->zs.mtime;
+	ts[1].tv_nsec = 0;
+	if (fd != -1)
+		futimens(fd, ts);
+	else
+		utimensat(job->dfd, job->leaf, ts, AT_SYMLINK_NOFOLLOW);
+}
+
+/* Ask for a new path for a file that already exists. Returns a
+   newly allocated path, or NULL if standard input is unusable. */
+static char *take_rename_path(void)
+{
+	char *renm;
+	size_t alen;
+
+	for (;;) {
+		fputs("new name: ", stdout);
+		fflush(stdout);
+
+		/* Take standard input from the terminal/tty. */
+		renm = take_stdin_rename();
+		if (renm == NULL)
+			return (NULL);
+
+		/* Check if string length is zero. */
+		alen = strlen(renm);
+		if (alen == 0) {
+			fputs("path name cannot be empty.\n", stderr);
+			free(renm);
+			continue;
+		}
+
+		/* Check if a same file exists with that input name. */
+		if (access(renm, F_OK) == 0) {
+			fprintf(stdout,
+				"similar file with name '%s' exists...\n",
+				renm);
+			free(renm);
+			continue;
+		}
+
+		/* Ignore inputs, that consists of a single or multiple spaces
+		   and no other keyword. Don't use isascii() as we don't know
+		   the locale.*/
+		if (ignore_only_spaces(renm) == 0) {
+			fputs("invalid path name.\n", stderr);
+			free(renm);
+			continue;
+		}
+
+		return (renm);
+	}
+}
+
+/* Copy a stored entry from the archive to fd, then check its crc
+   unless asked not to. */
+static int copy_stored_entry(const struct unzip_ctx *ctx,
+			     const struct unzip_job *job,
+			     const struct cdir_entry *ce, int fd,
+			     const struct unzip_io *io)
+{
+	zip_uint64_t off;
+	zip_uint32_t crc;
+
+	if (cdir_data_offset(ctx->zfd, ce, &off) == -1) {
+		dwarnx(io->err, "error: %s: %s", job->zs.name,
+		       zip_proper_error[ZIP_ER_NOZIP]);
+		return (-1);
+	}
+
+	if (copy_archive_range(ctx->zfd, off, fd, ce->size, io) == -1) {
+		dwarn(io->err, "copy_file_range(): %s", job->path);
+		return (-1);
+	}
+
+	if (ctx->opts->no_crc == 0) {
+		if (crc_of_fd(fd, ce->size, io, &crc) == -1) {
+			dwarn(io->err, "read(): %s", job->path);
+			return (-1);
+		}
+		if (crc != ce->crc) {
+			dwarnx(io->err, "error: %s: %s", job->zs.name,
+			       zip_proper_error[ZIP_ER_CRC]);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* Fill buf with want bytes of an open entry, telling err why not. */
+static int fill_buffer(zip_file_t *zfp, const struct unzip_job *job,
+		       char *buf, size_t want, int err)
+{
+	zip_int64_t reads;
+	size_t got;
+
+	for (got = 0; got < want; got += (size_t)reads) {
+		reads = zip_fread(zfp, buf + got, want - got);
+		if (reads <= 0) {
+			dwarnx(err, "error: %s: %s", job->zs.name, reads == 0 ?
+			       zip_proper_error[ZIP_ER_EOF] :
+			       zip_error_string(zip_file_get_error(zfp)));
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+#ifdef HAVE_IO_URING
+/* A minimal io_uring, driven through the raw system calls so that no
+   library is needed. Only one thread ever touches a given ring. */
+static int uring_setup(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	size_t sq_len, cq_len;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1)
+		return (-1);
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+
+	r->sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		close(r->fd);
+		return (-1);
+	}
+	r->sq_len = sq_len;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			munmap(r->sq_ptr, sq_len);
+			close(r->fd);
+			return (-1);
+		}
+	}
+	r->cq_len = cq_len;
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		if (r->cq_ptr != r->sq_ptr)
+			munmap(r->cq_ptr, cq_len);
+		munmap(r->sq_ptr, sq_len);
+		close(r->fd);
+		return (-1);
+	}
+
+	r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+	r->entries = p.sq_entries;
+	r->tail = *r->sq_tail;
+	return (0);
+}
+
+static void uring_free(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+}
+
+/* Check that the kernel knows every operation the backend uses. */
+static int uring_probe(struct uring *r)
+{
+	static const int ops[] = {
+		IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE,
+		IORING_OP_UNLINKAT,
+	};
+	struct io_uring_probe *probe;
+	size_t i, len;
+	int ok;
+
+	len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, len);
+	if (probe == NULL)
+		return (-1);
+
+	ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+		     probe, 256) == 0;
+	for (i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i] > probe->last_op ||
+		    (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+			ok = 0;
+	}
+	free(probe);
+	return (ok ? 0 : -1);
+}
+
+/* Get the next free submission entry, NULL if the ring is full. */
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+	    r->entries)
+		return (NULL);
+
+	idx = r->tail & *r->sq_mask;
+	r->sq_array[idx] = idx;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->tail++;
+	r->queued++;
+	return (sqe);
+}
+
+/* Submit everything queued and wait for at least nwait completions. */
+static int uring_submit(struct uring *r, unsigned nwait)
+{
+	long ret;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	for (;;) {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->queued, nwait,
+			      nwait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (ret >= 0)
+			break;
+		if (errno != EINTR)
+			return (-1);
+	}
+	r->queued -= (unsigned)ret < r->queued ? (unsigned)ret : r->queued;
+	return (0);
+}
+
+/* Take one completion, waiting for it if there is none yet. */
+static int uring_cqe(struct uring *r, zip_uint64_t *data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+
+	head = *r->cq_head;
+	while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (uring_submit(r, 1) == -1)
+			return (-1);
+	}
+
+	cqe = &r->cqes[head & *r->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+/* Tell whether the backend can be used at all on this kernel. */
+static int uring_usable(void)
+{
+	static int usable = -1;
+	struct uring r;
+
+	if (usable == -1) {
+		usable = 0;
+		if (uring_setup(&r, 8) == 0) {
+			usable = uring_probe(&r) == 0;
+			uring_free(&r);
+		}
+	}
+	return (usable);
+}
+
+static struct uring_batch *uring_batch_new(FILE *out)
+{
+	struct uring_batch *b;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		return (NULL);
+	b->out = out;
+
+	b->arena = malloc(URING_ARENA);
+	b->files = calloc(URING_BATCH, sizeof(*b->files));
+	if (b->arena == NULL || b->files == NULL ||
+	    uring_setup(&b->ring, URING_ENTRIES) == -1) {
+		free(b->arena);
+		free(b->files);
+		free(b);
+		return (NULL);
+	}
+	return (b);
+}
+
+static void uring_batch_free(struct uring_batch *b)
+{
+	if (b) {
+		uring_free(&b->ring);
+		free(b->arena);
+		free(b->files);
+		free(b);
+	}
+}
+
+/* Write out every queued file with two trips to the kernel: first
+   unlinkat + openat for all of them, then write + close. Failures are
+   told on err, see dwarn(). */
+static int uring_flush(struct uring_batch *b, int err)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_file *f;
+	zip_uint64_t data;
+	size_t i, n;
+	int res, ret;
+
+	if (b->nfiles == 0)
+		return (0);
+
+	/* The unlink is hard-linked to the open, so the file is still
+	   opened when there was nothing to remove. */
+	for (i = n = 0; i < b->nfiles; i++) {
+		f = &b->files[i];
+		f->fd = -1;
+		f->wres = 0;
+		f->cres = 0;
+		f->error = 0;
+		if (f->job->renamed == 0) {
+			sqe = uring_sqe(&b->ring);
+			sqe->opcode = IORING_OP_UNLINKAT;
+			sqe->fd = f->job->dfd;
+			sqe->addr = (zip_uint64_t)(uintptr_t)f->job->leaf;
+			sqe->flags = IOSQE_IO_HARDLINK;
+			sqe->user_data = i << 2 | URING_UNLINK;
+			n++;
+		}
+		sqe = uring_sqe(&b->ring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = f->job->dfd;
+		sqe->addr = (zip_uint64_t)(uintptr_t)f->job->leaf;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_NOFOLLOW;
+		sqe->len = 0644;
+		sqe->user_data = i << 2 | URING_OPEN;
+		n++;
+	}
+	if (uring_submit(&b->ring, 0) == -1)
+		return (-1);
+
+	for (; n > 0; n--) {
+		if (uring_cqe(&b->ring, &data, &res) == -1)
+			return (-1);
+		f = &b->files[data >> 2];
+		if ((data & 3) == URING_UNLINK) {
+			if (res < 0 && res != -ENOENT) {
+				errno = -res;
+				dwarn(err, "unlink()");
+				dprintf(err, "if unlink() failed to remove the older "
+					"files, you may notice corrupted output "
+					"files.\n");
+			}
+		} else if (res < 0) {
+			f->error = -res;
+			f->what = "open()";
+		} else {
+			f->fd = res;
+		}
+	}
+
+	/* A short write breaks the link and cancels the close, both
+	   are then finished below without the ring. */
+	for (i = n = 0; i < b->nfiles; i++) {
+		f = &b->files[i];
+		if (f->fd == -1)
+			continue;
+		if (f->len > 0) {
+			sqe = uring_sqe(&b->ring);
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = f->fd;
+			sqe->addr = (zip_uint64_t)(uintptr_t)(b->arena + f->off);
+			sqe->len = (unsigned)f->len;
+			sqe->off = 0;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = i << 2 | URING_WRITE;
+			n++;
+		}
+		sqe = uring_sqe(&b->ring);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = f->fd;
+		sqe->user_data = i << 2 | URING_CLOSE;
+		n++;
+	}
+	if (uring_submit(&b->ring, 0) == -1)
+		return (-1);
+
+	for (; n > 0; n--) {
+		if (uring_cqe(&b->ring, &data, &res) == -1)
+			return (-1);
+		f = &b->files[data >> 2];
+		if ((data & 3) == URING_WRITE)
+			f->wres = res;
+		else
+			f->cres = res;
+	}
+
+	for (i = 0; i < b->nfiles; i++) {
+		f = &b->files[i];
+		if (f->fd == -1)
+			continue;
+		if (f->wres >= 0 && (size_t)f->wres < f->len &&
+		    (lseek(f->fd, f->wres, SEEK_SET) == -1 ||
+		     write_all(f->fd, b->arena + f->off + f->wres,
+			       f->len - (size_t)f->wres) == -1))
+			f->wres = -errno;
+		if (f->wres < 0) {
+			f->error = -f->wres;
+			f->what = "write()";
+		}
+		if (f->cres == -ECANCELED)
+			f->cres = close(f->fd) == -1 ? -errno : 0;
+		if (f->cres < 0 && f->error == 0) {
+			f->error = -f->cres;
+			f->what = "close()";
+		}
+	}
+
+	for (i = 0, ret = 0; i < b->nfiles; i++) {
+		f = &b->files[i];
+		if (f->error) {
+			errno = f->error;
+			dwarn(err, "%s: %s", f->what, f->job->path);
+			ret = -1;
+		} else {
+			stamp_mtime(-1, f->job);
+			if (b->out)
+				fprintf(b->out, " inflating: %s .. [ok]\n",
+					f->job->label);
+		}
+	}
+
+	b->nfiles = 0;
+	b->used = 0;
+	return (ret);
+}
+
+/* Inflate a small entry into the batch, writing the batch out once
+   it is full. */
+static int uring_queue(struct uring_batch *b, zip_t *zip,
+		       const struct unzip_job *job, int err)
+{
+	struct uring_file *f;
+	zip_file_t *zfp;
+	zip_uint64_t t0;
+	int ret;
+
+	if (b->nfiles == URING_BATCH ||
+	    b->used + job->zs.size > URING_ARENA) {
+		t0 = stats_start(b->stats);
+		ret = uring_flush(b, err);
+		stats_stop(b->stats, PHASE_WRITE, t0);
+		if (ret == -1)
+			return (-1);
+	}
+
+	if (job->zs.encryption_method)
+		zfp = zip_fopen_index_encrypted(zip, job->idx, 0, job->passw);
+	else
+		zfp = zip_fopen_index(zip, job->idx, 0);
+	if (zfp == NULL) {
+		dwarnx(err, "error: %s: %s", job->zs.name,
+		       zip_error_string(zip_get_error(zip)));
+		return (-1);
+	}
+	t0 = stats_start(b->stats);
+	ret = fill_buffer(zfp, job, b->arena + b->used, (size_t)job->zs.size,
+			  err);
+	stats_stop(b->stats, PHASE_INFLATE, t0);
+	zip_fclose(zfp);
+	if (ret == -1)
+		return (-1);
+
+	f = &b->files[b->nfiles++];
+	f->job = job;
+	f->off = b->used;
+	f->len = (size_t)job->zs.size;
+	b->used += f->len;
+	return (0);
+}
+
+#else
+static int uring_usable(void)
+{
+	return (0);
+}
+#endif /* HAVE_IO_URING */
+
+static int io_alloc(struct unzip_io *io, const struct unzip_opts *opts,
+		    FILE *out)
+{
+	io->size = opts->bufsize;
+	io->writer = NULL;
+	io->sparse = opts->sparse;
+	memset(&io->tally, 0, sizeof(io->tally));
+	memset(&io->timing, 0, sizeof(io->timing));
+	io->stats = opts->stats ? &io->timing : NULL;
+	io->progress = NULL;
+	io->counted = 0;
+	io->err = STDERR_FILENO;
+	io->buf[0] = io->buf[1] = NULL;
+	if (posix_memalign((void **)&io->buf[0], ZBUF_ALIGN, io->size) != 0 ||
+	    posix_memalign((void **)&io->buf[1], ZBUF_ALIGN, io->size) != 0) {
+		free(io->buf[0]);
+		io->buf[0] = NULL;
+		return (-1);
+	}
+
+#ifdef HAVE_IO_URING
+	/* Without a ring, everything goes the synchronous way. */
+	io->batch = opts->io_uring ?
+		uring_batch_new(opts->quiet ? NULL : out) : NULL;
+	if (io->batch)
+		io->batch->stats = io->stats;
+#endif
+	return (0);
+}
+
+/* Write out what is still pending, then free everything. */
+static int io_free(struct unzip_io *io)
+{
+	struct unzip_writer *w;
+#ifdef HAVE_IO_URING
+	zip_uint64_t t0;
+#endif
+	int ret;
+
+	ret = 0;
+	if ((w = io->writer) != NULL) {
+		pthread_mutex_lock(&w->lock);
+		w->done = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->tid, NULL);
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+		io->writer = NULL;
+	}
+#ifdef HAVE_IO_URING
+	if (io->batch) {
+		t0 = stats_start(io->stats);
+		ret = uring_flush(io->batch, io->err);
+		stats_stop(io->stats, PHASE_WRITE, t0);
+		uring_batch_free(io->batch);
+	}
+#endif
+	free(io->buf[0]);
+	free(io->buf[1]);
+	return (ret);
+}
+
+/* Write every buffer handed over by inflate_entry(), in order, until
+   io_free(). After a failed write the remaining buffers of the entry
+   are only given back, so the other side never waits forever. */
+static void *unzip_writer_main(void *arg)
+{
+	struct unzip_writer *w;
+	zip_uint64_t t0;
+	int k, error;
+
+	w = arg;
+	t0 = 0;
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->full[w->next] == 0 && w->done == 0)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->full[w->next] == 0) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		k = w->next;
+		error = w->error;
+		pthread_mutex_unlock(&w->lock);
+
+		if (w->io->stats)
+			t0 = clock_ns();
+		if (error == 0 && (w->io->sparse ?
+			write_sparse(w->fd, w->io->buf[k], w->len[k],
+				     &w->holes) :
+			write_all(w->fd, w->io->buf[k], w->len[k])) == -1)
+			error = errno;
+		if (w->io->stats) {
+			w->write_ns += clock_ns() - t0;
+			w->writes++;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		w->error = error;
+		w->full[k] = 0;
+		w->next = k ^ 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return (NULL);
+}
+
+/* The writer thread of io, started the first time it is needed.
+   Returns NULL if there is none, then everything is written in turn. */
+static struct unzip_writer *io_writer(struct unzip_io *io)
+{
+	struct unzip_writer *w;
+
+	if (io->writer)
+		return (io->writer);
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		return (NULL);
+	w->io = io;
+	if (pthread_mutex_init(&w->lock, NULL) != 0) {
+		free(w);
+		return (NULL);
+	}
+	if (pthread_cond_init(&w->cond, NULL) != 0) {
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+		return (NULL);
+	}
+	if (pthread_create(&w->tid, NULL, unzip_writer_main, w) != 0) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+		return (NULL);
+	}
+	io->writer = w;
+	return (w);
+}
+
+/* Read an entry through libzip, decrypting and inflating it. Entries
+   bigger than a buffer are double buffered: the next buffer is being
+   inflated while the previous one is written by the writer thread. */
+static int inflate_entry(zip_t *zip, const struct unzip_job *job, int fd,
+			 struct unzip_io *io)
+{
+	struct unzip_writer *w;
+	zip_file_t *zfp;
+	zip_uint64_t bytes, t0;
+	size_t want;
+	int k, ret, error;
+
+	if (job->zs.encryption_method)
+		/* Open an encrypted zip file. */
+		zfp = zip_fopen_index_encrypted(zip, job->idx, 0, job->passw);
+	else
+		/* Open a generic zip file. */
+		zfp = zip_fopen_index(zip, job->idx, 0);
+	if (zfp == NULL) {
+		dwarnx(io->err, "error: %s: %s", job->zs.name,
+		       zip_error_string(zip_get_error(zip)));
+		return (-1);
+	}
+
+	/* Small entries, or no writer thread: read, then write. */
+	if (job->zs.size <= io->size || (w = io_writer(io)) == NULL) {
+		for (bytes = 0, ret = 0; ret == 0 && bytes != job->zs.size;
+		     bytes += want) {
+			want = job->zs.size - bytes < io->size ?
+				(size_t)(job->zs.size - bytes) : io->size;
+			t0 = stats_start(io->stats);
+			ret = fill_buffer(zfp, job, io->buf[0], want, io->err);
+			stats_stop(io->stats, PHASE_INFLATE, t0);
+			if (ret == -1)
+				break;
+			progress_bytes(io, want);
+			t0 = stats_start(io->stats);
+			if ((io->sparse ?
+			     write_sparse(fd, io->buf[0], want,
+					  &io->tally.holes) :
+			     write_all(fd, io->buf[0], want)) == -1) {
+				dwarn(io->err, "write(): %s", job->path);
+				ret = -1;
+			}
+			stats_stop(io->stats, PHASE_WRITE, t0);
+		}
+		zip_fclose(zfp);
+		return (ret);
+	}
+
+	/* Both buffers are empty between entries, so the writer is
+	   waiting and this entry can be set up under it. */
+	pthread_mutex_lock(&w->lock);
+	w->fd = fd;
+	w->next = 0;
+	w->error = 0;
+	w->holes = 0;
+	w->write_ns = 0;
+	w->writes = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	ret = error = 0;
+	for (bytes = 0, k = 0; bytes != job->zs.size; bytes += want, k ^= 1) {
+		/* Wait for the writer to give this buffer back. */
+		pthread_mutex_lock(&w->lock);
+		while (w->full[k])
+			pthread_cond_wait(&w->cond, &w->lock);
+		error = w->error;
+		pthread_mutex_unlock(&w->lock);
+		if (error)
+			break;
+
+		want = job->zs.size - bytes < io->size ?
+			(size_t)(job->zs.size - bytes) : io->size;
+		t0 = stats_start(io->stats);
+		ret = fill_buffer(zfp, job, io->buf[k], want, io->err);
+		stats_stop(io->stats, PHASE_INFLATE, t0);
+		if (ret == -1)
+			break;
+		progress_bytes(io, want);
+
+		pthread_mutex_lock(&w->lock);
+		w->len[k] = want;
+		w->full[k] = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	/* Wait until both buffers are back, the writer is then done
+	   with fd. */
+	pthread_mutex_lock(&w->lock);
+	while (w->full[0] || w->full[1])
+		pthread_cond_wait(&w->cond, &w->lock);
+	error = w->error;
+	pthread_mutex_unlock(&w->lock);
+	io->tally.holes += w->holes;
+	if (io->stats) {
+		io->stats->ns[PHASE_WRITE] += w->write_ns;
+		io->stats->calls[PHASE_WRITE] += w->writes;
+	}
+
+	if (error) {
+		errno = error;
+		dwarn(io->err, "write(): %s", job->path);
+		ret = -1;
+	}
+
+	zip_fclose(zfp);
+	return (ret);
+}
+
+/* Extract a single planned entry. Nothing here prompts, so it is safe
+   to call from a worker thread with that worker's own zip handle.
+   Returns 0 on success and -1 (after printing why) on failure. */
+static int extract_file_from_zip(zip_t *zip, const struct unzip_ctx *ctx,
+				 const struct unzip_job *job,
+				 struct unzip_io *io)
+{
+	const struct cdir_entry *ce;
+	zip_uint64_t t0;
+	const char *leaf;
+	int dfd, fd, ret;
+
+	/* The size and time are the same, the crc tells whether the
+	   data is as well. */
+	if (job->verify && same_data(job, io)) {
+		io->tally.skipped++;
+		io->tally.skipped_bytes += job->zs.size;
+		return (0);
+	}
+	io->tally.written++;
+	io->tally.written_bytes += job->zs.size;
+
+#ifdef HAVE_IO_URING
+	/* Small files are written out in batches by the ring, if their
+	   directory is open. */
+	if (io->batch && job->zs.size <= URING_FILE_MAX &&
+	    strchr(job->leaf, '/') == NULL)
+		return (uring_queue(io->batch, zip, job, io->err));
+#endif
+
+	t0 = stats_start(io->stats);
+	dfd = open_beneath(job->dfd, job->leaf, &leaf);
+	if (dfd == -1) {
+		dwarn(io->err, "open(): %s", job->path);
+		return (-1);
+	}
+
+	/* A renamed file gets a path that didn't exist when it was
+	   asked for, so there is nothing to remove. */
+	if (job->renamed == 0) {
+	        /* Remove the older file to not to cause data
+		   corruption by appending on the older file. */
+	        if (unlinkat(dfd, leaf, 0) == -1) {
+			if (errno != ENOENT) {
+				dwarn(io->err, "unlink()");
+				dprintf(io->err, "if unlink() failed to remove the "
+					"older files, you may notice corrupted "
+					"output files.\n");
+			}
+		}
+	}
+
+	/* Stored entries don't need libzip at all, their data is
+	   copied from the archive by the kernel. The file is opened
+	   for reading as well to check the crc afterwards. */
+	ce = stored_entry(ctx, job);
+
+	/* Open a file descriptor for writing. */
+	fd = openat(dfd, leaf, (ce ? O_RDWR : O_WRONLY) | O_CREAT |
+		    O_NOFOLLOW, 0644);
+	if (fd == -1)
+		dwarn(io->err, "open(): %s", job->path);
+	close_beneath(dfd, job->dfd);
+	if (fd == -1)
+		return (-1);
+
+	/* Reserve the whole file up front, so it is laid out in one piece
+	   and a full disk shows up before anything is inflated. Stored
+	   entries are left to the kernel, which may share their blocks
+	   instead, and sparse files would lose their holes. */
+	if (ce == NULL && io->sparse == 0 && job->zs.size >= PREALLOC_MIN &&
+	    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)job->zs.size) == -1 &&
+	    errno == ENOSPC) {
+		dwarn(io->err, "fallocate(): %s", job->path);
+		close(fd);
+		return (-1);
+	}
+	stats_stop(io->stats, PHASE_CREATE, t0);
+
+	if (ce) {
+		t0 = stats_start(io->stats);
+		ret = copy_stored_entry(ctx, job, ce, fd, io);
+		stats_stop(io->stats, PHASE_COPY, t0);
+	} else {
+		ret = inflate_entry(zip, job, fd, io);
+	}
+
+	/* A hole at the end is not written, so the size is set here. */
+	t0 = stats_start(io->stats);
+	if (ret == 0 && io->sparse &&
+	    ftruncate(fd, (off_t)job->zs.size) == -1) {
+		dwarn(io->err, "ftruncate(): %s", job->path);
+		ret = -1;
+	}
+	if (ret == 0)
+		stamp_mtime(fd, job);
+	close(fd);
+	stats_stop(io->stats, PHASE_CLOSE, t0);
+	if (ret == -1)
+		return (-1);
+
+	/* The whole line is printed once the file is done, so the
+	   lines of different workers don't get mixed up, and nothing
+	   is flushed for every file. */
+	if (ctx->opts->quiet == 0)
+		fprintf(ctx->out, " inflating: %s .. [ok]\n", job->label);
+	return (0);
+}
+
+/* Check an entry read straight from the archive, inflating it with
+   zlib. Returns NULL if it is fine, or what is wrong with it. */
+static const char *test_raw_entry(const struct unzip_ctx *ctx,
+				  const struct cdir_entry *ce,
+				  const struct unzip_io *io)
+{
+	z_stream z;
+	zip_uint64_t off, left, out;
+	const char *why;
+	size_t n;
+	uLong crc;
+	int zr;
+
+	if (cdir_data_offset(ctx->zfd, ce, &off) == -1)
+		return ("cannot read the local header");
+
+	crc = crc32(0L, Z_NULL, 0);
+	left = ce->comp_size;
+	out = 0;
+	if (ce->method == ZIP_CM_STORE) {
+		for (; left > 0; off += n, left -= n) {
+			n = left < io->size ? (size_t)left : io->size;
+			if (pread_full(ctx->zfd, io->buf[0], n, off) == -1)
+				return ("cannot read the data");
+			crc = crc32_fast(crc, (unsigned char *)io->buf[0], n);
+		}
+		return (crc != ce->crc ? "bad crc" : NULL);
+	}
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, -MAX_WBITS) != Z_OK)
+		return ("inflateInit2() failed");
+	why = NULL;
+	do {
+		if (z.avail_in == 0) {
+			if (left == 0) {
+				why = "the data is truncated";
+				break;
+			}
+			n = left < io->size ? (size_t)left : io->size;
+			if (pread_full(ctx->zfd, io->buf[0], n, off) == -1) {
+				why = "cannot read the data";
+				break;
+			}
+			z.next_in = (Bytef *)io->buf[0];
+			z.avail_in = (uInt)n;
+			off += n;
+			left -= n;
+		}
+		z.next_out = (Bytef *)io->buf[1];
+		z.avail_out = (uInt)io->size;
+		zr = inflate(&z, Z_NO_FLUSH);
+		if (zr != Z_OK && zr != Z_STREAM_END) {
+			why = "invalid compressed data";
+			break;
+		}
+		n = io->size - z.avail_out;
+		crc = crc32_fast(crc, (unsigned char *)io->buf[1], n);
+		out += n;
+	} while (zr != Z_STREAM_END);
+	inflateEnd(&z);
+
+	if (why == NULL && out != ce->size)
+		why = "wrong size";
+	if (why == NULL && crc != ce->crc)
+		why = "bad crc";
+	return (why);
+}
+
+/* Check an entry through libzip, for what test_raw_entry() can't
+   read: encrypted entries and other compression methods. */
+static const char *test_zip_entry(zip_t *zip, const struct unzip_job *job,
+				  const struct unzip_io *io)
+{
+	zip_file_t *zfp;
+	zip_uint64_t out;
+	zip_int64_t n;
+	uLong crc;
+	int ec;
+
+	if (job->zs.encryption_method)
+		zfp = zip_fopen_index_encrypted(zip, job->idx, 0, job->passw);
+	else
+		zfp = zip_fopen_index(zip, job->idx, 0);
+	if (zfp == NULL)
+		return (zip_error_string(zip_get_error(zip)));
+
+	crc = crc32(0L, Z_NULL, 0);
+	out = 0;
+	while ((n = zip_fread(zfp, io->buf[0], io->size)) > 0) {
+		crc = crc32_fast(crc, (unsigned char *)io->buf[0], (size_t)n);
+		out += (zip_uint64_t)n;
+	}
+	if (n == -1) {
+		/* libzip checks the crc itself at the end. */
+		ec = zip_error_code_zip(zip_file_get_error(zfp));
+		zip_fclose(zfp);
+		return (ec == ZIP_ER_CRC ? "bad crc" : "cannot inflate the data");
+	}
+	zip_fclose(zfp);
+
+	if (out != job->zs.size)
+		return ("wrong size");
+	if (crc != job->zs.crc)
+		return ("bad crc");
+	return (NULL);
+}
+
+/* Test a single planned entry for the t command. A broken entry is
+   counted and reported, but doesn't stop the others. */
+static int test_entry(zip_t *zip, const struct unzip_ctx *ctx,
+		      const struct unzip_job *job, struct unzip_io *io)
+{
+	const struct cdir_entry *ce;
+	const char *why;
+	zip_uint64_t t0;
+
+	t0 = stats_start(io->stats);
+	ce = raw_entry(ctx, job);
+	if (ce && (ce->method == ZIP_CM_STORE || ce->method == ZIP_CM_DEFLATE))
+		why = test_raw_entry(ctx, ce, io);
+	else
+		why = test_zip_entry(zip, job, io);
+	stats_stop(io->stats, PHASE_INFLATE, t0);
+
+	if (why) {
+		io->tally.failed++;
+		fprintf(ctx->out, " testing: %s .. [failed: %s]\n",
+			job->label, why);
+	} else {
+		io->tally.written++;
+		io->tally.written_bytes += job->zs.size;
+		if (ctx->opts->quiet == 0)
+			fprintf(ctx->out, " testing: %s .. [ok]\n",
+				job->label);
+	}
+	return (0);
+}
+
+/* Order jobs by what is known of their data, then by index. */
+static int job_cmp_payload(const void *a, const void *b)
+{
+	const struct unzip_job *ja, *jb;
+
+	ja = *(const struct unzip_job *const *)a;
+	jb = *(const struct unzip_job *const *)b;
+	if (ja->zs.size != jb->zs.size)
+		return (ja->zs.size < jb->zs.size ? -1 : 1);
+	if (ja->zs.crc != jb->zs.crc)
+		return (ja->zs.crc < jb->zs.crc ? -1 : 1);
+	if (ja->zs.comp_method != jb->zs.comp_method)
+		return (ja->zs.comp_method < jb->zs.comp_method ? -1 : 1);
+	if (ja->zs.comp_size != jb->zs.comp_size)
+		return (ja->zs.comp_size < jb->zs.comp_size ? -1 : 1);
+	return (ja->idx < jb->idx ? -1 : ja->idx > jb->idx);
+}
+
+/* Whether two entries hold the same bytes in the archive. Comparing
+   the compressed data is enough to know the files are the same, and
+   cheaper than inflating it. buf holds two chunks. */
+static int same_raw_data(const struct unzip_ctx *ctx,
+			 const struct cdir_entry *a,
+			 const struct cdir_entry *b, char *buf)
+{
+	zip_uint64_t oa, ob, left;
+	size_t n;
+
+	if (a->comp_size != b->comp_size ||
+	    cdir_data_offset(ctx->zfd, a, &oa) == -1 ||
+	    cdir_data_offset(ctx->zfd, b, &ob) == -1)
+		return (0);
+	for (left = a->comp_size; left > 0; left -= n, oa += n, ob += n) {
+		n = left < DEDUP_CHUNK ? (size_t)left : DEDUP_CHUNK;
+		if (pread_full(ctx->zfd, buf, n, oa) == -1 ||
+		    pread_full(ctx->zfd, buf + DEDUP_CHUNK, n, ob) == -1 ||
+		    memcmp(buf, buf + DEDUP_CHUNK, n) != 0)
+			return (0);
+	}
+	return (1);
+}
+
+/* Find the jobs whose data is the same as the data of an earlier
+   one: same size, crc and method, then the same compressed bytes.
+   Those are moved to the end of jobs, pointing at the file of the
+   first one, and their number is returned. */
+static size_t dedup_jobs(const struct unzip_ctx *ctx, struct unzip_job *jobs,
+			 size_t njobs)
+{
+	struct unzip_job **v, *tmp;
+	const struct cdir_entry *ce, *cp;
+	size_t i, k, p, n, ndups;
+	char *buf;
+
+	v = malloc(njobs * sizeof(*v));
+	buf = malloc(2 * DEDUP_CHUNK);
+	if (v == NULL || buf == NULL) {
+		free(v);
+		free(buf);
+		return (0);
+	}
+
+	for (i = n = 0; i < njobs; i++) {
+		jobs[i].same_leaf = NULL;
+		if (jobs[i].zs.size > 0 && jobs[i].verify == 0 &&
+		    raw_entry(ctx, &jobs[i]))
+			v[n++] = &jobs[i];
+	}
+	qsort(v, n, sizeof(*v), job_cmp_payload);
+
+	ndups = 0;
+	for (i = 0; i < n; i = k) {
+		for (k = i + 1; k < n && v[k]->zs.size == v[i]->zs.size &&
+			     v[k]->zs.crc == v[i]->zs.crc &&
+			     v[k]->zs.comp_method == v[i]->zs.comp_method &&
+			     v[k]->zs.comp_size == v[i]->zs.comp_size; k++) {
+			ce = raw_entry(ctx, v[k]);
+			for (p = i; p < k; p++) {
+				if (v[p]->same_leaf)
+					continue;
+				cp = raw_entry(ctx, v[p]);
+				if (same_raw_data(ctx, cp, ce, buf)) {
+					v[k]->same_dfd = v[p]->dfd;
+					v[k]->same_leaf = v[p]->leaf;
+					ndups++;
+					break;
+				}
+			}
+		}
+	}
+	free(buf);
+	free(v);
+
+	/* The leaves point into the paths, moving the jobs is fine. */
+	tmp = ndups ? malloc(njobs * sizeof(*tmp)) : NULL;
+	if (tmp == NULL) {
+		for (i = 0; i < njobs; i++)
+			jobs[i].same_leaf = NULL;
+		return (0);
+	}
+	for (i = k = 0; i < njobs; i++)
+		if (jobs[i].same_leaf == NULL)
+			tmp[k++] = jobs[i];
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].same_leaf)
+			tmp[k++] = jobs[i];
+	memcpy(jobs, tmp, njobs * sizeof(*jobs));
+	free(tmp);
+	return (ndups);
+}
+
+/* Create the file of a duplicate from the file with the same data,
+   once that one is written: as a hard link with --dedup-link, or as
+   a reflink sharing its blocks, or else a copy made by the kernel. */
+static int link_duplicate(struct unzip_ctx *ctx, const struct unzip_job *job,
+			  const struct unzip_io *io)
+{
+	const char *how, *leaf, *same_leaf;
+	int src, fd, dfd, same_dfd, ret;
+
+	dfd = open_beneath(job->dfd, job->leaf, &leaf);
+	same_dfd = open_beneath(job->same_dfd, job->same_leaf, &same_leaf);
+	if (dfd == -1 || same_dfd == -1) {
+		warn("open(): %s", job->path);
+		close_beneath(dfd, job->dfd);
+		close_beneath(same_dfd, job->same_dfd);
+		return (-1);
+	}
+
+	if (job->renamed == 0 && unlinkat(dfd, leaf, 0) == -1 &&
+	    errno != ENOENT)
+		warn("unlink()");
+
+	if (ctx->opts->dedup == DEDUP_LINK &&
+	    linkat(same_dfd, same_leaf, dfd, leaf, 0) == 0) {
+		close_beneath(dfd, job->dfd);
+		close_beneath(same_dfd, job->same_dfd);
+		how = "linking";
+		ctx->tally.shared_bytes += job->zs.size;
+		goto done;
+	}
+
+	src = openat(same_dfd, same_leaf, O_RDONLY | O_NOFOLLOW);
+	fd = src == -1 ? -1 : openat(dfd, leaf, O_WRONLY | O_CREAT | O_TRUNC |
+				     O_NOFOLLOW, 0644);
+	if (fd == -1)
+		warn("open(): %s", job->path);
+	close_beneath(dfd, job->dfd);
+	close_beneath(same_dfd, job->same_dfd);
+	if (fd == -1) {
+		if (src != -1)
+			close(src);
+		return (-1);
+	}
+
+	ret = -1;
+#ifdef FICLONE
+	ret = ioctl(fd, FICLONE, src);
+#endif
+	if (ret == 0) {
+		how = "cloning";
+		ctx->tally.shared_bytes += job->zs.size;
+	} else {
+		how = "copying";
+		ret = copy_archive_range(src, 0, fd, job->zs.size, io);
+	}
+	if (ret == 0)
+		stamp_mtime(fd, job);
+	close(src);
+	close(fd);
+	if (ret == -1) {
+		warn("copy_file_range(): %s", job->path);
+		return (-1);
+	}
+
+done:
+	ctx->tally.deduped++;
+	ctx->tally.deduped_bytes += job->zs.size;
+	ctx->tally.written++;
+	ctx->tally.written_bytes += job->zs.size;
+	if (ctx->opts->quiet == 0)
+		fprintf(ctx->out, " %s: %s .. [ok]\n", how, job->label);
+	return (0);
+}
+
+/* Create the files of the duplicates left out of the jobs. */
+static int run_dedup_jobs(struct unzip_ctx *ctx, const struct unzip_job *jobs,
+			  size_t njobs)
+{
+	struct unzip_io io;
+	size_t i;
+	int ret;
+
+	if (io_alloc(&io, ctx->opts, ctx->out) == -1) {
+		warn("posix_memalign()");
+		return (-1);
+	}
+	for (i = 0, ret = 0; i < njobs && ret == 0; i++)
+		ret = link_duplicate(ctx, &jobs[i], &io);
+	if (io_free(&io) == -1)
+		ret = -1;
+	return (ret);
+}
+
+/* Order jobs by compressed size, biggest first. Handing the big
+   ones out first keeps a single huge member from being picked up
+   last and leaving every other worker idle. */
+static int job_cmp_comp_size(const void *a, const void *b)
+{
+	const struct unzip_job *ja, *jb;
+
+	ja = a;
+	jb = b;
+	if (ja->zs.comp_size != jb->zs.comp_size)
+		return (ja->zs.comp_size < jb->zs.comp_size ? 1 : -1);
+	return (ja->idx < jb->idx ? -1 : ja->idx > jb->idx);
+}
+
+/* Order jobs by where their data is in the archive, so that it is
+   read from start to end. With workers, the few jobs that are bigger
+   than a worker's share go first, biggest first, or one of them
+   could be picked up last and leave every other worker idle. */
+static int job_cmp_offset(const void *a, const void *b)
+{
+	const struct unzip_job *ja, *jb;
+
+	ja = a;
+	jb = b;
+	if (ja->first != jb->first)
+		return (ja->first ? -1 : 1);
+	if (ja->first && ja->zs.comp_size != jb->zs.comp_size)
+		return (ja->zs.comp_size < jb->zs.comp_size ? 1 : -1);
+	if (ja->lho != jb->lho)
+		return (ja->lho < jb->lho ? -1 : 1);
+	return (ja->idx < jb->idx ? -1 : ja->idx > jb->idx);
+}
+
+/* Count the seeks reading the jobs in this order takes: jumping
+   back, or skipping more than a header could hold. */
+static size_t count_seeks(const struct unzip_job *jobs, size_t njobs,
+			  zip_uint64_t *dist)
+{
+	zip_uint64_t end, start;
+	size_t i, seeks;
+
+	seeks = 0;
+	*dist = 0;
+	for (i = 1; i < njobs; i++) {
+		end = jobs[i - 1].lho + LOCAL_HDR_SIZE +
+			strlen(jobs[i - 1].zs.name) + jobs[i - 1].zs.comp_size;
+		start = jobs[i].lho;
+		if (start < end || start > end + SEEK_SLACK) {
+			seeks++;
+			*dist += start < end ? end - start : start - end;
+		}
+	}
+	return (seeks);
+}
+
+/* Sort the jobs by data offset, and tell how much seeking that saves
+   over the order of the central directory. */
+static void schedule_unzip_jobs(const struct unzip_ctx *ctx,
+				struct unzip_job *jobs, size_t njobs,
+				long nthreads)
+{
+	zip_uint64_t total, before, after;
+	size_t i, seeks_before, seeks_after;
+	char b1[16];
+
+	if (ctx->cd == NULL) {
+		/* Without offsets, only the big jobs can go first. */
+		if (nthreads > 1)
+			qsort(jobs, njobs, sizeof(*jobs), job_cmp_comp_size);
+		return;
+	}
+
+	total = 0;
+	for (i = 0; i < njobs; i++) {
+		jobs[i].lho = jobs[i].idx < ctx->cd->nentries ?
+			ctx->cd->e[jobs[i].idx].lho : 0;
+		total += jobs[i].zs.comp_size;
+	}
+	for (i = 0; i < njobs; i++)
+		jobs[i].first = nthreads > 1 &&
+			jobs[i].zs.comp_size > total / (zip_uint64_t)nthreads;
+
+	seeks_before = count_seeks(jobs, njobs, &before);
+	qsort(jobs, njobs, sizeof(*jobs), job_cmp_offset);
+	seeks_after = count_seeks(jobs, njobs, &after);
+
+	if (seeks_after < seeks_before)
+		fprintf(ctx->out, " reading in archive order: %zu seek(s) "
+			"avoided, %s less seek distance.\n",
+			seeks_before - seeks_after,
+			human_size(b1, sizeof(b1),
+				   before > after ? before - after : 0));
+}
+
+/* Tell the kernel about the data the next jobs are going to read,
+   about RA_WINDOW bytes of it ahead of job cur. Neighbouring regions
+   go out as one request. The advice is about the page cache, so it
+   helps libzip's own reads as well as ours. */
+static void readahead_jobs(struct readahead *ra, size_t cur)
+{
+	const struct unzip_job *job;
+	zip_uint64_t from, to, len;
+
+	if (ra->fd == -1)
+		return;
+	if (cur < ra->next)
+		ra->ahead -= ra->ahead < ra->jobs[cur].zs.comp_size ?
+			ra->ahead : ra->jobs[cur].zs.comp_size;
+
+	from = to = 0;
+	for (; ra->next < ra->njobs && ra->ahead < RA_WINDOW; ra->next++) {
+		job = &ra->jobs[ra->next];
+		len = LOCAL_HDR_SIZE + strlen(job->zs.name) + job->zs.comp_size;
+		if (to != 0 && (job->lho < from || job->lho > to + SEEK_SLACK)) {
+			posix_fadvise(ra->fd, (off_t)from, (off_t)(to - from),
+				      POSIX_FADV_WILLNEED);
+			to = 0;
+		}
+		if (to == 0)
+			from = job->lho;
+		if (job->lho + len > to)
+			to = job->lho + len;
+		if (cur != ra->next)
+			ra->ahead += job->zs.comp_size;
+	}
+	if (to != 0)
+		posix_fadvise(ra->fd, (off_t)from, (off_t)(to - from),
+			      POSIX_FADV_WILLNEED);
+}
+
+static void tally_add(struct unzip_tally *to, const struct unzip_tally *t)
+{
+	to->written += t->written;
+	to->written_bytes += t->written_bytes;
+	to->skipped += t->skipped;
+	to->skipped_bytes += t->skipped_bytes;
+	to->holes += t->holes;
+	to->failed += t->failed;
+	to->deduped += t->deduped;
+	to->deduped_bytes += t->deduped_bytes;
+	to->shared_bytes += t->shared_bytes;
+}
+
+/* Tell what --update skipped and how much disk space --sparse saved. */
+static void report_tally(const struct unzip_ctx *ctx)
+{
+	const struct unzip_tally *t;
+	char b1[32], b2[32];
+
+	t = &ctx->tally;
+	if (ctx->opts->update)
+		fprintf(ctx->out, " %llu file(s) written (%s), "
+			"%llu unchanged skipped (%s).\n",
+			(unsigned long long)t->written,
+			human_size(b1, sizeof(b1), t->written_bytes),
+			(unsigned long long)t->skipped,
+			human_size(b2, sizeof(b2), t->skipped_bytes));
+	if (ctx->opts->sparse)
+		fprintf(ctx->out, " sparse: %s of zeros left as holes.\n",
+			human_size(b1, sizeof(b1), t->holes));
+
+	/* The time saved is a guess, at the rate the others took. */
+	if (ctx->opts->dedup)
+		fprintf(ctx->out, " dedup: %llu duplicate(s), %s not inflated "
+			"(about %.2f s), %s sharing blocks.\n",
+			(unsigned long long)t->deduped,
+			human_size(b1, sizeof(b1), t->deduped_bytes),
+			t->written_bytes > t->deduped_bytes ? ctx->secs *
+			(double)t->deduped_bytes /
+			(double)(t->written_bytes - t->deduped_bytes) : 0.0,
+			human_size(b2, sizeof(b2), t->shared_bytes));
+}
+
+/* Upper bound of the bucket the share p of the values falls in. */
+static zip_uint64_t stats_percentile(const zip_uint64_t *h, zip_uint64_t n,
+				     double p)
+{
+	zip_uint64_t seen;
+	int k;
+
+	for (k = 0, seen = 0; k < STATS_BUCKETS - 1; k++) {
+		seen += h[k];
+		if (n > 0 && (double)seen >= p * (double)n)
+			break;
+	}
+	return (k ? 1ULL << k : 1);
+}
+
+/* Format a duration in microseconds, e.g. "1.5 ms". */
+static const char *human_us(char *buf, size_t len, double us)
+{
+	if (us < 1000)
+		snprintf(buf, len, "%.0f us", us);
+	else if (us < 1e6)
+		snprintf(buf, len, "%.3g ms", us / 1e3);
+	else
+		snprintf(buf, len, "%.3g s", us / 1e6);
+	return (buf);
+}
+
+static void json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", (unsigned)*s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+/* The non-empty buckets of a histogram as a JSON array of [upper
+   bound, count] pairs. */
+static void json_histogram(FILE *out, const zip_uint64_t *h)
+{
+	const char *sep;
+	int k;
+
+	sep = "";
+	fputc('[', out);
+	for (k = 0; k < STATS_BUCKETS; k++) {
+		if (h[k] == 0)
+			continue;
+		fprintf(out, "%s[%llu,%llu]", sep,
+			(unsigned long long)(k ? 1ULL << k : 1),
+			(unsigned long long)h[k]);
+		sep = ",";
+	}
+	fputc(']', out);
+}
+
+/* Print a histogram with a bar per non-empty bucket, labelled by
+   what its values are below. */
+static void print_histogram(FILE *out, const char *what,
+			    const zip_uint64_t *h, int us)
+{
+	zip_uint64_t most;
+	char b[32];
+	int k, bar;
+
+	for (k = 0, most = 0; k < STATS_BUCKETS; k++)
+		if (h[k] > most)
+			most = h[k];
+	if (most == 0)
+		return;
+
+	fprintf(out, "  %s:\n", what);
+	for (k = 0; k < STATS_BUCKETS; k++) {
+		if (h[k] == 0)
+			continue;
+		if (us)
+			human_us(b, sizeof(b), k ? (double)(1ULL << k) : 1);
+		else
+			human_size(b, sizeof(b), k ? 1ULL << k : 1);
+		bar = (int)((h[k] * 40 + most - 1) / most);
+		fprintf(out, "   %s %10s %-40.*s %llu\n",
+			k == STATS_BUCKETS - 1 ? ">=" : "< ", b, bar,
+			"########################################",
+			(unsigned long long)h[k]);
+	}
+}
+
+/* Tell where the time of an archive went, with --stats. The phases
+   of every thread are summed, so with -j they may add up to more
+   than the time the archive took. */
+static void report_stats(const struct unzip_ctx *ctx, double secs)
+{
+	const struct unzip_stats *st;
+	zip_uint64_t total;
+	const char *sep;
+	char b1[32], b2[32], b3[32], b4[32];
+	int k;
+
+	st = ctx->stats;
+	if (st == NULL)
+		return;
+	for (k = 0, total = 0; k < PHASES; k++)
+		total += st->ns[k];
+
+	if (ctx->opts->stats == STATS_JSON) {
+		fputs("{\"archive\":", ctx->out);
+		json_string(ctx->out, ctx->zfile);
+		fprintf(ctx->out, ",\"seconds\":%.6f,\"threads\":%ld,"
+			"\"entries\":%llu,\"bytes\":%llu,\"max_entry_us\":%.1f,"
+			"\"phases\":{", secs, st->threads,
+			(unsigned long long)st->entries,
+			(unsigned long long)st->bytes, (double)st->max_ns / 1e3);
+		for (k = 0, sep = ""; k < PHASES; k++, sep = ",")
+			fprintf(ctx->out, "%s\"%s\":{\"calls\":%llu,"
+				"\"seconds\":%.6f}", sep, phase_names[k],
+				(unsigned long long)st->calls[k],
+				(double)st->ns[k] / 1e9);
+		fputs("},\"latency_us\":", ctx->out);
+		json_histogram(ctx->out, st->latency);
+		fputs(",\"size_bytes\":", ctx->out);
+		json_histogram(ctx->out, st->size);
+		fputs("}\n", ctx->out);
+		return;
+	}
+
+	fprintf(ctx->out, " stats: %llu entries (%s) in %.3f s on %ld "
+		"thread(s).\n", (unsigned long long)st->entries,
+		human_size(b1, sizeof(b1), st->bytes), secs, st->threads);
+	fprintf(ctx->out, "  %-8s %10s %10s %7s\n", "phase", "calls",
+		"seconds", "share");
+	for (k = 0; k < PHASES; k++)
+		fprintf(ctx->out, "  %-8s %10llu %10.3f %6.1f%%\n",
+			phase_names[k], (unsigned long long)st->calls[k],
+			(double)st->ns[k] / 1e9, total ? 100.0 *
+			(double)st->ns[k] / (double)total : 0.0);
+	if (st->entries == 0)
+		return;
+	fprintf(ctx->out, "  latency: p50 < %s, p90 < %s, p99 < %s, "
+		"max %s.\n",
+		human_us(b1, sizeof(b1), (double)stats_percentile(
+			st->latency, st->entries, 0.5)),
+		human_us(b2, sizeof(b2), (double)stats_percentile(
+			st->latency, st->entries, 0.9)),
+		human_us(b3, sizeof(b3), (double)stats_percentile(
+			st->latency, st->entries, 0.99)),
+		human_us(b4, sizeof(b4), (double)st->max_ns / 1e3));
+	print_histogram(ctx->out, "entry latency", st->latency, 1);
+	print_histogram(ctx->out, "entry size", st->size, 0);
+}
+
+static void *unzip_worker(void *arg)
+{
+	struct unzip_pool *pool;
+	struct unzip_io io;
+	zip_t *zip;
+	zip_uint64_t t0;
+	size_t n;
+	int eptr, ret;
+
+	pool = arg;
+	if (io_alloc(&io, pool->ctx->opts, pool->ctx->out) == -1) {
+		warn("posix_memalign()");
+		pthread_mutex_lock(&pool->lock);
+		pool->failed = 1;
+		pthread_mutex_unlock(&pool->lock);
+		return (NULL);
+	}
+	io.progress = pool->ctx->progress;
+
+	/* libzip handles are not thread-safe, every worker has its own. */
+	t0 = stats_start(io.stats);
+	zip = zip_open(pool->ctx->zfile, ZIP_RDONLY, &eptr);
+	stats_stop(io.stats, PHASE_OPEN, t0);
+	if (zip == NULL) {
+		warnx("error: %s", zip_proper_error[eptr]);
+		io_free(&io);
+		pthread_mutex_lock(&pool->lock);
+		pool->failed = 1;
+		pthread_mutex_unlock(&pool->lock);
+		return (NULL);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->failed || pool->next == pool->njobs) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		n = pool->next++;
+		readahead_jobs(&pool->ra, n);
+		pthread_mutex_unlock(&pool->lock);
+
+		t0 = stats_start(io.stats);
+		ret = (pool->ctx->opts->test ? test_entry :
+		       extract_file_from_zip)(zip, pool->ctx, &pool->jobs[n],
+					      &io);
+		stats_entry(io.stats, pool->jobs[n].zs.size, t0);
+		progress_entry(&io, pool->jobs[n].zs.size);
+		if (ret == -1) {
+			pthread_mutex_lock(&pool->lock);
+			pool->failed = 1;
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+	}
+
+	zip_close(zip);
+	ret = io_free(&io);
+	pthread_mutex_lock(&pool->lock);
+	tally_add(&pool->tally, &io.tally);
+	stats_add(pool->ctx->stats, io.stats);
+	if (ret == -1)
+		pool->failed = 1;
+	pthread_mutex_unlock(&pool->lock);
+	return (NULL);
+}
+
+/* Run all planned jobs, either one after another on the already
+   opened archive, or on a pool of worker threads. */
+static int run_unzip_jobs(zip_t *zip, struct unzip_ctx *ctx,
+			  struct unzip_job *jobs, size_t njobs)
+{
+	struct unzip_pool pool;
+	struct unzip_io io;
+	struct readahead ra;
+	struct progress pg;
+	pthread_t *tids;
+	zip_uint64_t t0;
+	size_t i;
+	long t, started, nthreads;
+	int ret;
+
+	nthreads = ctx->opts->jobs;
+	if (nthreads > (long)njobs)
+		nthreads = (long)njobs;
+
+	schedule_unzip_jobs(ctx, jobs, njobs, nthreads);
+	ra.fd = ctx->cd ? ctx->zfd : -1;
+	ra.jobs = jobs;
+	ra.njobs = njobs;
+	ra.next = 0;
+	ra.ahead = 0;
+
+	if (ctx->stats)
+		ctx->stats->threads = nthreads > 1 ? nthreads : 1;
+	ctx->progress = NULL;
+	if (ctx->opts->progress) {
+		progress_start(&pg, pathbase(ctx->zfile), jobs, njobs);
+		ctx->progress = &pg;
+	}
+
+	if (nthreads <= 1) {
+		if (io_alloc(&io, ctx->opts, ctx->out) == -1) {
+			warn("posix_memalign()");
+			ret = -1;
+			goto done;
+		}
+		io.progress = ctx->progress;
+		for (i = 0, ret = 0; i < njobs && ret == 0; i++) {
+			readahead_jobs(&ra, i);
+			t0 = stats_start(io.stats);
+			ret = (ctx->opts->test ? test_entry :
+			       extract_file_from_zip)(zip, ctx, &jobs[i], &io);
+			stats_entry(io.stats, jobs[i].zs.size, t0);
+			progress_entry(&io, jobs[i].zs.size);
+		}
+		if (io_free(&io) == -1)
+			ret = -1;
+		tally_add(&ctx->tally, &io.tally);
+		stats_add(ctx->stats, io.stats);
+		goto done;
+	}
+
+	tids = calloc((size_t)nthreads, sizeof(*tids));
+	if (tids == NULL) {
+		warn("calloc()");
+		ret = -1;
+		goto done;
+	}
+
+	pool.ctx = ctx;
+	pool.jobs = jobs;
+	pool.njobs = njobs;
+	pool.next = 0;
+	pool.ra = ra;
+	pool.failed = 0;
+	memset(&pool.tally, 0, sizeof(pool.tally));
+	pthread_mutex_init(&pool.lock, NULL);
+
+	started = 0;
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&tids[t], NULL, unzip_worker, &pool) != 0) {
+			warnx("pthread_create(): cannot start worker %ld", t);
+			break;
+		}
+		started++;
+	}
+
+	/* If not a single worker could be started, do it ourselves. */
+	if (started == 0)
+		unzip_worker(&pool);
+
+	for (t = 0; t < started; t++)
+		pthread_join(tids[t], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+	free(tids);
+	tally_add(&ctx->tally, &pool.tally);
+	ret = pool.failed ? -1 : 0;
+
+done:
+	if (ctx->progress) {
+		progress_end(ctx->progress);
+		ctx->progress = NULL;
+	}
+	return (ret);
+}
+
+static void free_unzip_jobs(struct unzip_job *jobs, size_t njobs)
+{
+	size_t i;
+
+	for (i = 0; i < njobs; i++)
+		free(jobs[i].path);
+	free(jobs);
+}
+
+/* FNV-1a, used for every table of names. */
+static zip_uint64_t name_hash(const char *s)
+{
+	zip_uint64_t h;
+
+	for (h = 0xcbf29ce484222325ULL; *s != '\0'; s++) {
+		h ^= (unsigned char)*s;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+/* Open addressing table from names to a value. The names are not
+   copied, they have to outlive the table. */
+static int nametab_init(struct nametab *t, size_t n)
+{
+	t->cap = 16;
+	while (t->cap < n * 2)
+		t->cap *= 2;
+	t->len = 0;
+	t->slots = calloc(t->cap, sizeof(*t->slots));
+	return (t->slots == NULL ? -1 : 0);
+}
+
+static void nametab_free(struct nametab *t)
+{
+	free(t->slots);
+	t->slots = NULL;
+}
+
+static struct nameslot *nametab_slot(const struct nametab *t, const char *key,
+				     zip_uint64_t h)
+{
+	struct nameslot *s;
+	size_t i;
+
+	for (i = (size_t)h & (t->cap - 1);; i = (i + 1) & (t->cap - 1)) {
+		s = &t->slots[i];
+		if (s->key == NULL || (s->hash == h && strcmp(s->key, key) == 0))
+			return (s);
+	}
+}
+
+static int nametab_grow(struct nametab *t)
+{
+	struct nameslot *old, *s;
+	size_t i, cap;
+
+	old = t->slots;
+	cap = t->cap;
+	t->slots = calloc(cap * 2, sizeof(*t->slots));
+	if (t->slots == NULL) {
+		t->slots = old;
+		return (-1);
+	}
+	t->cap = cap * 2;
+	for (i = 0; i < cap; i++) {
+		if (old[i].key) {
+			s = nametab_slot(t, old[i].key, old[i].hash);
+			*s = old[i];
+		}
+	}
+	free(old);
+	return (0);
+}
+
+/* Add a name, unless it is already there. Returns its slot either
+   way, or NULL if memory ran out. */
+static struct nameslot *nametab_put(struct nametab *t, const char *key,
+				    zip_uint64_t val)
+{
+	struct nameslot *s;
+	zip_uint64_t h;
+
+	if ((t->len + 1) * 2 > t->cap && nametab_grow(t) == -1)
+		return (NULL);
+
+	h = name_hash(key);
+	s = nametab_slot(t, key, h);
+	if (s->key == NULL) {
+		s->key = key;
+		s->hash = h;
+		s->val = val;
+		t->len++;
+	}
+	return (s);
+}
+
+static struct nameslot *nametab_get(const struct nametab *t, const char *key)
+{
+	struct nameslot *s;
+
+	if (t->len == 0)
+		return (NULL);
+	s = nametab_slot(t, key, name_hash(key));
+	return (s->key ? s : NULL);
+}
+
+static int strlist_add(struct strlist *l, char *s)
+{
+	char **v;
+
+	if (l->n == l->max) {
+		l->max = l->max ? l->max * 2 : 16;
+		v = realloc(l->v, l->max * sizeof(*l->v));
+		if (v == NULL)
+			return (-1);
+		l->v = v;
+	}
+	l->v[l->n++] = s;
+	return (0);
+}
+
+/* Free the list, including the strings it owns. */
+static void strlist_free(struct strlist *l)
+{
+	size_t i;
+
+	for (i = 0; i < l->n; i++) {
+		if (l->owned)
+			free(l->v[i]);
+	}
+	free(l->v);
+	l->v = NULL;
+	l->n = l->max = 0;
+}
+
+/* Add every non-empty line of a manifest file to the list. */
+static int read_manifest(const char *path, struct strlist *l)
+{
+	FILE *fp;
+	char *line, *s;
+	size_t cap;
+	ssize_t len;
+
+	fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (fp == NULL)
+		return (-1);
+
+	line = NULL;
+	cap = 0;
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' ||
+				   line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+
+		s = strdup(line);
+		if (s == NULL || strlist_add(l, s) == -1) {
+			free(s);
+			free(line);
+			if (fp != stdin)
+				fclose(fp);
+			errno = ENOMEM;
+			return (-1);
+		}
+	}
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return (0);
+}
+
+/* Tell whether a name has to go through fnmatch(). */
+static int is_glob(const char *s)
+{
+	return (strpbrk(s, "*?[") != NULL);
+}
+
+static int name_ent_cmp(const void *a, const void *b)
+{
+	const struct name_ent *ea, *eb;
+	int r;
+
+	ea = a;
+	eb = b;
+	r = strcmp(ea->name, eb->name);
+	if (r == 0)
+		r = ea->idx < eb->idx ? -1 : ea->idx > eb->idx;
+	return (r);
+}
+
+/* Sort the names and hash them. Each name maps to its first position
+   in the sorted view, duplicates follow it. */
+static int name_index_finish(struct name_index *ni)
+{
+	size_t k;
+
+	qsort(ni->v, ni->n, sizeof(*ni->v), name_ent_cmp);
+	if (nametab_init(&ni->tab, ni->n) == -1)
+		return (-1);
+	for (k = 0; k < ni->n; k++) {
+		if (nametab_put(&ni->tab, ni->v[k].name, k) == NULL)
+			return (-1);
+	}
+	return (0);
+}
+
+/* Index the names of an archive opened with libzip. The names belong
+   to libzip, so the index must not outlive the archive. */
+static int name_index_zip(struct name_index *ni, zip_t *zip)
+{
+	zip_int64_t entries;
+	zip_uint64_t i;
+
+	memset(ni, 0, sizeof(*ni));
+	entries = zip_get_num_entries(zip, ZIP_FL_NONE);
+	ni->v = malloc(((size_t)entries + 1) * sizeof(*ni->v));
+	if (ni->v == NULL)
+		return (-1);
+
+	for (i = 0; i < (zip_uint64_t)entries; i++) {
+		ni->v[ni->n].name = zip_get_name(zip, i, ZIP_FL_NONE);
+		if (ni->v[ni->n].name == NULL)
+			return (-1);
+		ni->v[ni->n++].idx = i;
+	}
+	return (name_index_finish(ni));
+}
+
+/* Same, from a central directory read with cdir_read(). */
+static int name_index_cdir(struct name_index *ni, const struct cdir *cd)
+{
+	zip_uint64_t i;
+
+	memset(ni, 0, sizeof(*ni));
+	ni->v = malloc(((size_t)cd->nentries + 1) * sizeof(*ni->v));
+	if (ni->v == NULL)
+		return (-1);
+
+	for (i = 0; i < cd->nentries; i++) {
+		ni->v[ni->n].name = cd->e[i].name;
+		ni->v[ni->n++].idx = i;
+	}
+	return (name_index_finish(ni));
+}
+
+static void name_index_free(struct name_index *ni)
+{
+	nametab_free(&ni->tab);
+	free(ni->v);
+	ni->v = NULL;
+	ni->n = 0;
+}
+
+/* Every entry with exactly that name, usually one. */
+static struct name_ent *name_index_find(const struct name_index *ni,
+					const char *name, size_t *count)
+{
+	struct nameslot *slot;
+	size_t k;
+
+	*count = 0;
+	slot = nametab_get(&ni->tab, name);
+	if (slot == NULL)
+		return (NULL);
+
+	for (k = (size_t)slot->val; k < ni->n &&
+		     strcmp(ni->v[k].name, name) == 0; k++)
+		(*count)++;
+	return (&ni->v[slot->val]);
+}
+
+/* Every entry whose name starts with prefix, such as everything
+   under "dir/". Two binary searches over the sorted view. */
+static struct name_ent *name_index_prefix(const struct name_index *ni,
+					  const char *prefix, size_t *count)
+{
+	size_t lo, hi, mid, first, plen;
+
+	plen = strlen(prefix);
+	lo = 0;
+	hi = ni->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(ni->v[mid].name, prefix, plen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+
+	hi = ni->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(ni->v[mid].name, prefix, plen) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*count = lo - first;
+	return (ni->v + first);
+}
+
+/* Collect the names asked for on the command line: plain names,
+   @manifest files, and glob patterns, or extended regular expressions
+   if regex is set. Exits if anything is wrong with them. */
+static void name_query_init(struct name_query *q, char **names,
+			    size_t nnames, int regex)
+{
+	char *s, msg[256];
+	size_t k;
+	int ret;
+
+	memset(q, 0, sizeof(*q));
+	q->req.owned = 1;
+	for (k = 0; k < nnames; k++) {
+		if (names[k][0] == '@') {
+			if (read_manifest(names[k] + 1, &q->req) == -1)
+				err(EXIT_FAILURE, "%s", names[k] + 1);
+			continue;
+		}
+		s = strdup(names[k]);
+		if (s == NULL || strlist_add(&q->req, s) == -1)
+			err(EXIT_FAILURE, "strdup()");
+	}
+
+	if (q->req.n == 0)
+		errx(EXIT_FAILURE,
+		     "file path cannot be an empty string.");
+	for (k = 0; k < q->req.n; k++) {
+		if (q->req.v[k][0] == '\0')
+			errx(EXIT_FAILURE,
+			     "file path cannot be an empty string.");
+	}
+
+	q->hit = calloc(q->req.n, sizeof(*q->hit));
+	if (q->hit == NULL)
+		err(EXIT_FAILURE, "calloc()");
+	if (regex == 0) {
+		if (nametab_init(&q->lits, q->req.n) == -1)
+			err(EXIT_FAILURE, "calloc()");
+		for (k = 0; k < q->req.n; k++) {
+			if (is_glob(q->req.v[k]) == 0 &&
+			    nametab_put(&q->lits, q->req.v[k], k) == NULL)
+				err(EXIT_FAILURE, "calloc()");
+		}
+		return;
+	}
+
+	q->re = calloc(q->req.n, sizeof(*q->re));
+	if (q->re == NULL)
+		err(EXIT_FAILURE, "calloc()");
+	for (k = 0; k < q->req.n; k++) {
+		ret = regcomp(&q->re[k], q->req.v[k], REG_EXTENDED | REG_NOSUB);
+		if (ret != 0) {
+			regerror(ret, &q->re[k], msg, sizeof(msg));
+			errx(EXIT_FAILURE, "invalid regular expression '%s': %s",
+			     q->req.v[k], msg);
+		}
+	}
+}
+
+/* Mark in sel every entry of the index that was asked for, and return
+   how many were newly marked. A plain name is a single hash lookup.
+   A pattern is only matched against the names that start with its
+   literal part, found in the sorted view. A regular expression has
+   to go through every name. */
+static size_t name_query_select(struct name_query *q,
+				const struct name_index *ni,
+				unsigned char *sel)
+{
+	struct name_ent *ne;
+	size_t k, m, count, nsel, plen;
+	char *pat, c;
+
+	nsel = 0;
+	for (k = 0; k < q->req.n; k++) {
+		pat = q->req.v[k];
+		if (q->re) {
+			for (m = 0; m < ni->n; m++) {
+				if (regexec(&q->re[k], ni->v[m].name,
+					    0, NULL, 0) != 0)
+					continue;
+				q->hit[k] = 1;
+				if (sel[ni->v[m].idx] == 0) {
+					sel[ni->v[m].idx] = 1;
+					nsel++;
+				}
+			}
+			continue;
+		}
+
+		if (is_glob(pat)) {
+			plen = strcspn(pat, "*?[\\");
+			c = pat[plen];
+			pat[plen] = '\0';
+			ne = name_index_prefix(ni, pat, &count);
+			pat[plen] = c;
+		} else {
+			ne = name_index_find(ni, pat, &count);
+		}
+
+		for (m = 0; m < count; m++) {
+			if (is_glob(pat) && fnmatch(pat, ne[m].name, 0) != 0)
+				continue;
+			q->hit[k] = 1;
+			if (sel[ne[m].idx] == 0) {
+				sel[ne[m].idx] = 1;
+				nsel++;
+			}
+		}
+	}
+	return (nsel);
+}
+
+/* Tell whether a single name was asked for, for when there is no
+   index of the archive to select from. */
+static int name_query_match(struct name_query *q, const char *name)
+{
+	struct nameslot *slot;
+	size_t k;
+
+	slot = q->re ? NULL : nametab_get(&q->lits, name);
+	if (slot) {
+		q->hit[slot->val] = 1;
+		return (1);
+	}
+	for (k = 0; k < q->req.n; k++) {
+		if (q->re ? regexec(&q->re[k], name, 0, NULL, 0) == 0 :
+		    is_glob(q->req.v[k]) && fnmatch(q->req.v[k], name, 0) == 0) {
+			q->hit[k] = 1;
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/* Tell about every name that didn't match anything, and return how
+   many of them there were. */
+static size_t name_query_report(const struct name_query *q)
+{
+	size_t k, missed;
+
+	missed = 0;
+	for (k = 0; k < q->req.n; k++) {
+		if (q->hit[k])
+			continue;
+		if (q->re || is_glob(q->req.v[k]))
+			warnx("no archived file matches '%s'.", q->req.v[k]);
+		else
+			warnx("no archived file was found with name '%s'.",
+			      q->req.v[k]);
+		missed++;
+	}
+	return (missed);
+}
+
+static void name_query_free(struct name_query *q)
+{
+	size_t k;
+
+	for (k = 0; q->re && k < q->req.n; k++)
+		regfree(&q->re[k]);
+	free(q->re);
+	free(q->hit);
+	nametab_free(&q->lits);
+	strlist_free(&q->req);
+}
+
+/* Names from an archive can't be trusted: nothing absolute, nothing
+   that climbs out of the destination, no empty components. */
+static int safe_name(const char *name)
+{
+	const char *p, *end;
+	size_t len;
+
+	if (name[0] == '/')
+		return (0);
+	for (p = name; *p != '\0'; p = *end ? end + 1 : end) {
+		end = strchr(p, '/');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = (size_t)(end - p);
+		if ((len == 0 && *end == '/') ||
+		    (len == 2 && p[0] == '.' && p[1] == '.'))
+			return (0);
+	}
+	return (1);
+}
+
+/* Raise the soft limit of open files as far as it goes, and return
+   it. Zero means that it is unknown, or that there is none. */
+static size_t nofile_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return (0);
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	return (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > SIZE_MAX ?
+		0 : (size_t)rl.rlim_cur);
+}
+
+/* Open the destination directory, and work out how many directories
+   can be kept open: half of what the process may open, after raising
+   the soft limit as far as it goes, and no more than maxfds if it is
+   given. */
+static int dircache_init(struct dircache *dc, const char *dpath,
+			 size_t maxfds)
+{
+	memset(dc, 0, sizeof(*dc));
+	dc->keys.owned = 1;
+	dc->root = open(dpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dc->root == -1)
+		return (-1);
+
+	dc->maxfds = nofile_limit() / 2;
+	if (dc->maxfds == 0 || dc->maxfds > DIRCACHE_FDS)
+		dc->maxfds = DIRCACHE_FDS;
+	if (maxfds > 0 && maxfds < dc->maxfds)
+		dc->maxfds = maxfds;
+
+	if (nametab_init(&dc->tab, 64) == -1) {
+		close(dc->root);
+		return (-1);
+	}
+	return (0);
+}
+
+static void dircache_free(struct dircache *dc)
+{
+	size_t i;
+	int fd;
+
+	for (i = 0; i < dc->tab.cap; i++) {
+		fd = (int)(zip_int64_t)dc->tab.slots[i].val;
+		if (dc->tab.slots[i].key && fd >= 0)
+			close(fd);
+	}
+	nametab_free(&dc->tab);
+	strlist_free(&dc->keys);
+	close(dc->root);
+}
+
+/* Get a directory below the destination, given relative to it,
+   creating it and its parents as needed, like mkdir -p. Every
+   directory is created and opened once, relative to its parent, and
+   never followed if it turns out to be a symbolic link. Returns an
+   fd for it, DIRCACHE_NOFD if it exists but isn't kept open, or -1. */
+static int dircache_dir(struct dircache *dc, const char *rel)
+{
+	struct nameslot *slot;
+	struct stat st;
+	const char *leaf;
+	char *parent, *key;
+	int base, fd, walked;
+
+	if (rel[0] == '\0')
+		return (dc->root);
+	slot = nametab_get(&dc->tab, rel);
+	if (slot)
+		return ((int)(zip_int64_t)slot->val);
+
+	base = dc->root;
+	leaf = strrchr(rel, '/');
+	if (leaf) {
+		parent = strndup(rel, (size_t)(leaf - rel));
+		if (parent == NULL)
+			return (-1);
+		base = dircache_dir(dc, parent);
+		free(parent);
+		if (base == -1)
+			return (-1);
+		leaf++;
+	} else {
+		leaf = rel;
+	}
+
+	/* Without an fd for the parent, go from the top, a component
+	   at a time. */
+	walked = base == DIRCACHE_NOFD;
+	if (walked && (base = open_beneath(dc->root, rel, &leaf)) == -1)
+		return (-1);
+
+	fd = -1;
+	if (mkdirat(base, leaf, 0777) == 0 || errno == EEXIST) {
+		if (dc->nfds < dc->maxfds) {
+			fd = openat(base, leaf, O_RDONLY | O_DIRECTORY |
+				    O_NOFOLLOW | O_CLOEXEC);
+			if (fd != -1)
+				dc->nfds++;
+		} else if (fstatat(base, leaf, &st,
+				   AT_SYMLINK_NOFOLLOW) == 0) {
+			if (S_ISDIR(st.st_mode))
+				fd = DIRCACHE_NOFD;
+			else
+				errno = ENOTDIR;
+		}
+	}
+	if (walked)
+		close_beneath(base, dc->root);
+	if (fd == -1)
+		return (-1);
+
+	key = strdup(rel);
+	if (key == NULL || strlist_add(&dc->keys, key) == -1) {
+		free(key);
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	if (nametab_put(&dc->tab, key, (zip_uint64_t)(zip_int64_t)fd) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/* Find the directory a file goes to, creating it if needed. Returns
+   the fd to use with the *at() calls and points *leaf to the name to
+   use with it, or returns -1. A directory that isn't kept open gives
+   the destination and the whole name, which is then opened through
+   open_beneath() so that no link on the way is followed. */
+static int dircache_place(struct dircache *dc, const char *name,
+			  const char **leaf)
+{
+	const char *slash;
+	char *parent;
+	int fd;
+
+	slash = strrchr(name, '/');
+	if (slash == NULL) {
+		*leaf = name;
+		return (dc->root);
+	}
+
+	parent = strndup(name, (size_t)(slash - name));
+	fd = parent ? dircache_dir(dc, parent) : -1;
+	free(parent);
+	if (fd == DIRCACHE_NOFD) {
+		*leaf = name;
+		return (dc->root);
+	}
+	*leaf = slash + 1;
+	return (fd);
+}
+
+/* Check passw on an encrypted entry. The header of the traditional
+   encryption lets one wrong password in 256 through, so the start of
+   the data is inflated as well, and checked against the crc when it
+   is the whole entry. Returns 0 if it is right, or a libzip error. */
+static int check_password(zip_t *zip, const zip_stat_t *zs,
+			  const char *passw)
+{
+	zip_file_t *zfp;
+	unsigned char *buf;
+	zip_int64_t n;
+	int ret;
+
+	zfp = zip_fopen_index_encrypted(zip, zs->index, 0, passw);
+	if (zfp == NULL)
+		return (zip_error_code_zip(zip_get_error(zip)));
+
+	buf = malloc(PASSWORD_PROBE);
+	if (buf == NULL) {
+		zip_fclose(zfp);
+		return (ZIP_ER_MEMORY);
+	}
+	ret = 0;
+	n = zip_fread(zfp, buf, PASSWORD_PROBE);
+	if (n < 0 || ((zip_uint64_t)n == zs->size &&
+		      (zs->valid & ZIP_STAT_CRC) &&
+		      crc32_fast(0, buf, (size_t)n) != zs->crc))
+		ret = ZIP_ER_WRONGPASSWD;
+	free(buf);
+	zip_fclose(zfp);
+	return (ret);
+}
+
+/* Settle the password of an archive on its first encrypted entry (zs),
+   before anything is extracted: the one given without the terminal
+   has to be right, one typed on it is asked again a few times. The
+   jobs of the archive then share it. Returns NULL (after telling why)
+   if there is no right one. */
+static char *archive_password(zip_t *zip, const char *zfile,
+			      const zip_stat_t *zs,
+			      const struct unzip_opts *opts)
+{
+	char *passw;
+	int tries, ec;
+
+	if (opts->passw) {
+		ec = check_password(zip, zs, opts->passw);
+		if (ec != 0) {
+			warnx("error: %s: %s", zfile, zip_proper_error[ec]);
+			return (NULL);
+		}
+		passw = strdup(opts->passw);
+		if (passw == NULL)
+			warn("strdup()");
+		return (passw);
+	}
+
+	/* Archives extracted at once take turns at the terminal. */
+	ec = ZIP_ER_WRONGPASSWD;
+	for (tries = 0; tries < PASSWORD_TRIES; tries++) {
+		pthread_mutex_lock(&prompt_lock);
+		fprintf(stdout, "[%s] password: ", pathbase(zfile));
+		fflush(stdout);
+		passw = take_stdin_password();
+		fputc('\n', stdout);
+		pthread_mutex_unlock(&prompt_lock);
+		if (passw == NULL) {
+			warnx("cannot take standard input.");
+			return (NULL);
+		}
+
+		ec = check_password(zip, zs, passw);
+		if (ec == 0)
+			return (passw);
+		free(passw);
+		if (ec != ZIP_ER_WRONGPASSWD)
+			break;
+		warnx("%s: %s", zfile, zip_proper_error[ec]);
+	}
+	warnx("error: %s: %s", zfile, zip_proper_error[ec]);
+	return (NULL);
+}
+
+/* The crc of the end records and comment of an archive, which change
+   with every edit of its central directory. */
+static int lzidx_tail_crc(int zfd, zip_uint64_t tail, zip_uint64_t size,
+			  zip_uint32_t *crc)
+{
+	unsigned char *buf;
+	size_t len;
+
+	if (tail > size || size - tail > LZIDX_TAIL_MAX)
+		return (-1);
+	len = (size_t)(size - tail);
+	buf = malloc(len + 1);
+	if (buf == NULL || pread_full(zfd, buf, len, tail) == -1) {
+		free(buf);
+		return (-1);
+	}
+	*crc = (zip_uint32_t)crc32(0L, buf, (uInt)len);
+	free(buf);
+	return (0);
+}
+
+/* Write the sidecar index of an archive, from its central directory,
+   into a temporary file that takes the place of the old one. */
+static int lzidx_build(int zfd, const struct stat *st, const char *path)
+{
+	struct lzidx_head head;
+	struct lzidx_entry ie;
+	struct name_ent *byname;
+	struct cdir *cd;
+	const unsigned char *rec;
+	zip_uint64_t i, off;
+	zip_uint32_t pos;
+	char *tmp;
+	FILE *f;
+	int fd, ret;
+
+	cd = cdir_read(zfd, 1);
+	if (cd == NULL || cd->nentries >= 0xffffffff) {
+		cdir_free(cd);
+		return (-1);
+	}
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, LZIDX_MAGIC, sizeof(LZIDX_MAGIC));
+	head.endian = LZIDX_ENDIAN;
+	head.size = (zip_uint64_t)st->st_size;
+	head.mtime = st->st_mtim.tv_sec;
+	head.mtime_ns = st->st_mtim.tv_nsec;
+	head.tail = cd->offset + cd->size;
+	head.nentries = cd->nentries;
+	byname = malloc(((size_t)cd->nentries + 1) * sizeof(*byname));
+	tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (byname == NULL || tmp == NULL ||
+	    lzidx_tail_crc(zfd, head.tail, head.size, &head.tail_crc) == -1) {
+		free(byname);
+		free(tmp);
+		cdir_free(cd);
+		return (-1);
+	}
+	for (i = 0; i < cd->nentries; i++) {
+		byname[i].name = cd->e[i].name;
+		byname[i].idx = i;
+		head.names_len += strlen(cd->e[i].name) + 1;
+	}
+	qsort(byname, (size_t)cd->nentries, sizeof(*byname), name_ent_cmp);
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	f = fd == -1 ? NULL : fdopen(fd, "w");
+	if (f == NULL) {
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(byname);
+		free(tmp);
+		cdir_free(cd);
+		return (-1);
+	}
+	ret = fchmod(fd, st->st_mode & 0666) == 0 &&
+		fwrite(&head, sizeof(head), 1, f) == 1 ? 0 : -1;
+	for (i = 0, off = 0; i < cd->nentries && ret == 0; i++) {
+		rec = cd->raw + cd->e[i].rec;
+		memset(&ie, 0, sizeof(ie));
+		ie.lho = cd->e[i].lho;
+		ie.comp_size = cd->e[i].comp_size;
+		ie.size = cd->e[i].size;
+		ie.name = off;
+		ie.crc = cd->e[i].crc;
+		ie.dos_time = get32(rec + 12);
+		ie.method = cd->e[i].method;
+		ie.flags = cd->e[i].flags;
+		ie.mode = cdir_rec_mode(rec);
+		ie.nlen = (zip_uint32_t)strlen(cd->e[i].name);
+		off += ie.nlen + 1;
+		if (fwrite(&ie, sizeof(ie), 1, f) != 1)
+			ret = -1;
+	}
+	for (i = 0; i < cd->nentries && ret == 0; i++) {
+		pos = (zip_uint32_t)byname[i].idx;
+		if (fwrite(&pos, sizeof(pos), 1, f) != 1)
+			ret = -1;
+	}
+	pos = 0;
+	if (cd->nentries % 2 && fwrite(&pos, sizeof(pos), 1, f) != 1)
+		ret = -1;
+	for (i = 0; i < cd->nentries && ret == 0; i++) {
+		if (fwrite(cd->e[i].name, strlen(cd->e[i].name) + 1, 1,
+			   f) != 1)
+			ret = -1;
+	}
+
+	if (fclose(f) != 0 || ret == -1 || rename(tmp, path) == -1) {
+		unlink(tmp);
+		ret = -1;
+	}
+	free(byname);
+	free(tmp);
+	cdir_free(cd);
+	return (ret);
+}
+
+/* Check what the entries of a mapped index point at: positions in
+   the sorted view that are entries, and names that end in the names
+   with a NUL. Everything else then reads the index without checks. */
+static int lzidx_check(const struct lzidx *x)
+{
+	const struct lzidx_entry *e;
+	zip_uint64_t i, n, len;
+
+	n = x->head->nentries;
+	len = x->head->names_len;
+	for (i = 0; i < n; i++) {
+		if (x->sorted[i] >= n)
+			return (-1);
+		e = &x->e[i];
+		if (e->name >= len || e->nlen >= len - e->name ||
+		    x->names[e->name + e->nlen] != '\0')
+			return (-1);
+	}
+	return (0);
+}
+
+/* Map a sidecar index, if it was made for the archive as it is now
+   and is whole. */
+static int lzidx_map(struct lzidx *x, const char *path, int zfd,
+		     const struct stat *st)
+{
+	const struct lzidx_head *h;
+	struct stat ist;
+	zip_uint64_t need, n;
+	zip_uint32_t crc;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if (fstat(fd, &ist) == -1 ||
+	    (size_t)ist.st_size < sizeof(struct lzidx_head)) {
+		close(fd);
+		return (-1);
+	}
+	map = mmap(NULL, (size_t)ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	/* With both counts below the size of the file, the sum can't
+	   wrap around. */
+	h = map;
+	n = h->nentries;
+	need = 0;
+	if (n < 0xffffffff && h->names_len <= (zip_uint64_t)ist.st_size)
+		need = sizeof(*h) + n * sizeof(struct lzidx_entry) +
+			(n + n % 2) * sizeof(zip_uint32_t) + h->names_len;
+	if (memcmp(h->magic, LZIDX_MAGIC, sizeof(LZIDX_MAGIC)) != 0 ||
+	    h->endian != LZIDX_ENDIAN ||
+	    h->size != (zip_uint64_t)st->st_size ||
+	    h->mtime != st->st_mtim.tv_sec ||
+	    h->mtime_ns != st->st_mtim.tv_nsec ||
+	    need != (zip_uint64_t)ist.st_size ||
+	    lzidx_tail_crc(zfd, h->tail, h->size, &crc) == -1 ||
+	    crc != h->tail_crc) {
+		munmap(map, (size_t)ist.st_size);
+		return (-1);
+	}
+
+	x->map = map;
+	x->len = (size_t)ist.st_size;
+	x->head = h;
+	x->e = (const struct lzidx_entry *)(h + 1);
+	x->sorted = (const zip_uint32_t *)(x->e + n);
+	x->names = (const char *)(x->sorted + n + n % 2);
+	if (lzidx_check(x) == -1) {
+		munmap(map, x->len);
+		x->map = NULL;
+		return (-1);
+	}
+	return (0);
+}
+
+/* Find the sidecar index of an archive and map it. A stale index, made
+   for the archive before it changed, is made again, and so is a
+   missing one with create. Returns -1 if there is none to use, the
+   archive is then read as usual. */
+static int lzidx_open(struct lzidx *x, const char *zfile, int create)
+{
+	struct stat st;
+	char *path;
+	int zfd, ret;
+
+	memset(x, 0, sizeof(*x));
+	zfd = open(zfile, O_RDONLY);
+	if (zfd == -1)
+		return (-1);
+	path = malloc(strlen(zfile) + sizeof(LZIDX_SUFFIX));
+	if (path == NULL || fstat(zfd, &st) == -1) {
+		free(path);
+		close(zfd);
+		return (-1);
+	}
+	sprintf(path, "%s%s", zfile, LZIDX_SUFFIX);
+
+	ret = lzidx_map(x, path, zfd, &st);
+	if (ret == -1 && (create || access(path, F_OK) == 0)) {
+		if (lzidx_build(zfd, &st, path) == 0)
+			ret = lzidx_map(x, path, zfd, &st);
+		else
+			warnx("warning: cannot write the index '%s'.", path);
+	}
+	free(path);
+	close(zfd);
+	return (ret);
+}
+
+static void lzidx_close(struct lzidx *x)
+{
+	if (x->map)
+		munmap(x->map, x->len);
+	x->map = NULL;
+}
+
+/* The name of an entry, checked by lzidx_check(). */
+static const char *lzidx_name(const struct lzidx *x, zip_uint64_t i)
+{
+	return (x->names + x->e[i].name);
+}
+
+/* The time of DOS date and time fields, the date in the high half,
+   taken as local time the way libzip does. */
+static time_t dos_mtime(zip_uint32_t t)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = -1;
+	tm.tm_year = (int)((t >> 25) & 127) + 1980 - 1900;
+	tm.tm_mon = (int)((t >> 21) & 15) - 1;
+	tm.tm_mday = (int)((t >> 16) & 31);
+	tm.tm_hour = (int)((t >> 11) & 31);
+	tm.tm_min = (int)((t >> 5) & 63);
+	tm.tm_sec = (int)((t << 1) & 62);
+	return (mktime(&tm));
+}
+
+/* What zip_stat_index() would tell about an entry. */
+static void lzidx_stat(const struct lzidx *x, zip_uint64_t i,
+		       zip_stat_t *zs)
+{
+	const struct lzidx_entry *e;
+
+	e = &x->e[i];
+	zip_stat_init(zs);
+	zs->valid = ZIP_STAT_NAME | ZIP_STAT_INDEX | ZIP_STAT_SIZE |
+		ZIP_STAT_COMP_SIZE | ZIP_STAT_MTIME | ZIP_STAT_CRC |
+		ZIP_STAT_COMP_METHOD;
+	zs->name = lzidx_name(x, i);
+	zs->index = i;
+	zs->size = e->size;
+	zs->comp_size = e->comp_size;
+	zs->mtime = dos_mtime(e->dos_time);
+	zs->crc = e->crc;
+	zs->comp_method = e->method;
+}
+
+/* The entry as cdir_read() would have it, for the raw readers. */
+static void lzidx_cdir_entry(const struct lzidx *x, zip_uint64_t i,
+			     struct cdir_entry *ce)
+{
+	memset(ce, 0, sizeof(*ce));
+	ce->lho = x->e[i].lho;
+	ce->comp_size = x->e[i].comp_size;
+	ce->size = x->e[i].size;
+	ce->crc = x->e[i].crc;
+	ce->method = x->e[i].method;
+	ce->flags = x->e[i].flags;
+	ce->name = lzidx_name(x, i);
+}
+
+/* First position in the sorted view whose name is not below key, or
+   with upper, above it. Only len bytes are compared, which is a
+   prefix search unless len counts the end of key. */
+static size_t lzidx_bound(const struct lzidx *x, const char *key,
+			  size_t len, int upper)
+{
+	size_t lo, hi, mid;
+	int r;
+
+	lo = 0;
+	hi = (size_t)x->head->nentries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = strncmp(lzidx_name(x, x->sorted[mid]), key, len);
+		if (r < 0 || (upper && r == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/* name_query_select(), answered from a sidecar index: names and the
+   fixed start of glob patterns are found by binary search, and only
+   regular expressions go through every name. */
+static size_t lzidx_select(const struct lzidx *x, struct name_query *q,
+			   unsigned char *sel)
+{
+	const char *name;
+	zip_uint64_t idx;
+	size_t k, m, first, last, nsel, len;
+	char *pat;
+	int glob;
+
+	nsel = 0;
+	for (k = 0; k < q->req.n; k++) {
+		pat = q->req.v[k];
+		glob = is_glob(pat);
+		if (q->re) {
+			first = 0;
+			last = (size_t)x->head->nentries;
+		} else {
+			len = glob ? strcspn(pat, "*?[\\") : strlen(pat) + 1;
+			first = lzidx_bound(x, pat, len, 0);
+			last = lzidx_bound(x, pat, len, 1);
+		}
+
+		for (m = first; m < last; m++) {
+			idx = x->sorted[m];
+			name = lzidx_name(x, idx);
+			if (q->re && regexec(&q->re[k], name, 0, NULL, 0) != 0)
+				continue;
+			if (q->re == NULL && glob && fnmatch(pat, name, 0) != 0)
+				continue;
+			q->hit[k] = 1;
+			if (sel[idx] == 0) {
+				sel[idx] = 1;
+				nsel++;
+			}
+		}
+	}
+	return (nsel);
+}
+
+/* Find the first encrypted entry of an archive, among those selected
+   by sel. Returns 0 if there is one. */
+static int first_encrypted(zip_t *zip, const unsigned char *sel,
+			   zip_stat_t *zs)
+{
+	zip_int64_t entries;
+	zip_uint64_t i;
+
+	entries = zip_get_num_entries(zip, 0);
+	for (i = 0; i < (zip_uint64_t)entries; i++) {
+		if (sel && sel[i] == 0)
+			continue;
+		if (zip_stat_index(zip, i, 0, zs) == 0 &&
+		    (zs->valid & ZIP_STAT_ENCRYPTION_METHOD) &&
+		    zs->encryption_method != ZIP_EM_NONE)
+			return (0);
+	}
+	return (-1);
+}
+
+/* Work out which entries of an archive are extracted, going by the
+   names in the central directory alone: those of the sidecar index x
+   if there is one, with no need for zip, or those libzip has. *sel is
+   left NULL if every entry is, and *none is set if no entry is.
+   Returns -1 (after telling why) on failure. */
+static int unzip_select(zip_t *zip, const struct lzidx *x,
+			const char *zfile, const struct unzip_opts *opts,
+			unsigned char **selp, int *none)
+{
+	struct name_index ni;
+	unsigned char *sel, *out;
+	size_t k, n, total;
+
+	*selp = NULL;
+	*none = 0;
+	if (opts->include == NULL && opts->exclude == NULL)
+		return (0);
+
+	memset(&ni, 0, sizeof(ni));
+	if (x == NULL && name_index_zip(&ni, zip) == -1) {
+		warnx("error: %s: %s", zfile,
+		      zip_error_string(zip_get_error(zip)));
+		name_index_free(&ni);
+		return (-1);
+	}
+	total = x ? (size_t)x->head->nentries : ni.n;
+	sel = calloc(total + 1, 1);
+	out = calloc(total + 1, 1);
+	if (sel == NULL || out == NULL) {
+		warn("calloc()");
+		free(sel);
+		free(out);
+		name_index_free(&ni);
+		return (-1);
+	}
+
+	/* The hits are counted per archive. */
+	if (opts->include) {
+		memset(opts->include->hit, 0, opts->include->req.n);
+		if (x)
+			lzidx_select(x, opts->include, sel);
+		else
+			name_query_select(opts->include, &ni, sel);
+		name_query_report(opts->include);
+	} else {
+		memset(sel, 1, total);
+	}
+	if (opts->exclude && x)
+		lzidx_select(x, opts->exclude, out);
+	else if (opts->exclude)
+		name_query_select(opts->exclude, &ni, out);
+
+	n = 0;
+	for (k = 0; k < total; k++) {
+		sel[k] &= !out[k];
+		n += sel[k];
+	}
+	*none = n == 0;
+
+	free(out);
+	name_index_free(&ni);
+	*selp = sel;
+	return (0);
+}
+
+/* Extract an archive, telling about it on out. Returns 0 when done,
+   1 if extraction was stopped on the prompt, and -1 on failure. */
+static int unzip_zip_archive(const char *dpath, const char *zfile,
+			     const struct unzip_opts *opts, FILE *out)
+{
+	zip_t *zip;
+	zip_int64_t entries;
+	zip_uint64_t i;
+        zip_stat_t zs;
+	struct unzip_job *jobs, *job, *r;
+	struct unzip_ctx ctx;
+	struct dircache dc;
+	struct stat st;
+	struct lzidx x;
+        char *p, *renm, *dir, *passw;
+	const char *leaf;
+	unsigned char *sel;
+	struct timespec t0, t1;
+	struct unzip_stats stats, *stp;
+	zip_uint64_t start, pt, nindexed;
+	size_t zlen, dlen, njobs, maxjobs, ndups;
+	int ret, all_ok, rename_ok, in_loop, eptr, stop, none, dfd, verify;
+
+	/* Nothing here exits: with --archives, a bad archive only
+	   fails itself, and the others carry on. */
+
+	/* Check whether the source path (zip) file exists or not. */
+	if (access(zfile, F_OK) == -1) {
+		warnx("error: file '%s' does not exists.", zfile);
+		return (-1);
+	}
+
+	/* Check whether the destination path exists or not. */
+	if (access(dpath, F_OK) == -1) {
+		warnx("error: destination path '%s' does not exists.",
+		      dpath);
+		return (-1);
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	stp = opts->stats ? &stats : NULL;
+	start = pt = stats_start(stp);
+
+	/* An archive with a sidecar index has its entries picked from
+	   the index, and isn't opened at all if none of them is. */
+	sel = NULL;
+	none = 0;
+	nindexed = 0;
+	if ((opts->include || opts->exclude) && lzidx_open(&x, zfile, 0) == 0) {
+		nindexed = x.head->nentries;
+		ret = unzip_select(NULL, &x, zfile, opts, &sel, &none);
+		lzidx_close(&x);
+		if (ret == -1)
+			return (-1);
+		if (none) {
+			warnx("nothing to extract from '%s'.", zfile);
+			free(sel);
+			return (0);
+		}
+	}
+
+	zip = zip_open(zfile, ZIP_NONE, &eptr);
+        if (zip == NULL) {
+		warnx("error: %s: %s", zfile, zip_proper_error[eptr]);
+		free(sel);
+		return (-1);
+	}
+	stats_stop(stp, PHASE_OPEN, pt);
+
+	/* The archive may have changed since the index was read. */
+	entries = zip_get_num_entries(zip, 0);
+	if (sel && (zip_uint64_t)entries != nindexed) {
+		free(sel);
+		sel = NULL;
+	}
+	if (sel == NULL &&
+	    unzip_select(zip, NULL, zfile, opts, &sel, &none) == -1) {
+		zip_close(zip);
+		return (-1);
+	}
+	if (none) {
+		warnx("nothing to extract from '%s'.", zfile);
+		free(sel);
+		zip_close(zip);
+		return (0);
+	}
+
+	/* One password for the whole archive, checked before anything
+	   is written so that a wrong one fails right away. */
+	passw = NULL;
+	if (first_encrypted(zip, sel, &zs) == 0) {
+		pt = stats_start(stp);
+		passw = archive_password(zip, zfile, &zs, opts);
+		stats_stop(stp, PHASE_PROMPT, pt);
+		if (passw == NULL) {
+			free(sel);
+			zip_close(zip);
+			return (-1);
+		}
+	}
+
+	if (dircache_init(&dc, dpath, opts->dirfds) == -1) {
+		warn("open(): %s", dpath);
+		free(sel);
+		free(passw);
+		zip_close(zip);
+		return (-1);
+	}
+	all_ok = opts->all_ok;
+	dlen = strlen(dpath);
+	jobs = NULL;
+	njobs = maxjobs = 0;
+	stop = 0;
+	memset(&ctx.tally, 0, sizeof(ctx.tally));
+
+	/* First pass: create directories and settle every question
+	   (overwrite, rename, password) before any data is touched, so
+	   that the extraction itself can run without a terminal. */
+	for (i = 0; i < (zip_uint64_t)entries && stop == 0; i++) {
+		if (sel && sel[i] == 0)
+			continue;
+		pt = stats_start(stp);
+		ret = zip_stat_index(zip, i, 0, &zs);
+		stats_stop(stp, PHASE_STAT, pt);
+		if (ret != 0)
+			continue;
+
+		zlen = strlen(zs.name);
+		if (zlen == 0)
+			continue;
+		if (safe_name(zs.name) == 0) {
+			warnx("skipping %s: unsafe path.", zs.name);
+			continue;
+		}
+
+		/* Destination place where the file will be created. */
+		p = malloc(dlen + zlen + 2);
+		if (p == NULL) {
+			warn("malloc()");
+			goto fail;
+		}
+		snprintf(p, dlen + zlen + 2, "%s/%s", dpath, zs.name);
+
+		/* If the file is a directory, create a directory for it,
+		   along with its parents. Files get their parents the
+		   same way, archives don't always list directories. */
+		pt = stats_start(stp);
+		if (zs.name[zlen - 1] == '/') {
+			dir = strndup(zs.name, zlen - 1);
+			if (dir == NULL || dircache_dir(&dc, dir) == -1) {
+				warn("mkdir(): %s", p);
+				free(dir);
+				free(p);
+				goto fail;
+			}
+			stats_stop(stp, PHASE_MKDIR, pt);
+			free(dir);
+			free(p);
+			continue;
+		}
+		dfd = dircache_place(&dc, zs.name, &leaf);
+		stats_stop(stp, PHASE_MKDIR, pt);
+		if (dfd == -1) {
+			warn("mkdir(): %s", p);
+			free(p);
+			goto fail;
+		}
+
+		/* With --update, a file of the same size and time is left
+		   alone, or checked by a worker with --check-crc, which
+		   then overwrites it without asking if it differs. */
+		verify = 0;
+		if (opts->update) {
+			if (stat_beneath(dfd, leaf, &st) == -1) {
+				if (opts->update == UPDATE_FRESHEN) {
+					free(p);
+					continue;
+				}
+			} else if (same_file(&st, &zs)) {
+				if (opts->check_crc == 0) {
+					ctx.tally.skipped++;
+					ctx.tally.skipped_bytes += zs.size;
+					free(p);
+					continue;
+				}
+				verify = 1;
+			}
+		}
+
+		/* For a file, ask what to do if it already exists. */
+		ret = 0;
+		rename_ok = 0;
+		in_loop = 1;
+		pt = stats_start(stp);
+		if (all_ok == 0 && verify == 0 &&
+		    stat_beneath(dfd, leaf, &st) == 0) {
+		        do {
+				fprintf(stdout,
+					"replace %s? [y]es, [n]o, [a]ll, "
+					"[r]ename, [e]xit: ",
+					zs.name);
+				fflush(stdout);
+				ret = take_stdin_args();
+				switch (ret) {
+				case REPLACE_ERROR:
+					/* An internal error occurred in libzip. */
+					warnx("reading input stream failed.");
+					free(p);
+					goto fail;
+
+				case REPLACE_INVALID:
+					/* Invalid input was provided. */
+					fputs("invalid input, ignoring...\n",
+					      stderr);
+					break;
+
+				case REPLACE_ALL:
+					/* Assume other answers are always
+					   will be 'yes'. */
+					all_ok = 1;
+					ret = REPLACE_YES;
+					in_loop = 0;
+					break;
+
+				case REPLACE_RENAME:
+					/* Indicate that we need to rename
+					   the file, so we don't overwrite
+					   the original or already extracted
+					   file. */
+					rename_ok = 1;
+					ret = REPLACE_YES;
+					in_loop = 0;
+					break;
+
+				case REPLACE_OVERFLOW:
+					/* If we read more than we need to,
+					   free the buffers, and exit from
+					   the program. */
+					warnx("invalid input, exiting...");
+					free(p);
+					goto fail;
+
+				default:
+					/* y, n and e are handled below. */
+					in_loop = 0;
+					break;
+				}
+		        } while (in_loop);
+			stats_stop(stp, PHASE_PROMPT, pt);
+	        }
+
+		switch (ret) {
+		case 0: /* This the default value of ret,
+			   only used if the previous access()
+			   call returns -1 (fails). */
+		case REPLACE_YES:
+			break;
+
+		case REPLACE_EXIT:
+			/* Still extract what was agreed on so far. */
+			stop = 1;
+			free(p);
+			continue;
+
+		case REPLACE_NO:
+		default:
+			free(p);
+			continue;
+		}
+
+		/* It doesn't really do renaming of an existing file,
+		   rather it just changes the file path that will be
+		   created for that new file to live. */
+		if (rename_ok) {
+			pt = stats_start(stp);
+			renm = take_rename_path();
+			stats_stop(stp, PHASE_PROMPT, pt);
+			if (renm == NULL) {
+				warnx("cannot take standard input.");
+				free(p);
+				goto fail;
+			}
+			free(p);
+			p = renm;
+		}
+
+		if (njobs == maxjobs) {
+			maxjobs = maxjobs ? maxjobs * 2 : 64;
+			r = realloc(jobs, maxjobs * sizeof(*jobs));
+			if (r == NULL) {
+				warn("realloc()");
+				free(p);
+				goto fail;
+			}
+			jobs = r;
+		}
+
+		job = &jobs[njobs++];
+		job->idx = i;
+		job->zs = zs;
+		job->path = p;
+		job->dfd = rename_ok ? AT_FDCWD : dfd;
+		job->leaf = rename_ok ? p : p + dlen + 1 + (leaf - zs.name);
+		job->passw = zs.encryption_method ? passw : NULL;
+		job->renamed = rename_ok;
+		job->verify = verify;
+		job->same_leaf = NULL;
+		job->label = rename_ok ? p : zs.name;
+	}
+
+	free(sel);
+
+	/* Where the data of every entry lives is needed to read them
+	   in order, and to copy stored entries straight from the
+	   archive. */
+	ctx.zfile = zfile;
+	ctx.opts = opts;
+	ctx.cd = NULL;
+	ctx.out = out;
+	ctx.stats = stp;
+	ctx.zfd = open(zfile, O_RDONLY);
+	if (ctx.zfd != -1) {
+		posix_fadvise(ctx.zfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		ctx.cd = cdir_read(ctx.zfd, 0);
+	}
+
+	/* With --dedup, the files whose data is already extracted to
+	   another file are left for after the others. */
+	ndups = opts->dedup ? dedup_jobs(&ctx, jobs, njobs) : 0;
+
+	/* Second pass: the actual extraction. */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = run_unzip_jobs(zip, &ctx, jobs, njobs - ndups);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ctx.secs = (double)(t1.tv_sec - t0.tv_sec) +
+		(double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+	if (ret == 0 && ndups)
+		ret = run_dedup_jobs(&ctx, jobs + njobs - ndups, ndups);
+	if (ret == 0)
+		report_tally(&ctx);
+	if (stp)
+		report_stats(&ctx, (double)(clock_ns() - start) / 1e9);
+
+	free_unzip_jobs(jobs, njobs);
+	free(passw);
+	dircache_free(&dc);
+	cdir_free(ctx.cd);
+	if (ctx.zfd != -1)
+		close(ctx.zfd);
+	zip_close(zip);
+	if (ret == -1)
+		return (-1);
+	return (stop ? 1 : 0);
+
+fail:
+	free(sel);
+	free_unzip_jobs(jobs, njobs);
+	free(passw);
+	dircache_free(&dc);
+	zip_close(zip);
+	return (-1);
+}
+
+/* Order archives by size, biggest first, so that the last one to
+   finish is a small one. */
+static int archive_cmp_size(const void *a, const void *b)
+{
+	const struct archive_job *ja, *jb;
+
+	ja = a;
+	jb = b;
+	if (ja->size != jb->size)
+		return (ja->size < jb->size ? 1 : -1);
+	return (strcmp(ja->zfile, jb->zfile));
+}
+
+static void *archive_worker(void *arg)
+{
+	struct archive_pool *pool;
+	FILE *out;
+	char *buf;
+	size_t n, len;
+	int ret;
+
+	pool = arg;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next == pool->narcs) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		n = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		/* What an archive prints is kept until it is done, and
+		   then printed in one piece. */
+		buf = NULL;
+		len = 0;
+		out = open_memstream(&buf, &len);
+		if (out == NULL)
+			out = stdout;
+		fprintf(out, "archive: %s\n", pool->arcs[n].zfile);
+		ret = unzip_zip_archive(pool->dpath, pool->arcs[n].zfile,
+					pool->opts, out);
+
+		pthread_mutex_lock(&pool->lock);
+		if (out != stdout) {
+			fclose(out);
+			fwrite(buf, 1, len, stdout);
+			fflush(stdout);
+			free(buf);
+		}
+		if (ret == -1)
+			pool->failed++;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return (NULL);
+}
+
+/* Extract many archives, up to nslots of them at once, each with its
+   own -j workers. How many run at once is also bounded by memory,
+   for the buffers of their workers, and by open files, which are
+   shared out between them. Returns how many archives failed. */
+static size_t unzip_archives(const char *dpath, char **zfiles, size_t n,
+			     const struct unzip_opts *opts, long nslots)
+{
+	struct archive_pool pool;
+	struct unzip_opts o;
+	struct stat st;
+	pthread_t *tids;
+	zip_uint64_t mem, per_mem;
+	size_t i, k, fds, per_fds, missing;
+	long pages, psize, t, started;
+
+	if (access(dpath, F_OK) == -1)
+		errx(EXIT_FAILURE,
+		     "error: destination path '%s' does not exists.",
+		     dpath);
+
+	/* An archive that is not there fails on its own. */
+	pool.arcs = calloc(n, sizeof(*pool.arcs));
+	if (pool.arcs == NULL)
+		err(EXIT_FAILURE, "calloc()");
+	missing = 0;
+	for (i = 0, k = 0; i < n; i++) {
+		if (stat(zfiles[i], &st) == -1) {
+			warnx("error: file '%s' does not exists.", zfiles[i]);
+			missing++;
+			continue;
+		}
+		pool.arcs[k].zfile = zfiles[i];
+		pool.arcs[k++].size = st.st_size;
+	}
+	n = k;
+	if (n == 0) {
+		free(pool.arcs);
+		return (missing);
+	}
+	qsort(pool.arcs, n, sizeof(*pool.arcs), archive_cmp_size);
+
+	/* Every archive has two buffers per worker, and an arena
+	   per worker with --io-uring. */
+	per_mem = (zip_uint64_t)opts->jobs * 2 * opts->bufsize;
+	if (opts->io_uring)
+		per_mem += (zip_uint64_t)opts->jobs * URING_ARENA;
+	pages = sysconf(_SC_PHYS_PAGES);
+	psize = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && psize > 0) {
+		mem = (zip_uint64_t)pages * (zip_uint64_t)psize /
+			ARCHIVES_MEM_SHARE;
+		if (mem / per_mem < (zip_uint64_t)nslots)
+			nslots = mem / per_mem > 0 ? (long)(mem / per_mem) : 1;
+	}
+
+	/* And a libzip handle and an output file per worker, the
+	   archive itself, the destination and its directories. */
+	per_fds = (size_t)opts->jobs * 2 + 3;
+	fds = nofile_limit() / 2;
+	if (fds > 0 && fds / (per_fds + ARCHIVE_DIRFDS) < (size_t)nslots)
+		nslots = fds / (per_fds + ARCHIVE_DIRFDS) > 0 ?
+			(long)(fds / (per_fds + ARCHIVE_DIRFDS)) : 1;
+	if (nslots > (long)n)
+		nslots = (long)n;
+
+	o = *opts;
+	if (o.progress) {
+		warnx("--progress is left out with --archives.");
+		o.progress = 0;
+	}
+	if (fds > 0)
+		o.dirfds = fds / (size_t)nslots > per_fds + ARCHIVE_DIRFDS ?
+			fds / (size_t)nslots - per_fds : ARCHIVE_DIRFDS;
+
+	fprintf(stdout, " extracting %ld archive(s) at once, with %ld "
+		"thread(s) each.\n", nslots, opts->jobs);
+	fflush(stdout);
+
+	pool.dpath = dpath;
+	pool.opts = &o;
+	pool.narcs = n;
+	pool.next = 0;
+	pool.failed = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	tids = calloc((size_t)nslots, sizeof(*tids));
+	if (tids == NULL)
+		err(EXIT_FAILURE, "calloc()");
+	started = 0;
+	for (t = 0; t < nslots; t++) {
+		if (pthread_create(&tids[t], NULL, archive_worker, &pool) != 0)
+			break;
+		started++;
+	}
+	if (started == 0)
+		archive_worker(&pool);
+	for (t = 0; t < started; t++)
+		pthread_join(tids[t], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+	free(tids);
+	free(pool.arcs);
+	return (pool.failed + missing);
+}
+
+/* Test every entry of an archive for the t command, on the same
+   workers as extraction. Returns how many entries failed, or -1 if
+   the archive couldn't be tested at all. */
+static long test_zip_archive(const char *zfile, const struct unzip_opts *opts)
+{
+	zip_t *zip;
+	zip_int64_t entries;
+	zip_uint64_t i;
+	zip_stat_t zs;
+	struct unzip_job *jobs, *job, *r;
+	struct unzip_ctx ctx;
+	struct timespec t0, t1;
+	struct unzip_stats stats, *stp;
+	zip_uint64_t start, pt;
+	char *passw, b1[32], b2[32];
+	size_t njobs, maxjobs, zlen;
+	double secs;
+	int eptr, ret;
+
+	memset(&stats, 0, sizeof(stats));
+	stp = opts->stats ? &stats : NULL;
+	start = pt = stats_start(stp);
+	zip = zip_open(zfile, ZIP_RDONLY | ZIP_CHECKCONS, &eptr);
+	if (zip == NULL) {
+		warnx("%s: %s", zfile, zip_proper_error[eptr]);
+		return (-1);
+	}
+	stats_stop(stp, PHASE_OPEN, pt);
+
+	entries = zip_get_num_entries(zip, 0);
+	jobs = NULL;
+	njobs = maxjobs = 0;
+	passw = NULL;
+	if (first_encrypted(zip, NULL, &zs) == 0) {
+		pt = stats_start(stp);
+		passw = archive_password(zip, zfile, &zs, opts);
+		stats_stop(stp, PHASE_PROMPT, pt);
+		if (passw == NULL) {
+			zip_close(zip);
+			return (-1);
+		}
+	}
+	for (i = 0; i < (zip_uint64_t)entries; i++) {
+		pt = stats_start(stp);
+		ret = zip_stat_index(zip, i, 0, &zs);
+		stats_stop(stp, PHASE_STAT, pt);
+		if (ret != 0)
+			continue;
+		zlen = strlen(zs.name);
+		if (zlen == 0 || zs.name[zlen - 1] == '/')
+			continue;
+
+		if (njobs == maxjobs) {
+			maxjobs = maxjobs ? maxjobs * 2 : 64;
+			r = realloc(jobs, maxjobs * sizeof(*jobs));
+			if (r == NULL) {
+				zip_close(zip);
+				free_unzip_jobs(jobs, njobs);
+				err(EXIT_FAILURE, "realloc()");
+			}
+			jobs = r;
+		}
+
+		job = &jobs[njobs++];
+		memset(job, 0, sizeof(*job));
+		job->idx = i;
+		job->zs = zs;
+		job->dfd = -1;
+		job->label = zs.name;
+		job->passw = zs.encryption_method ? passw : NULL;
+	}
+
+	ctx.zfile = zfile;
+	ctx.opts = opts;
+	ctx.cd = NULL;
+	ctx.out = stdout;
+	ctx.stats = stp;
+	memset(&ctx.tally, 0, sizeof(ctx.tally));
+	ctx.zfd = open(zfile, O_RDONLY);
+	if (ctx.zfd != -1) {
+		posix_fadvise(ctx.zfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		ctx.cd = cdir_read(ctx.zfd, 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = run_unzip_jobs(zip, &ctx, jobs, njobs);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	free_unzip_jobs(jobs, njobs);
+	free(passw);
+	cdir_free(ctx.cd);
+	if (ctx.zfd != -1)
+		close(ctx.zfd);
+	zip_close(zip);
+	if (ret == -1)
+		return (-1);
+
+	secs = (double)(t1.tv_sec - t0.tv_sec) +
+		(double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stdout, "%s: %llu ok, %llu failed, %s in %.2f s (%s/s).\n",
+		zfile, (unsigned long long)ctx.tally.written,
+		(unsigned long long)ctx.tally.failed,
+		human_size(b1, sizeof(b1), ctx.tally.written_bytes), secs,
+		human_size(b2, sizeof(b2), secs > 0 ?
+			   (zip_uint64_t)((double)ctx.tally.written_bytes /
+					  secs) : 0));
+	if (stp)
+		report_stats(&ctx, (double)(clock_ns() - start) / 1e9);
+	return ((long)ctx.tally.failed);
+}
+
+/* Fill the buffer of a stream until it holds at least n bytes from
+   pos on, or the input ends. Returns how many it holds. */
+static size_t zstream_need(struct zstream *zs, size_t n)
+{
+	ssize_t r;
+
+	if (zs->len - zs->pos >= n)
+		return (zs->len - zs->pos);
+
+	memmove(zs->buf, zs->buf + zs->pos, zs->len - zs->pos);
+	zs->len -= zs->pos;
+	zs->pos = 0;
+	while (zs->len < n && zs->eof == 0) {
+		r = read(zs->fd, zs->buf + zs->len, zs->size - zs->len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1) {
+			warn("read()");
+			zs->eof = 1;
+		} else if (r == 0) {
+			zs->eof = 1;
+		}
+		if (r > 0)
+			zs->len += (size_t)r;
+	}
+	return (zs->len);
+}
+
+static void zstream_take(struct zstream *zs, size_t n)
+{
+	zs->pos += n;
+	zs->off += n;
+}
+
+/* Skip n bytes of the stream. */
+static int zstream_skip(struct zstream *zs, zip_uint64_t n)
+{
+	size_t have;
+
+	while (n > 0) {
+		have = zstream_need(zs, 1);
+		if (have == 0)
+			return (-1);
+		if (have > n)
+			have = (size_t)n;
+		zstream_take(zs, have);
+		n -= have;
+	}
+	return (0);
+}
+
+/* Copy the data of a stored entry, whose size is known. */
+static int zstream_copy(struct zstream *zs, struct zstream_entry *ze,
+			int fd)
+{
+	zip_uint64_t left;
+	size_t have;
+
+	for (left = ze->comp_size; left > 0; left -= have) {
+		have = zstream_need(zs, 1);
+		if (have == 0)
+			return (-1);
+		if (have > left)
+			have = (size_t)left;
+		if (fd != -1 && write_all(fd, zs->buf + zs->pos, have) == -1)
+			return (-1);
+		ze->crc = crc32(ze->crc, zs->buf + zs->pos, (uInt)have);
+		zstream_take(zs, have);
+	}
+	ze->size = ze->comp_size;
+	return (0);
+}
+
+/* Copy the data of a stored entry followed by a data descriptor,
+   which is the only way to tell where it ends. A descriptor is taken
+   for the real one when its crc and size match the data before it. */
+static int zstream_copy_dd(struct zstream *zs, struct zstream_entry *ze,
+			   int fd)
+{
+	unsigned char *p, *d;
+	size_t have, k, n, done;
+	uLong crc;
+	int found;
+
+	ze->size = 0;
+	for (found = 0; found == 0;) {
+		/* A descriptor with 64-bit sizes is 24 bytes long. */
+		have = zstream_need(zs, 24);
+		if (have < 16)
+			return (-1);
+
+		p = zs->buf + zs->pos;
+		crc = ze->crc;
+		for (k = 0, done = 0; k + 16 <= have; k++) {
+			d = p + k;
+			if (get32(d) != SIG_DATA_DESC)
+				continue;
+			crc = crc32(crc, p + done, (uInt)(k - done));
+			done = k;
+			if (crc == get32(d + 4) &&
+			    (get32(d + 8) == ze->size + k ||
+			     (k + 24 <= have && get64(d + 8) == ze->size + k))) {
+				found = 1;
+				break;
+			}
+		}
+
+		/* Everything that can't be the start of a descriptor is
+		   data, the rest waits for more input. */
+		if (found)
+			n = k;
+		else if (zs->eof)
+			return (-1);
+		else
+			n = have > 23 ? have - 23 : 0;
+
+		if (n > 0) {
+			if (fd != -1 && write_all(fd, p, n) == -1)
+				return (-1);
+			ze->crc = crc32(ze->crc, p, (uInt)n);
+			ze->size += n;
+			zstream_take(zs, n);
+		}
+	}
+	ze->comp_size = ze->size;
+	return (0);
+}
+
+/* Inflate the data of a deflated entry. zlib finds the end of the
+   data by itself, so the compressed size doesn't have to be known. */
+static int zstream_inflate(struct zstream *zs, struct zstream_entry *ze,
+			   int fd, unsigned char *out, size_t outsize)
+{
+	z_stream z;
+	size_t have, in, produced;
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, -MAX_WBITS) != Z_OK)
+		return (-1);
+
+	ze->size = 0;
+	ret = Z_OK;
+	while (ret != Z_STREAM_END) {
+		have = zstream_need(zs, 1);
+		if (have == 0)
+			break;
+		if ((ze->flags & 1 << 3) == 0 &&
+		    have > ze->comp_size - (zs->off - ze->data))
+			have = (size_t)(ze->comp_size - (zs->off - ze->data));
+
+		z.next_in = zs->buf + zs->pos;
+		z.avail_in = (uInt)have;
+		z.next_out = out;
+		z.avail_out = (uInt)outsize;
+		ret = inflate(&z, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			break;
+
+		in = have - z.avail_in;
+		produced = outsize - z.avail_out;
+		zstream_take(zs, in);
+		if (fd != -1 && write_all(fd, out, produced) == -1) {
+			ret = Z_ERRNO;
+			break;
+		}
+		ze->crc = crc32(ze->crc, out, (uInt)produced);
+		ze->size += produced;
+		if (in == 0 && produced == 0)
+			break;
+	}
+	inflateEnd(&z);
+
+	if (ret != Z_STREAM_END)
+		return (-1);
+	if (ze->flags & 1 << 3)
+		ze->comp_size = zs->off - ze->data;
+	return (zs->off - ze->data == ze->comp_size ? 0 : -1);
+}
+
+/* Read the data descriptor that follows an entry, with or without
+   its signature. */
+static int zstream_descriptor(struct zstream *zs, struct zstream_entry *ze)
+{
+	unsigned char *d;
+	size_t len, have;
+
+	len = ze->zip64 ? 20 : 12;
+	have = zstream_need(zs, len + 4);
+	d = zs->buf + zs->pos;
+	if (have >= 4 && get32(d) == SIG_DATA_DESC &&
+	    (have < len + 4 || get32(d + 4) == ze->crc)) {
+		d += 4;
+		zstream_take(zs, 4);
+		have -= 4;
+	}
+	if (have < len)
+		return (-1);
+
+	ze->want_crc = get32(d);
+	ze->want_comp = ze->zip64 ? get64(d + 4) : get32(d + 4);
+	ze->want_size = ze->zip64 ? get64(d + 12) : get32(d + 8);
+	zstream_take(zs, len);
+	return (0);
+}
+
+/* The finalizer of splitmix64, to spread the fields of an entry over
+   the whole hash. */
+static zip_uint64_t zstream_mix(zip_uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return (x);
+}
+
+/* Add an entry to a digest, with what its local header or its record
+   in the central directory says. name is hashed with crc32(). */
+static void zstream_fold(struct zstream_digest *d, zip_uint64_t lho,
+			 zip_uint64_t comp_size, zip_uint64_t size,
+			 zip_uint32_t crc, zip_uint32_t nlen, zip_uint32_t name)
+{
+	zip_uint64_t h;
+
+	h = zstream_mix(lho);
+	h = zstream_mix(h ^ comp_size);
+	h = zstream_mix(h ^ size);
+	h = zstream_mix(h ^ ((zip_uint64_t)crc << 32 | name));
+	h = zstream_mix(h ^ nlen);
+	d->n++;
+	d->sum += h;
+	d->xor ^= zstream_mix(h + 0x9e3779b97f4a7c15ULL);
+}
+
+/* Step over the end records after the central directory of a stream.
+   Returns -1 if something else comes, or anything after them. */
+static int zstream_end(struct zstream *zs)
+{
+	unsigned char *p;
+	zip_uint64_t len;
+
+	if (zstream_need(zs, 12) >= 12 &&
+	    get32(zs->buf + zs->pos) == SIG_EOCD64) {
+		len = get64(zs->buf + zs->pos + 4);
+		if (zstream_skip(zs, 12 + len) == -1)
+			return (-1);
+	}
+	if (zstream_need(zs, EOCD64_LOC_SIZE) >= EOCD64_LOC_SIZE &&
+	    get32(zs->buf + zs->pos) == SIG_EOCD64_LOC)
+		zstream_take(zs, EOCD64_LOC_SIZE);
+
+	if (zstream_need(zs, EOCD_SIZE) < EOCD_SIZE)
+		return (-1);
+	p = zs->buf + zs->pos;
+	if (get32(p) != SIG_EOCD ||
+	    zstream_skip(zs, EOCD_SIZE + get16(p + 20)) == -1)
+		return (-1);
+	return (zstream_need(zs, 1) == 0 ? 0 : -1);
+}
+
+/* Check the central directory at the end of a stream against the
+   digest of the local headers, and that only the end records come
+   after it. Returns how many of those checks failed. */
+static size_t zstream_verify(struct zstream *zs,
+			     const struct zstream_digest *local)
+{
+	struct zstream_digest cdir;
+	unsigned char *rec;
+	zip_uint64_t lho, comp_size, size;
+	size_t have, nlen, elen, clen, bad;
+
+	memset(&cdir, 0, sizeof(cdir));
+	for (;;) {
+		have = zstream_need(zs, CENTRAL_HDR_SIZE);
+		rec = zs->buf + zs->pos;
+		if (have < CENTRAL_HDR_SIZE || get32(rec) != SIG_CENTRAL)
+			break;
+		nlen = get16(rec + 28);
+		elen = get16(rec + 30);
+		clen = get16(rec + 32);
+		have = zstream_need(zs, CENTRAL_HDR_SIZE + nlen + elen + clen);
+		rec = zs->buf + zs->pos;
+		if (have < CENTRAL_HDR_SIZE + nlen + elen + clen)
+			break;
+
+		comp_size = get32(rec + 20);
+		size = get32(rec + 24);
+		lho = get32(rec + 42);
+		zip64_extra(rec + CENTRAL_HDR_SIZE + nlen, elen,
+			    &size, &comp_size, &lho);
+		zstream_fold(&cdir, lho, comp_size, size, get32(rec + 16),
+			     (zip_uint32_t)nlen,
+			     (zip_uint32_t)crc32(0, rec + CENTRAL_HDR_SIZE,
+						 (uInt)nlen));
+		zstream_take(zs, CENTRAL_HDR_SIZE + nlen + elen + clen);
+	}
+
+	bad = 0;
+	if (cdir.n != local->n) {
+		warnx("the central directory has %zu entries, the stream had %zu.",
+		      cdir.n, local->n);
+		bad++;
+	} else if (cdir.sum != local->sum || cdir.xor != local->xor) {
+		warnx("the central directory doesn't match the local headers.");
+		bad++;
+	}
+
+	/* A central directory with more after it is an old one, which
+	   a reader going by the central directory would skip. */
+	if (zstream_end(zs) == -1) {
+		warnx("the stream goes on after the central directory.");
+		bad++;
+	}
+
+	/* Drain the rest, so whatever writes the pipe doesn't get a
+	   broken pipe. */
+	while (zstream_need(zs, 1) > 0)
+		zstream_take(zs, zs->len - zs->pos);
+	return (bad);
+}
+
+/* Open the file an entry from a stream goes to. There is no terminal
+   to ask about existing files, as standard input is the archive, so
+   they are only replaced with -y. Returns -2 for a directory, -3 for
+   a file that is left alone, and -1 on errors. */
+static int zstream_open(struct dircache *dc, const struct zstream_entry *ze,
+			const struct unzip_opts *opts)
+{
+	const char *leaf;
+	char *dir;
+	size_t nlen;
+	int pdfd, dfd, fd;
+
+	nlen = strlen(ze->name);
+	if (ze->name[nlen - 1] == '/') {
+		dir = strndup(ze->name, nlen - 1);
+		fd = dir ? dircache_dir(dc, dir) : -1;
+		free(dir);
+		if (fd == -1) {
+			warn("mkdir(): %s", ze->name);
+			return (-1);
+		}
+		return (-2);
+	}
+
+	pdfd = dircache_place(dc, ze->name, &leaf);
+	dfd = pdfd == -1 ? -1 : open_beneath(pdfd, leaf, &leaf);
+	if (dfd == -1) {
+		warn("mkdir(): %s", ze->name);
+		return (-1);
+	}
+	fd = openat(dfd, leaf, O_WRONLY | O_CREAT | O_NOFOLLOW |
+		    (opts->all_ok ? O_TRUNC : O_EXCL), 0644);
+	close_beneath(dfd, pdfd);
+	if (fd == -1 && errno == EEXIST) {
+		warnx("skipping %s: it already exists, use -y to "
+		      "replace it.", ze->name);
+		fd = -3;
+	} else if (fd == -1) {
+		warn("open(): %s", ze->name);
+	}
+	return (fd);
+}
+
+/* Extract an archive as it comes from standard input, going by the
+   local headers. Nothing is seeked, and besides the buffers only a
+   digest of the entries is kept, to check the central directory once
+   it arrives. */
+static void unzip_zip_stream(const char *dpath, const struct unzip_opts *opts)
+{
+	struct zstream zs;
+	struct zstream_entry ze;
+	struct zstream_digest digest;
+	struct dircache dc;
+	unsigned char *h, *out;
+	size_t have, nlen, elen, bad;
+	zip_uint32_t sig;
+	int fd, ret, wanted;
 
-	/* Check whether the destination path exists or not. */
 	if (access(dpath, F_OK) == -1)
 		errx(EXIT_FAILURE,
-		     "error: destination path '%s' does not exists.",
-		     dpath);
-    
-	p = calloc(1, sizeof(char));
-	if (p == NULL)
+		     "error: destination path '%s' does not exists.",
+		     dpath);
+	if (dircache_init(&dc, dpath, opts->dirfds) == -1)
+		err(EXIT_FAILURE, "open(): %s", dpath);
+
+	/* A local header with its name and extra field always fits. */
+	memset(&zs, 0, sizeof(zs));
+	zs.fd = STDIN_FILENO;
+	zs.size = opts->bufsize < 256 * 1024 ? 256 * 1024 : opts->bufsize;
+	zs.buf = malloc(zs.size);
+	out = malloc(opts->bufsize);
+	if (zs.buf == NULL || out == NULL)
+		err(EXIT_FAILURE, "malloc()");
+
+	memset(&digest, 0, sizeof(digest));
+	bad = 0;
+	for (;;) {
+		have = zstream_need(&zs, 4);
+		if (have < 4)
+			errx(EXIT_FAILURE, "error: the stream ended early.");
+		sig = get32(zs.buf + zs.pos);
+
+		/* Split archives start with a marker of their own. */
+		if (sig == SIG_DATA_DESC && zs.off == 0) {
+			zstream_take(&zs, 4);
+			continue;
+		}
+		if (sig == SIG_CENTRAL || sig == SIG_EOCD)
+			break;
+		if (sig != SIG_LOCAL)
+			errx(EXIT_FAILURE, "error: %s",
+			     zip_proper_error[zs.off ? ZIP_ER_INCONS : ZIP_ER_NOZIP]);
+
+		have = zstream_need(&zs, LOCAL_HDR_SIZE);
+		h = zs.buf + zs.pos;
+		if (have < LOCAL_HDR_SIZE)
+			errx(EXIT_FAILURE, "error: the stream ended early.");
+		nlen = get16(h + 26);
+		elen = get16(h + 28);
+		have = zstream_need(&zs, LOCAL_HDR_SIZE + nlen + elen);
+		h = zs.buf + zs.pos;
+		if (have < LOCAL_HDR_SIZE + nlen + elen)
+			errx(EXIT_FAILURE, "error: the stream ended early.");
+
+		memset(&ze, 0, sizeof(ze));
+		ze.lho = zs.off;
+		ze.flags = get16(h + 6);
+		ze.method = get16(h + 8);
+		ze.want_crc = get32(h + 14);
+		ze.comp_size = get32(h + 18);
+		ze.want_size = get32(h + 22);
+		ze.zip64 = zip64_extra(h + LOCAL_HDR_SIZE + nlen, elen,
+				       &ze.want_size, &ze.comp_size, NULL);
+		ze.want_comp = ze.comp_size;
+		ze.nlen = nlen;
+		ze.hash = crc32(0, h + LOCAL_HDR_SIZE, (uInt)nlen);
+		ze.name = strndup((char *)h + LOCAL_HDR_SIZE, nlen);
+		if (ze.name == NULL)
+			err(EXIT_FAILURE, "strndup()");
+		zstream_take(&zs, LOCAL_HDR_SIZE + nlen + elen);
+		ze.data = zs.off;
+
+		/* Everything has to be read, wanted or not. */
+		wanted = nlen > 0 && safe_name(ze.name) &&
+			(opts->include == NULL ||
+			 name_query_match(opts->include, ze.name)) &&
+			(opts->exclude == NULL ||
+			 name_query_match(opts->exclude, ze.name) == 0);
+		if (nlen > 0 && safe_name(ze.name) == 0) {
+			warnx("skipping %s: unsafe path.", ze.name);
+			bad++;
+		}
+
+		if ((ze.flags & 1) ||
+		    (ze.method != ZIP_CM_STORE && ze.method != ZIP_CM_DEFLATE)) {
+			/* Without sizes there is no telling where it ends. */
+			ret = ze.flags & 1 ? ZIP_ER_ENCRNOTSUPP :
+				ZIP_ER_COMPNOTSUPP;
+			if (ze.flags & 1 << 3)
+				errx(EXIT_FAILURE, "error: %s: %s", ze.name,
+				     zip_proper_error[ret]);
+			warnx("skipping %s: %s", ze.name, zip_proper_error[ret]);
+			if (zstream_skip(&zs, ze.comp_size) == -1)
+				errx(EXIT_FAILURE, "error: the stream ended early.");
+			free(ze.name);
+			bad++;
+			continue;
+		}
+
+		fd = -1;
+		if (wanted) {
+			fd = zstream_open(&dc, &ze, opts);
+			if (fd == -1)
+				bad++;
+		}
+
+		if (ze.method == ZIP_CM_DEFLATE)
+			ret = zstream_inflate(&zs, &ze, fd < 0 ? -1 : fd,
+					      out, opts->bufsize);
+		else if (ze.flags & 1 << 3)
+			ret = zstream_copy_dd(&zs, &ze, fd < 0 ? -1 : fd);
+		else
+			ret = zstream_copy(&zs, &ze, fd < 0 ? -1 : fd);
+		if (ret == 0 && (ze.flags & 1 << 3))
+			ret = zstream_descriptor(&zs, &ze);
+
+		/* Bad data can be stepped over if its size is known, the
+		   stream is lost otherwise. */
+		if (ret == -1) {
+			if (fd >= 0) {
+				fprintf(stdout, " inflating: %s .. [error]\n",
+					ze.name);
+				close(fd);
+			}
+			if ((ze.flags & 1 << 3) || zs.off > ze.data + ze.want_comp ||
+			    zstream_skip(&zs, ze.data + ze.want_comp - zs.off) == -1)
+				errx(EXIT_FAILURE, "error: %s: %s", ze.name,
+				     zip_proper_error[ZIP_ER_READ]);
+			warnx("%s: %s", ze.name, zip_proper_error[ZIP_ER_INCONS]);
+			fd = -1;
+
+			/* Already told, the central directory is checked
+			   against the header alone. */
+			ze.crc = ze.want_crc;
+			ze.size = ze.want_size;
+			ze.comp_size = ze.want_comp;
+		}
+
+		if (ret == -1) {
+			bad++;
+		} else if (ze.crc != ze.want_crc || ze.size != ze.want_size ||
+			   ze.comp_size != ze.want_comp) {
+			if (fd >= 0)
+				fprintf(stdout, " inflating: %s .. "
+					"[crc error]\n", ze.name);
+			else
+				warnx("%s: %s", ze.name,
+				      zip_proper_error[ZIP_ER_CRC]);
+			bad++;
+		} else if (fd >= 0 && opts->quiet == 0) {
+			fprintf(stdout, " inflating: %s .. [ok]\n", ze.name);
+		}
+		if (fd >= 0)
+			close(fd);
+
+		zstream_fold(&digest, ze.lho, ze.comp_size, ze.size, ze.crc,
+			     (zip_uint32_t)ze.nlen, ze.hash);
+		free(ze.name);
+	}
+
+	bad += zstream_verify(&zs, &digest);
+	if (opts->include)
+		name_query_report(opts->include);
+
+	free(out);
+	free(zs.buf);
+	dircache_free(&dc);
+	if (bad)
+		exit(EXIT_FAILURE);
+}
+
+/* List the entries of an archive, from its sidecar index if it has
+   one (or gets one, with index). */
+static void zip_list_all_files(const char *zfile, int index)
+{
+	zip_t *zip;
+	zip_int64_t entries;
+	zip_uint64_t i;
+	zip_stat_t zs;
+	struct lzidx x;
+	char dfmt[11], tfmt[6];
+	struct tm *t;
+	int eptr;
+
+	zip = NULL;
+	if (lzidx_open(&x, zfile, index) == 0) {
+		entries = (zip_int64_t)x.head->nentries;
+	} else {
+		zip = zip_open(zfile, ZIP_NONE, &eptr);
+		if (zip == NULL)
+			zip_basic_error_exit(NULL, eptr);
+		entries = zip_get_num_entries(zip, ZIP_FL_NONE);
+	}
+
+	/* Iterate over the entries. */
+	for (i = 0; i < (zip_uint64_t)entries; i++) {
+		if (zip == NULL)
+			lzidx_stat(&x, i, &zs);
+		else if (zip_stat_index(zip, i, 0, &zs) == -1)
+			zip_basic_error_exit(zip, 0);
+		if (zs.name[0] == '\0')
+			continue;
+
+		t = localtime(&zs.mtime);
+		strftime(dfmt, sizeof(dfmt), "%Y-%m-%d", t);
+		strftime(tfmt, sizeof(tfmt), "%H:%M", t);
+		if (zs.name[strlen(zs.name) - 1] == '/')
+			fprintf(stdout, "%s %s %s (directory)\n",
+				dfmt, tfmt, zs.name);
+		else
+			fprintf(stdout, "%s %s %s (%zu bytes)\n",
+				dfmt, tfmt, zs.name, zs.size);
+	}
+
+	if (zip)
+		zip_close(zip);
+	lzidx_close(&x);
+}
+
+/* Hand the buffer of a pipe to write(), once it is full or at the
+   end. */
+static int pipe_flush(struct zpipe *zp)
+{
+	if (zp->len > 0 && write_all(zp->fd, zp->buf, zp->len) == -1) {
+		dwarn(zp->err, "write()");
+		return (-1);
+	}
+	zp->len = 0;
+	return (0);
+}
+
+static int pipe_put(struct zpipe *zp, const void *p, size_t n)
+{
+	size_t k;
+
+	while (n > 0) {
+		if (zp->len == zp->size && pipe_flush(zp) == -1)
+			return (-1);
+		k = zp->size - zp->len < n ? zp->size - zp->len : n;
+		memcpy(zp->buf + zp->len, p, k);
+		zp->len += k;
+		p = (const char *)p + k;
+		n -= k;
+	}
+	return (0);
+}
+
+/* Send the data of an entry down the pipe. libzip reads straight
+   into the buffer, which is written out whenever it fills up. passw
+   is that of the archive, if it has encrypted entries. */
+static int pipe_entry(struct zpipe *zp, zip_t *zip, const zip_stat_t *zs,
+		      zip_uint64_t idx, const char *passw)
+{
+	zip_file_t *zfp;
+	zip_int64_t reads;
+	zip_uint64_t left;
+	size_t want;
+
+	if (passw)
+		/* Open a zip file that may be encrypted. */
+		zfp = zip_fopen_index_encrypted(zip, idx, 0, passw);
+	else
+		/* Open a generic zip file. */
+		zfp = zip_fopen_index(zip, idx, 0);
+	if (zfp == NULL) {
+		dwarnx(zp->err, "error: %s: %s", zs->name,
+		       zip_error_string(zip_get_error(zip)));
+		return (-1);
+	}
+
+	for (left = zs->size; left > 0; left -= (zip_uint64_t)reads) {
+		if (zp->len == zp->size && pipe_flush(zp) == -1)
+			break;
+		want = zp->size - zp->len;
+		if (want > left)
+			want = (size_t)left;
+		reads = zip_fread(zfp, zp->buf + zp->len, want);
+		if (reads <= 0) {
+			dwarnx(zp->err, "error: %s: %s", zs->name, reads == 0 ?
+			       zip_proper_error[ZIP_ER_EOF] :
+			       zip_error_string(zip_file_get_error(zfp)));
+			break;
+		}
+		zp->len += (size_t)reads;
+	}
+	zip_fclose(zfp);
+	return (left == 0 ? 0 : -1);
+}
+
+/* Send a stored or deflated entry down the pipe straight from the
+   archive, for entries found in the sidecar index. Inflated data goes
+   right into the pipe buffer. */
+static int pipe_raw_entry(struct zpipe *zp, int zfd,
+			  const struct cdir_entry *ce, unsigned char *in,
+			  size_t insize)
+{
+	z_stream z;
+	zip_uint64_t off, left, out;
+	const char *why;
+	size_t n;
+	uLong crc;
+	int zr;
+
+	if (cdir_data_offset(zfd, ce, &off) == -1) {
+		dwarnx(zp->err, "error: %s: cannot read the local header",
+		       ce->name);
+		return (-1);
+	}
+
+	crc = crc32(0L, Z_NULL, 0);
+	left = ce->comp_size;
+	out = 0;
+	why = NULL;
+	if (ce->method == ZIP_CM_STORE) {
+		for (; left > 0; off += n, left -= n, out += n) {
+			if (zp->len == zp->size && pipe_flush(zp) == -1)
+				return (-1);
+			n = zp->size - zp->len;
+			if (n > left)
+				n = (size_t)left;
+			if (pread_full(zfd, zp->buf + zp->len, n, off) == -1) {
+				why = "cannot read the data";
+				break;
+			}
+			crc = crc32_fast(crc, (unsigned char *)zp->buf +
+					 zp->len, n);
+			zp->len += n;
+		}
+	} else {
+		memset(&z, 0, sizeof(z));
+		if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+			dwarnx(zp->err, "error: %s: inflateInit2() failed",
+			       ce->name);
+			return (-1);
+		}
+		do {
+			if (z.avail_in == 0) {
+				if (left == 0) {
+					why = "the data is truncated";
+					break;
+				}
+				n = left < insize ? (size_t)left : insize;
+				if (pread_full(zfd, in, n, off) == -1) {
+					why = "cannot read the data";
+					break;
+				}
+				z.next_in = in;
+				z.avail_in = (uInt)n;
+				off += n;
+				left -= n;
+			}
+			if (zp->len == zp->size && pipe_flush(zp) == -1) {
+				inflateEnd(&z);
+				return (-1);
+			}
+			z.next_out = (Bytef *)zp->buf + zp->len;
+			z.avail_out = (uInt)(zp->size - zp->len);
+			zr = inflate(&z, Z_NO_FLUSH);
+			if (zr != Z_OK && zr != Z_STREAM_END) {
+				why = "invalid compressed data";
+				break;
+			}
+			n = zp->size - zp->len - z.avail_out;
+			crc = crc32_fast(crc, (unsigned char *)zp->buf +
+					 zp->len, n);
+			zp->len += n;
+			out += n;
+		} while (zr != Z_STREAM_END);
+		inflateEnd(&z);
+	}
+
+	if (why == NULL && out != ce->size)
+		why = "wrong size";
+	if (why == NULL && crc != ce->crc)
+		why = "bad crc";
+	if (why) {
+		dwarnx(zp->err, "error: %s: %s", ce->name, why);
+		return (-1);
+	}
+	return (0);
+}
+
+/* Write a number into an octal field of a tar header, and tell
+   whether it fit. */
+static int tar_octal(char *field, size_t len, zip_uint64_t v)
+{
+	size_t k;
+
+	field[len - 1] = '\0';
+	for (k = len - 1; k > 0; k--) {
+		field[k - 1] = (char)('0' + (v & 7));
+		v >>= 3;
+	}
+	return (v == 0);
+}
+
+/* Pad what was written of a tar member up to the next block. */
+static int tar_pad(struct zpipe *zp, zip_uint64_t size)
+{
+	static const char zero[TAR_BLOCK];
+
+	if (size % TAR_BLOCK == 0)
+		return (0);
+	return (pipe_put(zp, zero, TAR_BLOCK - (size_t)(size % TAR_BLOCK)));
+}
+
+/* Add one pax record, "<len> <key>=<value>\n", where len counts the
+   whole record including its own digits. */
+static int tar_pax_record(char *buf, size_t cap, size_t *at,
+			  const char *key, const char *val)
+{
+	size_t len, total, n;
+
+	len = strlen(key) + strlen(val) + 3;
+	for (total = len + 1; len + (size_t)snprintf(NULL, 0, "%zu", total) !=
+		     total;)
+		total = len + (size_t)snprintf(NULL, 0, "%zu", total);
+	n = (size_t)snprintf(buf + *at, cap - *at, "%zu %s=%s\n",
+			     total, key, val);
+	if (n >= cap - *at)
+		return (-1);
+	*at += n;
+	return (0);
+}
+
+/* Fill in a ustar header. The checksum is the sum of the bytes of the
+   header, with the checksum field taken as spaces. */
+static void tar_header(unsigned char *h, const char *name, size_t nlen,
+		       const char *prefix, size_t plen, zip_uint64_t size,
+		       time_t mtime, unsigned mode, char type)
+{
+	unsigned sum;
+	size_t k;
+
+	memset(h, 0, TAR_BLOCK);
+	memcpy(h, name, nlen);
+	memcpy(h + 345, prefix, plen);
+	tar_octal((char *)h + 100, 8, mode);
+	tar_octal((char *)h + 108, 8, 0);
+	tar_octal((char *)h + 116, 8, 0);
+	tar_octal((char *)h + 124, 12, size);
+	tar_octal((char *)h + 136, 12, mtime > 0 ? (zip_uint64_t)mtime : 0);
+	h[156] = (unsigned char)type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+
+	memset(h + 148, ' ', 8);
+	for (sum = 0, k = 0; k < TAR_BLOCK; k++)
+		sum += h[k];
+	snprintf((char *)h + 148, 8, "%06o", sum);
+}
+
+/* Write the header of an entry as a tar member, with the permissions
+   of mode, or the usual ones if it is 0. A name that doesn't fit in
+   the ustar fields, or a size of 8 GiB or more, goes into a pax
+   extended header first. */
+static int tar_entry_header(struct zpipe *zp, const zip_stat_t *zs,
+			    unsigned mode, char type)
+{
+	unsigned char h[TAR_BLOCK];
+	char *pax, num[32];
+	const char *name, *slash;
+	size_t nlen, plen, at, cap;
+	zip_uint64_t size;
+	int long_name, ret;
+
+	name = zs->name;
+	nlen = strlen(name);
+	size = type == '5' ? 0 : zs->size;
+	if (mode == 0)
+		mode = type == '5' ? 0755 : 0644;
+
+	/* Split the name between prefix and name at a slash. */
+	plen = 0;
+	long_name = nlen > TAR_NAME_MAX;
+	if (long_name) {
+		for (slash = name + nlen - 1; slash > name; slash--) {
+			if (*slash == '/' && slash != name + nlen - 1 &&
+			    (size_t)(slash - name) <= TAR_PREFIX_MAX &&
+			    nlen - (size_t)(slash - name) - 1 <= TAR_NAME_MAX)
+				break;
+		}
+		if (slash > name) {
+			long_name = 0;
+			plen = (size_t)(slash - name);
+			name = slash + 1;
+			nlen -= plen + 1;
+		}
+	}
+
+	if (long_name || size >> 33) {
+		cap = strlen(zs->name) + 64;
+		pax = malloc(cap);
+		if (pax == NULL) {
+			dwarn(zp->err, "malloc()");
+			return (-1);
+		}
+		at = 0;
+		snprintf(num, sizeof(num), "%llu", (unsigned long long)size);
+		if ((long_name &&
+		     tar_pax_record(pax, cap, &at, "path", zs->name) == -1) ||
+		    (size >> 33 &&
+		     tar_pax_record(pax, cap, &at, "size", num) == -1)) {
+			dwarnx(zp->err, "error: %s: the pax header is too long",
+			       zs->name);
+			free(pax);
+			return (-1);
+		}
+		tar_header(h, "././@PaxHeader", 14, "", 0, at, zs->mtime,
+			   0644, 'x');
+		ret = pipe_put(zp, h, sizeof(h)) == -1 ||
+			pipe_put(zp, pax, at) == -1 || tar_pad(zp, at) == -1;
+		free(pax);
+		if (ret)
+			return (-1);
+		if (long_name) {
+			nlen = TAR_NAME_MAX;
+			plen = 0;
+		}
+	}
+
+	tar_header(h, name, nlen, zs->name, plen,
+		   size >> 33 ? 0 : size, zs->mtime, mode, type);
+	return (pipe_put(zp, h, sizeof(h)));
+}
+
+/* Send an entry down the pipe: straight from the archive if the index
+   has it stored or deflated, through libzip otherwise. With an index,
+   the archive is only opened with libzip for such entries. */
+static int pipe_any_entry(struct zpipe *zp, const char *zfile, zip_t **zip,
+			  const struct lzidx *x, int zfd, unsigned char *in,
+			  const zip_stat_t *zs, zip_uint64_t idx,
+			  const char *passw)
+{
+	struct cdir_entry ce;
+	int eptr;
+
+	if (x->map) {
+		lzidx_cdir_entry(x, idx, &ce);
+		if ((ce.flags & 1) == 0 && (ce.method == ZIP_CM_STORE ||
+					    ce.method == ZIP_CM_DEFLATE))
+			return (pipe_raw_entry(zp, zfd, &ce, in, ZBUF_DEFAULT));
+	}
+	if (*zip == NULL) {
+		*zip = zip_open(zfile, ZIP_RDONLY, &eptr);
+		if (*zip == NULL)
+			zip_basic_error_exit(NULL, eptr);
+	}
+	return (pipe_entry(zp, *zip, zs, idx, passw));
+}
+
+/* The permissions of entry i as the index or libzip have them, see
+   cdir_rec_mode(). */
+static unsigned pipe_entry_mode(zip_t *zip, const struct lzidx *x,
+				zip_uint64_t i)
+{
+	zip_uint8_t opsys;
+	zip_uint32_t attr;
+
+	if (x->map)
+		return (x->e[i].mode);
+	if (zip_file_get_external_attributes(zip, i, 0, &opsys, &attr) == -1 ||
+	    opsys != ZIP_OPSYS_UNIX)
+		return (0);
+	return (attr >> 16 & 07777);
+}
+
+/* Write the entries of an archive to standard output, either their
+   bare contents one after the other, or as a tar stream. Entries can
+   be picked like for d. */
+static void zip_pipe_files(const char *zfile, char **names, size_t nnames,
+			   int to_tar, int index,
+			   const struct unzip_opts *opts)
+{
+	static const char zero[TAR_BLOCK * 2];
+	zip_t *zip;
+	zip_int64_t entries;
+	zip_uint64_t i;
+	zip_stat_t zs;
+	struct zpipe zp;
+	struct name_query q;
+	struct name_index ni;
+	struct lzidx x;
+	unsigned char *sel, *in;
+	size_t missed;
+	char *passw, type;
+	int eptr, failed, zfd;
+
+	/* The index answers the lookups and has what the raw reader
+	   needs, libzip is left for the other entries. */
+	zip = NULL;
+	in = NULL;
+	zfd = -1;
+	if (lzidx_open(&x, zfile, index) == 0) {
+		entries = (zip_int64_t)x.head->nentries;
+		zfd = open(zfile, O_RDONLY);
+		in = malloc(ZBUF_DEFAULT);
+		if (zfd == -1 || in == NULL)
+			err(EXIT_FAILURE, "cannot read '%s'", zfile);
+	} else {
+		zip = zip_open(zfile, ZIP_RDONLY, &eptr);
+		if (zip == NULL)
+			zip_basic_error_exit(NULL, eptr);
+		entries = zip_get_num_entries(zip, ZIP_FL_NONE);
+	}
+
+	sel = NULL;
+	missed = 0;
+	if (nnames > 0) {
+		name_query_init(&q, names, nnames, 0);
+		sel = calloc((size_t)entries + 1, 1);
+		if (sel == NULL)
+			err(EXIT_FAILURE, "calloc()");
+		if (x.map) {
+			lzidx_select(&x, &q, sel);
+		} else {
+			if (name_index_zip(&ni, zip) == -1)
+				zip_basic_error_exit(zip, 0);
+			name_query_select(&q, &ni, sel);
+			name_index_free(&ni);
+		}
+		missed = name_query_report(&q);
+		name_query_free(&q);
+	}
+
+	/* Like for x, one password for the whole archive, checked before
+	   anything is written. Standard output is the data, so it can't
+	   be asked for there. */
+	for (i = 0; x.map && zip == NULL && i < (zip_uint64_t)entries; i++) {
+		if ((sel == NULL || sel[i]) && (x.e[i].flags & 1)) {
+			zip = zip_open(zfile, ZIP_RDONLY, &eptr);
+			if (zip == NULL)
+				zip_basic_error_exit(NULL, eptr);
+		}
+	}
+	passw = NULL;
+	if (zip && first_encrypted(zip, sel, &zs) == 0) {
+		if (opts->passw == NULL)
+			errx(EXIT_FAILURE, "%s: encrypted files need "
+			     "--password-file, --password-fd or "
+			     PASSWORD_ENV ".", zfile);
+		passw = archive_password(zip, zfile, &zs, opts);
+		if (passw == NULL)
+			exit(EXIT_FAILURE);
+	}
+
+	zp.fd = STDOUT_FILENO;
+	zp.err = STDERR_FILENO;
+	zp.size = opts->bufsize;
+	zp.len = 0;
+	if (posix_memalign((void **)&zp.buf, ZBUF_ALIGN, zp.size) != 0)
+		err(EXIT_FAILURE, "posix_memalign()");
+
+	failed = 0;
+	for (i = 0; i < (zip_uint64_t)entries && failed == 0; i++) {
+		if (sel && sel[i] == 0)
+			continue;
+		if (x.map)
+			lzidx_stat(&x, i, &zs);
+		else if (zip_stat_index(zip, i, 0, &zs) == -1)
+			zip_basic_error_exit(zip, 0);
+		if (zs.name[0] == '\0')
+			continue;
+
+		type = zs.name[strlen(zs.name) - 1] == '/' ? '5' : '0';
+		if (to_tar == 0) {
+			if (type == '0' && pipe_any_entry(&zp, zfile, &zip, &x,
+							  zfd, in, &zs, i,
+							  passw) == -1)
+				failed = 1;
+			continue;
+		}
+
+		if (tar_entry_header(&zp, &zs, pipe_entry_mode(zip, &x, i),
+				     type) == -1 ||
+		    (type == '0' && (pipe_any_entry(&zp, zfile, &zip, &x, zfd,
+						    in, &zs, i, passw) == -1 ||
+				     tar_pad(&zp, zs.size) == -1)))
+			failed = 1;
+	}
+
+	/* A tar stream ends with two empty blocks. */
+	if (to_tar && failed == 0 && pipe_put(&zp, zero, sizeof(zero)) == -1)
+		failed = 1;
+	if (pipe_flush(&zp) == -1)
+		failed = 1;
+
+	free(zp.buf);
+	free(sel);
+	free(in);
+	free(passw);
+	if (zfd != -1)
+		close(zfd);
+	lzidx_close(&x);
+	if (zip)
+		zip_close(zip);
+	if (failed || missed)
+		exit(EXIT_FAILURE);
+}
+
+/* Open an archive for editing its central directory in place. */
+static struct cdir *cdir_open_rw(const char *zfile, int *fd)
+{
+	struct cdir *cd;
+
+	*fd = open(zfile, O_RDWR);
+	if (*fd == -1)
+		err(EXIT_FAILURE, "open(): %s", zfile);
+
+	cd = cdir_read(*fd, 1);
+	if (cd == NULL) {
+		close(*fd);
+		errx(EXIT_FAILURE, "error: %s", zip_proper_error[ZIP_ER_NOZIP]);
+	}
+	return (cd);
+}
+
+static void zip_archive_file_delete(const char *zfile, char **names,
+				    size_t nnames, int in_place)
+{
+	zip_t *zip;
+	zip_uint64_t i;
+	struct name_query q;
+	struct name_index ni;
+	struct cdir *cd;
+	unsigned char *sel;
+	size_t deleted, missed;
+	int eptr, fd;
+
+	name_query_init(&q, names, nnames, 0);
+
+	if (in_place) {
+		/* Only the central directory is written again, the data
+		   of deleted entries stays where it is until compact. */
+		cd = cdir_open_rw(zfile, &fd);
+		sel = calloc((size_t)cd->nentries + 1, 1);
+		if (sel == NULL || name_index_cdir(&ni, cd) == -1)
+			err(EXIT_FAILURE, "malloc()");
+
+		deleted = name_query_select(&q, &ni, sel);
+		for (i = 0; i < cd->nentries; i++)
+			cd->e[i].deleted = sel[i];
+
+		missed = name_query_report(&q);
+		if (deleted > 0 && cdir_write(fd, cd) == -1)
+			err(EXIT_FAILURE, "cannot write the central directory");
+		name_index_free(&ni);
+		cdir_free(cd);
+		close(fd);
+	} else {
+		zip = zip_open(zfile, ZIP_NONE, &eptr);
+		if (zip == NULL)
+			zip_basic_error_exit(NULL, eptr);
+		if (name_index_zip(&ni, zip) == -1)
+			zip_basic_error_exit(zip, 0);
+		sel = calloc(ni.n + 1, 1);
+		if (sel == NULL)
+			err(EXIT_FAILURE, "calloc()");
+
+		/* Everything that has to go is marked first, and a
+		   single zip_close() writes the archive once. */
+		deleted = name_query_select(&q, &ni, sel);
+		for (i = 0; i < ni.n; i++) {
+			if (sel[i] && zip_delete(zip, i) == -1)
+				zip_basic_error_exit(zip, 0);
+		}
+		name_index_free(&ni);
+
+		/* Tell about the names that didn't match anything,
+		   without giving up on the ones that did. */
+		missed = name_query_report(&q);
+		if (deleted > 0 && zip_close(zip) == -1) {
+			warnx("error: %s",
+			      zip_error_string(zip_get_error(zip)));
+			zip_discard(zip);
+			exit(EXIT_FAILURE);
+		} else if (deleted == 0) {
+			zip_discard(zip);
+		}
+	}
+
+	if (deleted > 0)
+		fprintf(stdout, "%zu file(s) were deleted from the archive.\n",
+			deleted);
+
+	free(sel);
+	name_query_free(&q);
+	if (missed)
+		exit(EXIT_FAILURE);
+}
+
+/* Work out what a rename does: every entry named old_name gets
+   new_name and, if old_name is a directory, everything under it is
+   moved along. Exits if a new name is already taken. */
+static size_t rename_plan(const struct name_index *ni, const char *old_name,
+			  const char *new_name, struct rename_op **ops)
+{
+	struct name_ent *ne, *taken;
+	size_t k, count, olen, nlen, tcount;
+	int dir;
+
+	olen = strlen(old_name);
+	nlen = strlen(new_name);
+	dir = old_name[olen - 1] == '/';
+	if (dir)
+		ne = name_index_prefix(ni, old_name, &count);
+	else
+		ne = name_index_find(ni, old_name, &count);
+
+	*ops = calloc(count + 1, sizeof(**ops));
+	if (*ops == NULL)
+		err(EXIT_FAILURE, "calloc()");
+
+	for (k = 0; k < count; k++) {
+		(*ops)[k].idx = ne[k].idx;
+		(*ops)[k].name = malloc(nlen + strlen(ne[k].name) - olen + 2);
+		if ((*ops)[k].name == NULL)
+			err(EXIT_FAILURE, "malloc()");
+		sprintf((*ops)[k].name, "%s%s%s", new_name,
+			dir && new_name[nlen - 1] != '/' ? "/" : "",
+			ne[k].name + olen);
+
+		/* A name that is moved away anyway doesn't count. */
+		taken = name_index_find(ni, (*ops)[k].name, &tcount);
+		if (taken && (dir ? strncmp(taken->name, old_name, olen) != 0 :
+			      strcmp(taken->name, old_name) != 0))
+			errx(EXIT_FAILURE, "error: %s",
+			     zip_proper_error[ZIP_ER_EXISTS]);
+	}
+	return (count);
+}
+
+static void rename_ops_free(struct rename_op *ops, size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		free(ops[k].name);
+	free(ops);
+}
+
+static void zip_archive_file_rename(const char *zfile, const char *old_name,
+				    const char *new_name, int in_place)
+{
+	zip_t *zip;
+	struct name_index ni;
+	struct rename_op *ops;
+	struct cdir *cd;
+	size_t k, n;
+	int eptr, fd, fits;
+
+        /* No need to check for NULL, as we are sure that arguments
+	   will be passed, but we are not sure whether those arguments
+	   actually will have anything or not. */
+	if (strlen(old_name) == 0)
+	        errx(EXIT_FAILURE,
+		     "error: old file path cannot be an empty string.");
+	if (strlen(new_name) == 0)
+		errx(EXIT_FAILURE,
+		     "error: new file path cannot be an empty string.");
+
+	if (in_place) {
+		/* Only the central directory is written again. */
+		cd = cdir_open_rw(zfile, &fd);
+		if (name_index_cdir(&ni, cd) == -1)
+			err(EXIT_FAILURE, "malloc()");
+
+		n = rename_plan(&ni, old_name, new_name, &ops);
+		for (k = 0, fits = 1; k < n && fits == 1; k++)
+			fits = cdir_local_name_fits(fd, &cd->e[ops[k].idx],
+						    ops[k].name);
+		if (fits == -1)
+			errx(EXIT_FAILURE, "error: %s",
+			     zip_proper_error[ZIP_ER_NOZIP]);
+
+		/* A name of another length takes the whole archive. */
+		if (fits == 0) {
+			warnx("warning: the new name has another length, "
+			      "'%s' is written again.", zfile);
+			name_index_free(&ni);
+			rename_ops_free(ops, n);
+			in_place = 0;
+		}
+		for (k = 0; k < n && in_place; k++) {
+			cd->e[ops[k].idx].new_name = ops[k].name;
+			if (cdir_patch_local_name(fd, &cd->e[ops[k].idx]) == -1)
+				err(EXIT_FAILURE,
+				    "cannot write the local header");
+		}
+
+		if (in_place && n > 0 && cdir_write(fd, cd) == -1)
+			err(EXIT_FAILURE, "cannot write the central directory");
+		cdir_free(cd);
+		close(fd);
+	}
+	if (in_place == 0) {
+		zip = zip_open(zfile, ZIP_NONE, &eptr);
+		if (zip == NULL)
+			zip_basic_error_exit(NULL, eptr);
+		if (name_index_zip(&ni, zip) == -1)
+			zip_basic_error_exit(zip, 0);
+
+		n = rename_plan(&ni, old_name, new_name, &ops);
+		for (k = 0; k < n; k++) {
+			if (zip_file_rename(zip, ops[k].idx, ops[k].name,
+					    ZIP_FL_ENC_GUESS) == -1)
+				zip_basic_error_exit(zip, 0);
+		}
+
+		if (n > 0 && zip_close(zip) == -1) {
+			warnx("error: %s",
+			      zip_error_string(zip_get_error(zip)));
+			zip_discard(zip);
+			exit(EXIT_FAILURE);
+		} else if (n == 0) {
+			zip_discard(zip);
+		}
+	}
+
+	name_index_free(&ni);
+	rename_ops_free(ops, n);
+	if (n == 0)
+		errx(EXIT_FAILURE,
+		     "error: no archived file was found with name '%s'.",
+		     old_name);
+	else
+	        fprintf(stdout, "changed from '%s' to '%s'.\n",
+			old_name, new_name);
+}
+
+/* Copy an entry into a compacted archive, giving its local header
+   the name from the central directory if an in-place rename left it
+   with another one. Tell how many bytes were written. */
+static int compact_entry(int fd, const struct cdir_entry *ce, int out,
+			 struct unzip_io *io, zip_uint64_t *written)
+{
+	unsigned char lh[LOCAL_HDR_SIZE];
+	zip_uint64_t span, skip;
+	size_t nlen, olen;
+	char *old;
+	int same;
+
+	if (cdir_entry_span(fd, ce, &span) == -1 ||
+	    pread_full(fd, lh, sizeof(lh), ce->lho) == -1)
+		return (-1);
+
+	nlen = strlen(ce->name);
+	olen = get16(lh + 26);
+	old = malloc(olen + 1);
+	if (old == NULL ||
+	    pread_full(fd, old, olen, ce->lho + LOCAL_HDR_SIZE) == -1) {
+		free(old);
+		return (-1);
+	}
+	same = olen == nlen && memcmp(old, ce->name, nlen) == 0;
+	free(old);
+
+	if (same) {
+		*written = span;
+		return (copy_archive_range(fd, ce->lho, out, span, io));
+	}
+
+	put16(lh + 26, (zip_uint16_t)nlen);
+	if (is_ascii(ce->name) == 0)
+		put16(lh + 6, get16(lh + 6) | 1 << 11);
+	skip = LOCAL_HDR_SIZE + olen;
+	if (write_all(out, lh, sizeof(lh)) == -1 ||
+	    write_all(out, ce->name, nlen) == -1 ||
+	    copy_archive_range(fd, ce->lho + skip, out, span - skip, io) == -1)
+		return (-1);
+	*written = LOCAL_HDR_SIZE + nlen + span - skip;
+	return (0);
+}
+
+static int cdir_cmp_lho(const void *a, const void *b)
+{
+	const struct cdir_entry *ea, *eb;
+
+	ea = *(const struct cdir_entry *const *)a;
+	eb = *(const struct cdir_entry *const *)b;
+	return (ea->lho < eb->lho ? -1 : ea->lho > eb->lho);
+}
+
+/* Rewrite an archive without the space left behind by in-place
+   deletes and renames. The members are copied as they are, in their
+   current order, into a temporary file that replaces the archive. */
+static void zip_archive_compact(const char *zfile)
+{
+	struct cdir *cd;
+	struct cdir_entry **order;
+	struct unzip_opts opts;
+	struct unzip_io io;
+	struct stat st;
+	zip_uint64_t i, span, w, prev, prev_to;
+	unsigned char *buf;
+	char *tmp;
+	size_t len;
+	int fd, out;
+
+	fd = open(zfile, O_RDONLY);
+	if (fd == -1)
+		err(EXIT_FAILURE, "open(): %s", zfile);
+	if (fstat(fd, &st) == -1)
+		err(EXIT_FAILURE, "fstat(): %s", zfile);
+
+	cd = cdir_read(fd, 1);
+	if (cd == NULL)
+		errx(EXIT_FAILURE, "error: %s", zip_proper_error[ZIP_ER_NOZIP]);
+
+	order = malloc((cd->nentries + 1) * sizeof(*order));
+	len = strlen(zfile) + sizeof(".XXXXXX");
+	tmp = malloc(len);
+	if (order == NULL || tmp == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	for (i = 0; i < cd->nentries; i++)
+		order[i] = &cd->e[i];
+	qsort(order, (size_t)cd->nentries, sizeof(*order), cdir_cmp_lho);
+
+	memset(&opts, 0, sizeof(opts));
+	opts.bufsize = ZBUF_DEFAULT;
+	if (io_alloc(&io, &opts, stdout) == -1)
+		err(EXIT_FAILURE, "posix_memalign()");
+
+	snprintf(tmp, len, "%s.XXXXXX", zfile);
+	out = mkstemp(tmp);
+	if (out == -1)
+		err(EXIT_FAILURE, "mkstemp()");
+	if (fchmod(out, st.st_mode & 07777) == -1) {
+		unlink(tmp);
+		err(EXIT_FAILURE, "fchmod(): %s", tmp);
+	}
+
+	/* Entries that share a local header keep sharing it. */
+	w = 0;
+	prev = prev_to = (zip_uint64_t)-1;
+	for (i = 0; i < cd->nentries; i++) {
+		if (order[i]->lho == prev) {
+			cdir_set_lho(cd, order[i], prev_to);
+			continue;
+		}
+		if (compact_entry(fd, order[i], out, &io, &span) == -1) {
+			unlink(tmp);
+			errx(EXIT_FAILURE, "error: %s: %s", order[i]->name,
+			     zip_proper_error[ZIP_ER_READ]);
+		}
+		prev = order[i]->lho;
+		prev_to = w;
+		cdir_set_lho(cd, order[i], w);
+		w += span;
+	}
+
+	buf = cdir_build(cd, w, &len);
+	if (buf == NULL || write_all(out, buf, len) == -1 || fsync(out) == -1 ||
+	    close(out) == -1 || rename(tmp, zfile) == -1) {
+		unlink(tmp);
+		err(EXIT_FAILURE, "cannot write '%s'", zfile);
+	}
+
+	fprintf(stdout, "%lld bytes were reclaimed.\n",
+		(long long)st.st_size - (long long)(w + len));
+
+	free(buf);
+	io_free(&io);
+	free(order);
+	free(tmp);
+	cdir_free(cd);
+	close(fd);
+}
+
+/* Take a file or directory for the a command, unless its name is
+   already taken. */
+static int add_push(struct add_list *l, struct nametab *seen,
+		    const char *path, const char *name, const struct stat *st)
+{
+	struct add_member *m, *v;
+	struct nameslot *s;
+	size_t cap, nlen;
+	int dir;
+
+	dir = S_ISDIR(st->st_mode);
+	nlen = strlen(name);
+	if (safe_name(name) == 0 || nlen + (size_t)dir > 0xffff) {
+		warnx("error: %s: cannot be named '%s' in an archive.",
+		      path, name);
+		return (-1);
+	}
+
+	if (l->n == l->cap) {
+		cap = l->cap ? l->cap * 2 : 64;
+		v = realloc(l->v, cap * sizeof(*v));
+		if (v == NULL)
+			err(EXIT_FAILURE, "realloc()");
+		l->v = v;
+		l->cap = cap;
+	}
+	m = &l->v[l->n];
+	memset(m, 0, sizeof(*m));
+	m->path = strdup(path);
+	m->name = malloc(nlen + 2);
+	if (m->path == NULL || m->name == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	memcpy(m->name, name, nlen);
+	if (dir)
+		m->name[nlen++] = '/';
+	m->name[nlen] = '\0';
+	m->size = dir ? 0 : (zip_uint64_t)st->st_size;
+	m->mtime = st->st_mtime;
+	m->mode = st->st_mode;
+	m->nchunks = m->size ? (m->size + ADD_CHUNK - 1) / ADD_CHUNK : 1;
+
+	s = nametab_put(seen, m->name, l->n);
+	if (s == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	if (s->val != l->n) {
+		warnx("warning: %s: skipped, '%s' is already added.",
+		      path, m->name);
+		free(m->path);
+		free(m->name);
+		return (0);
+	}
+	l->n++;
+	return (0);
+}
+
+static int add_name_cmp(const void *a, const void *b)
+{
+	return (strcmp(*(char *const *)a, *(char *const *)b));
+}
+
+/* Gather a file, or a directory with everything under it, in name
+   order so that the same tree always makes the same archive. Links
+   and special files are skipped, and so is the archive itself. */
+static int add_walk(struct add_list *l, struct nametab *seen,
+		    const struct stat *self, const char *path,
+		    const char *name)
+{
+	struct stat st;
+	struct dirent *de;
+	DIR *dir;
+	char **ents, **v, *p, *n;
+	size_t nents, cap, i, plen, nlen;
+	int ret;
+
+	if (lstat(path, &st) == -1) {
+		warn("lstat(): %s", path);
+		return (-1);
+	}
+	if (st.st_dev == self->st_dev && st.st_ino == self->st_ino)
+		return (0);
+	if (S_ISREG(st.st_mode))
+		return (add_push(l, seen, path, name, &st));
+	if (S_ISDIR(st.st_mode) == 0) {
+		warnx("warning: %s: skipped, not a file or a directory.",
+		      path);
+		return (0);
+	}
+
+	/* Only the top of a tree given as . has no entry of its own. */
+	ret = 0;
+	if (*name != '\0' && add_push(l, seen, path, name, &st) == -1)
+		ret = -1;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		warn("opendir(): %s", path);
+		return (-1);
+	}
+	ents = NULL;
+	nents = cap = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		if (nents == cap) {
+			cap = cap ? cap * 2 : 64;
+			v = realloc(ents, cap * sizeof(*ents));
+			if (v == NULL)
+				err(EXIT_FAILURE, "realloc()");
+			ents = v;
+		}
+		ents[nents] = strdup(de->d_name);
+		if (ents[nents++] == NULL)
+			err(EXIT_FAILURE, "strdup()");
+	}
+	closedir(dir);
+	qsort(ents, nents, sizeof(*ents), add_name_cmp);
+
+	plen = strlen(path);
+	nlen = strlen(name);
+	for (i = 0; i < nents; i++) {
+		p = malloc(plen + strlen(ents[i]) + 2);
+		n = malloc(nlen + strlen(ents[i]) + 2);
+		if (p == NULL || n == NULL)
+			err(EXIT_FAILURE, "malloc()");
+		sprintf(p, "%s%s%s", path,
+			plen && path[plen - 1] == '/' ? "" : "/", ents[i]);
+		sprintf(n, "%s%s%s", name, nlen ? "/" : "", ents[i]);
+		if (add_walk(l, seen, self, p, n) == -1)
+			ret = -1;
+		free(p);
+		free(n);
+		free(ents[i]);
+	}
+	free(ents);
+	return (ret);
+}
+
+/* The name in the archive of a path from the command line, which is
+   the path without what would make it unsafe to extract: leading
+   slashes and ./, and trailing slashes. */
+static char *add_name(const char *path)
+{
+	char *name;
+	size_t len;
+
+	for (;;) {
+		if (path[0] == '/')
+			path++;
+		else if (path[0] == '.' && path[1] == '/')
+			path += 2;
+		else
+			break;
+	}
+	if (strcmp(path, ".") == 0)
+		path = "";
+
+	name = strdup(path);
+	if (name == NULL)
+		err(EXIT_FAILURE, "strdup()");
+	for (len = strlen(name); len > 0 && name[len - 1] == '/'; len--)
+		name[len - 1] = '\0';
+	return (name);
+}
+
+/* Bits of information per byte, going by how often every byte value
+   comes up. Text is around 4 to 5, compressed data close to 8. */
+static double byte_entropy(const unsigned char *p, size_t n)
+{
+	size_t count[256], i;
+	double h, f;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		count[p[i]]++;
+	for (i = 0, h = 0.0; i < 256; i++) {
+		if (count[i] == 0)
+			continue;
+		f = (double)count[i] / (double)n;
+		h -= f * log2(f);
+	}
+	return (h);
+}
+
+/* Whether a file of several chunks is stored, going by the first
+   RECOMP_SAMPLE bytes like for c. Its chunks are compressed apart, so
+   this is settled for the whole file before any of them is. A file
+   that can't be read is left to add_deflate() to tell. */
+static int add_incompressible(const struct add_member *m)
+{
+	unsigned char *buf;
+	int fd, ret;
+
+	buf = malloc(RECOMP_SAMPLE);
+	if (buf == NULL)
+		return (0);
+	fd = open(m->path, O_RDONLY | O_NOFOLLOW);
+	ret = fd != -1 && pread_full(fd, buf, RECOMP_SAMPLE, 0) == 0 &&
+		byte_entropy(buf, RECOMP_SAMPLE) >= RECOMP_ENTROPY;
+	if (fd != -1)
+		close(fd);
+	free(buf);
+	return (ret);
+}
+
+/* Read a chunk and compress it. A member that is a single chunk is
+   stored if deflate doesn't make it smaller, one of several if
+   add_incompressible() says so. */
+static void add_deflate(const struct add_pool *pool, struct add_chunk *ch)
+{
+	const struct add_member *m;
+	unsigned char *in, *out;
+	z_stream z;
+	size_t dict, cap;
+	int fd, r, ok;
+
+	m = &pool->members[ch->member];
+	ch->out = NULL;
+	ch->out_len = 0;
+	ch->crc = 0;
+	ch->stored = 1;
+	ch->error = NULL;
+	ch->errnum = 0;
+	if (ch->len == 0)
+		return;
+
+	/* The first chunk of a member has nothing before it. */
+	dict = ch->off < ADD_DICT ? (size_t)ch->off : ADD_DICT;
+	if (pool->level == 0 || m->store)
+		dict = 0;
+	in = malloc(dict + ch->len);
+	if (in == NULL) {
+		ch->error = "malloc()";
+		ch->errnum = errno;
+		return;
+	}
+
+	fd = open(m->path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		ch->error = "open()";
+		ch->errnum = errno;
+		free(in);
+		return;
+	}
+	errno = 0;
+	if (pread_full(fd, in, dict + ch->len, ch->off - dict) == -1) {
+		ch->error = errno ? "read()" : "the file got shorter";
+		ch->errnum = errno;
+		close(fd);
+		free(in);
+		return;
+	}
+	close(fd);
+
+	ch->crc = (zip_uint32_t)crc32_fast(0, in + dict, ch->len);
+	if (pool->level == 0 || m->store) {
+		ch->out = in;
+		ch->out_len = ch->len;
+		return;
+	}
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, pool->level, Z_DEFLATED, -MAX_WBITS, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		ch->error = "deflateInit2()";
+		free(in);
+		return;
+	}
+	cap = deflateBound(&z, ch->len) + 64;
+	out = malloc(cap);
+	if (out == NULL ||
+	    (dict && deflateSetDictionary(&z, in, (uInt)dict) != Z_OK)) {
+		ch->error = "deflate()";
+		deflateEnd(&z);
+		free(out);
+		free(in);
+		return;
+	}
+
+	/* A chunk that isn't the last ends on a byte boundary, so that
+	   the next one can follow it in the same stream. */
+	z.next_in = in + dict;
+	z.avail_in = (uInt)ch->len;
+	z.next_out = out;
+	z.avail_out = (uInt)cap;
+	r = deflate(&z, ch->last ? Z_FINISH : Z_SYNC_FLUSH);
+	ok = ch->last ? r == Z_STREAM_END :
+		r == Z_OK && z.avail_in == 0 && z.avail_out > 0;
+	ch->out_len = cap - z.avail_out;
+	deflateEnd(&z);
+	if (ok == 0) {
+		ch->error = "deflate()";
+		free(out);
+		free(in);
+		return;
+	}
+
+	if (ch->off == 0 && ch->last && ch->out_len >= ch->len) {
+		free(out);
+		ch->out = in;
+		ch->out_len = ch->len;
+		return;
+	}
+	free(in);
+	ch->out = out;
+	ch->stored = 0;
+}
+
+/* Compress chunks in order, as long as the writer keeps up. */
+static void *add_worker(void *arg)
+{
+	struct add_pool *pool;
+	struct add_chunk *ch;
+	zip_uint64_t left;
+
+	pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->stop == 0 && pool->next < pool->nchunks &&
+		       pool->next >= pool->written + pool->window)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->stop || pool->next == pool->nchunks)
+			break;
+
+		ch = &pool->ring[pool->next % pool->window];
+		pool->next++;
+		left = pool->members[pool->member].size - pool->off;
+		ch->member = pool->member;
+		ch->off = pool->off;
+		ch->len = left < ADD_CHUNK ? (size_t)left : ADD_CHUNK;
+		ch->last = ch->len == left;
+		ch->done = 0;
+		if (ch->last) {
+			pool->member++;
+			pool->off = 0;
+		} else {
+			pool->off += ch->len;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		add_deflate(pool, ch);
+
+		pthread_mutex_lock(&pool->lock);
+		ch->done = 1;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return (NULL);
+}
+
+/* Lay out the local header of a member, or with central its record
+   in the central directory, name and ZIP64 extra field included.
+   Returns the length. */
+static size_t add_header(unsigned char *h, const struct add_member *m,
+			 int central)
+{
+	struct tm tm;
+	unsigned char *q, *x;
+	zip_uint16_t date, tm_dos, version;
+	size_t nlen;
+	int big, big_lho;
+
+	localtime_r(&m->mtime, &tm);
+	if (tm.tm_year < 80) {
+		date = 1 << 5 | 1;
+		tm_dos = 0;
+	} else {
+		date = (zip_uint16_t)((tm.tm_year - 80) << 9 |
+				      (tm.tm_mon + 1) << 5 | tm.tm_mday);
+		tm_dos = (zip_uint16_t)(tm.tm_hour << 11 | tm.tm_min << 5 |
+					tm.tm_sec / 2);
+	}
+
+	/* The local header has both sizes in its extra field if the
+	   member may need them. The central record only has what
+	   doesn't fit, in the usual order. */
+	if (central)
+		big = m->size >= 0xffffffff || m->comp_size >= 0xffffffff;
+	else
+		big = m->size >= ADD_ZIP64;
+	big_lho = central && m->lho >= 0xffffffff;
+	version = big || big_lho ? 45 : 20;
+
+	if (central) {
+		put32(h, SIG_CENTRAL);
+		put16(h + 4, 3 << 8 | version);
+		q = h + 2;
+	} else {
+		put32(h, SIG_LOCAL);
+		q = h;
+	}
+	nlen = strlen(m->name);
+	put16(q + 4, version);
+	put16(q + 6, is_ascii(m->name) ? 0 : 1 << 11);
+	put16(q + 8, m->method);
+	put16(q + 10, tm_dos);
+	put16(q + 12, date);
+	put32(q + 14, m->crc);
+	put32(q + 18, big ? 0xffffffff : (zip_uint32_t)m->comp_size);
+	put32(q + 22, big ? 0xffffffff : (zip_uint32_t)m->size);
+	put16(q + 26, (zip_uint16_t)nlen);
+	put16(q + 28, (zip_uint16_t)((big ? 16 : 0) + (big_lho ? 8 : 0) +
+				     (big || big_lho ? 4 : 0)));
+
+	x = q + LOCAL_HDR_SIZE;
+	if (central) {
+		put16(h + 32, 0);
+		put16(h + 34, 0);
+		put16(h + 36, 0);
+		put32(h + 38, (zip_uint32_t)(m->mode & 0xffff) << 16 |
+		      (S_ISDIR(m->mode) ? 0x10 : 0));
+		put32(h + 42, big_lho ? 0xffffffff : (zip_uint32_t)m->lho);
+		x = h + CENTRAL_HDR_SIZE;
+	}
+	memcpy(x, m->name, nlen);
+	x += nlen;
+
+	if (big || big_lho) {
+		put16(x, 0x0001);
+		put16(x + 2, (zip_uint16_t)((big ? 16 : 0) +
+					    (big_lho ? 8 : 0)));
+		x += 4;
+		if (big) {
+			put64(x, m->size);
+			put64(x + 8, m->comp_size);
+			x += 16;
+		}
+		if (big_lho) {
+			put64(x, m->lho);
+			x += 8;
+		}
+	}
+	return ((size_t)(x - h));
+}
+
+/* The most a member can take in the archive: its local header, its
+   data deflated at worst (or stored), and its record in the central
+   directory. */
+static zip_uint64_t add_bound(const struct add_member *m)
+{
+	return (LOCAL_HDR_SIZE + CENTRAL_HDR_SIZE + 2 * strlen(m->name) + 48 +
+		m->size + (m->size >> 10) + m->nchunks * 64);
+}
+
+/* Append a copy of the central directory of an archive that ends at
+   end, at where or at end if that is further, so that it is the live
+   one while the old one is written over. old gets what the old one
+   and the end records were, for add_restore(). */
+static int add_move_cdir(int fd, const struct cdir *cd, zip_uint64_t end,
+			 zip_uint64_t where, unsigned char **old)
+{
+	unsigned char *buf;
+	size_t len;
+	int ret;
+
+	*old = malloc((size_t)(end - cd->offset) + 1);
+	if (*old == NULL ||
+	    pread_full(fd, *old, (size_t)(end - cd->offset), cd->offset) == -1)
+		return (-1);
+	if (where < end)
+		where = end;
+	buf = cdir_build(cd, where, &len);
+	ret = buf && pwrite_full(fd, buf, len, where) == 0 &&
+		fsync(fd) == 0 ? 0 : -1;
+	free(buf);
+	return (ret);
+}
+
+/* Put back the central directory of an archive as add_move_cdir()
+   found it, from offset to end, and cut what was added after it. */
+static int add_restore(int fd, const unsigned char *old,
+		       zip_uint64_t offset, zip_uint64_t end)
+{
+	if (old == NULL || pwrite_full(fd, old, (size_t)(end - offset),
+				       offset) == -1 ||
+	    fsync(fd) == -1 || ftruncate(fd, (off_t)end) == -1)
+		return (-1);
+	return (0);
+}
+
+/* Add the record of a member to the central directory. */
+static void add_record(struct cdir *cd, zip_uint64_t *cap,
+		       const struct add_member *m)
+{
+	struct cdir_entry *ce, *e;
+	unsigned char *raw;
+	size_t need;
+
+	need = CENTRAL_HDR_SIZE + strlen(m->name) + 28;
+	if (cd->size + need > *cap) {
+		*cap = (cd->size + need) * 2;
+		raw = realloc(cd->raw, (size_t)*cap);
+		e = realloc(cd->e, (size_t)(*cap / CENTRAL_HDR_SIZE + 1) *
+			    sizeof(*cd->e));
+		if (raw == NULL || e == NULL)
+			err(EXIT_FAILURE, "realloc()");
+		cd->raw = raw;
+		cd->e = e;
+	}
+
+	ce = &cd->e[cd->nentries++];
+	memset(ce, 0, sizeof(*ce));
+	ce->lho = m->lho;
+	ce->comp_size = m->comp_size;
+	ce->size = m->size;
+	ce->crc = m->crc;
+	ce->method = m->method;
+	ce->name = m->name;
+	ce->rec = (size_t)cd->size;
+	ce->rec_len = add_header(cd->raw + ce->rec, m, 1);
+	cd->size += ce->rec_len;
+}
+
+/* Add files and directory trees to an archive, or create it. The
+   members are compressed by jobs threads, chunk by chunk, and written
+   in the order they were given by this one, so that the archive only
+   depends on the files and not on the threads. New members go after
+   the end of the archive and a new central directory after them, so
+   the old one stays whole until the new one is written; it is left
+   behind as dead space, like the data of an entry that a member with
+   its name replaces, until compact. */
+static void zip_archive_add(const char *zfile, char **paths, size_t npaths,
+			    long jobs, int level, int quiet)
+{
+	struct add_list l;
+	struct add_pool pool;
+	struct add_member *m;
+	struct add_chunk *ch;
+	struct nametab seen;
+	struct nameslot *s;
+	struct cdir *cd;
+	struct zpipe zp;
+	struct stat self;
+	struct timespec t0, t1;
+	pthread_t *threads;
+	zip_uint64_t i, k, c, at, cap, in, out, old, bound;
+	unsigned char *hdr, *old_cdir;
+	size_t hlen, added;
+	long nthreads, t;
+	char *name, b1[32], b2[32], b3[32];
+	const char *why;
+	double secs;
+	int fd, created, walked, failed;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	created = 0;
+	fd = open(zfile, O_RDWR);
+	if (fd == -1 && errno == ENOENT) {
+		fd = open(zfile, O_RDWR | O_CREAT | O_EXCL, 0666);
+		created = 1;
+	}
+	if (fd == -1)
+		err(EXIT_FAILURE, "open(): %s", zfile);
+	if (fstat(fd, &self) == -1)
+		err(EXIT_FAILURE, "fstat(): %s", zfile);
+
+	if (created) {
+		cd = calloc(1, sizeof(*cd));
+		if (cd == NULL || (cd->comment = malloc(1)) == NULL)
+			err(EXIT_FAILURE, "calloc()");
+	} else {
+		cd = cdir_read(fd, 1);
+		if (cd == NULL) {
+			close(fd);
+			errx(EXIT_FAILURE, "error: %s",
+			     zip_proper_error[ZIP_ER_NOZIP]);
+		}
+	}
+
+	/* Everything is gathered, and read enough of to tell how it is
+	   stored, before the archive is touched. */
+	memset(&l, 0, sizeof(l));
+	if (nametab_init(&seen, 64) == -1)
 		err(EXIT_FAILURE, "calloc()");
+	walked = 0;
+	for (i = 0; i < npaths; i++) {
+		name = add_name(paths[i]);
+		if (add_walk(&l, &seen, &self, paths[i], name) == -1)
+			walked = -1;
+		free(name);
+	}
+	if (walked == -1 || l.n == 0) {
+		if (walked == 0)
+			warnx("error: there is nothing to add.");
+		if (created)
+			unlink(zfile);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; level != 0 && i < l.n; i++) {
+		if (l.v[i].nchunks > 1)
+			l.v[i].store = add_incompressible(&l.v[i]);
+	}
+
+	/* The new files go over the old central directory, once a copy of
+	   it past where they can end is the live one. */
+	old = cd->offset;
+	old_cdir = NULL;
+	if (created == 0) {
+		for (i = 0, bound = 0; i < l.n; i++)
+			bound += add_bound(&l.v[i]);
+		if (add_move_cdir(fd, cd, (zip_uint64_t)self.st_size,
+				  old + bound + EOCD64_SIZE + EOCD64_LOC_SIZE,
+				  &old_cdir) == -1) {
+			warn("cannot write '%s'", zfile);
+			if (ftruncate(fd, self.st_size) == -1)
+				warn("cannot restore '%s'", zfile);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < cd->nentries; i++) {
+		s = nametab_get(&seen, cd->e[i].name);
+		if (s != NULL) {
+			cd->e[i].deleted = 1;
+			l.v[s->val].replaces = 1;
+		}
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.members = l.v;
+	pool.level = level;
+	for (i = 0; i < l.n; i++)
+		pool.nchunks += l.v[i].nchunks;
+	nthreads = (zip_uint64_t)jobs < pool.nchunks ? jobs : (long)pool.nchunks;
+	pool.window = (zip_uint64_t)nthreads * ADD_WINDOW;
+	pool.ring = calloc((size_t)pool.window, sizeof(*pool.ring));
+	threads = malloc((size_t)nthreads * sizeof(*threads));
+	hdr = malloc(LOCAL_HDR_SIZE + 0xffff + 32);
+	zp.fd = fd;
+	zp.err = STDERR_FILENO;
+	zp.size = ZBUF_DEFAULT;
+	zp.len = 0;
+	zp.buf = malloc(zp.size);
+	if (pool.ring == NULL || threads == NULL || hdr == NULL ||
+	    zp.buf == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t], NULL, add_worker, &pool) != 0)
+			errx(EXIT_FAILURE, "pthread_create() failed.");
+	}
+
+	cap = cd->size;
+	at = old;
+	if (lseek(fd, (off_t)at, SEEK_SET) == -1)
+		err(EXIT_FAILURE, "lseek(): %s", zfile);
+
+	/* The chunks come back in order. A member that is a single
+	   chunk gets its final local header right away, the others get
+	   theirs once their crc and size are known. */
+	in = out = 0;
+	added = 0;
+	failed = 0;
+	hlen = 0;
+	for (i = 0, c = 0; i < l.n && failed == 0; i++) {
+		m = &l.v[i];
+		for (k = 0; k < m->nchunks; k++, c++) {
+			ch = &pool.ring[c % pool.window];
+			pthread_mutex_lock(&pool.lock);
+			while (ch->done == 0)
+				pthread_cond_wait(&pool.cond, &pool.lock);
+			pthread_mutex_unlock(&pool.lock);
+
+			if (ch->error) {
+				if (ch->errnum) {
+					errno = ch->errnum;
+					warn("%s: %s", m->path, ch->error);
+				} else {
+					warnx("error: %s: %s", m->path,
+					      ch->error);
+				}
+				failed = 1;
+				break;
+			}
+
+			if (k == 0) {
+				m->lho = at;
+				m->crc = ch->crc;
+				m->method = ch->stored ? ZIP_CM_STORE :
+					ZIP_CM_DEFLATE;
+				m->comp_size = m->nchunks == 1 ? ch->out_len : 0;
+				hlen = add_header(hdr, m, 0);
+				failed = pipe_put(&zp, hdr, hlen);
+				at += hlen;
+			} else {
+				m->crc = (zip_uint32_t)crc32_combine(m->crc,
+					ch->crc, (z_off_t)ch->len);
+			}
+			if (failed == 0)
+				failed = pipe_put(&zp, ch->out, ch->out_len);
+			at += ch->out_len;
+			free(ch->out);
+			ch->out = NULL;
+
+			pthread_mutex_lock(&pool.lock);
+			ch->done = 0;
+			pool.written++;
+			pthread_cond_broadcast(&pool.cond);
+			pthread_mutex_unlock(&pool.lock);
+			if (failed)
+				break;
+		}
+		if (failed)
+			break;
+
+		if (m->nchunks > 1) {
+			m->comp_size = at - m->lho - hlen;
+			if (pipe_flush(&zp) == -1 ||
+			    pwrite_full(fd, hdr, add_header(hdr, m, 0),
+					m->lho) == -1) {
+				warn("cannot write '%s'", zfile);
+				failed = 1;
+				break;
+			}
+		}
+		add_record(cd, &cap, m);
+		in += m->size;
+		out += m->comp_size;
+		added++;
+
+		if (quiet == 0)
+			fprintf(stdout, "%s: %s (%s %d%%)\n",
+				m->replaces ? "updating" : "  adding", m->name,
+				m->method == ZIP_CM_STORE ? "stored" :
+				"deflated", m->size ? (int)(((double)m->size -
+				(double)m->comp_size) * 100 / (double)m->size) :
+				0);
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	for (k = 0; k < pool.window; k++)
+		free(pool.ring[k].out);
+
+	/* A failed run puts the old central directory back and cuts
+	   what it wrote, or removes the archive it was creating. */
+	why = NULL;
+	if (failed == 0) {
+		cd->offset = at;
+		if (pipe_flush(&zp) == -1 || cdir_write(fd, cd) == -1)
+			why = "cannot write";
+	}
+	if (failed || why) {
+		if (why)
+			warn("%s '%s'", why, zfile);
+		if (created)
+			unlink(zfile);
+		else if (add_restore(fd, old_cdir, old,
+				     (zip_uint64_t)self.st_size) == -1)
+			warn("cannot restore '%s'", zfile);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (double)(t1.tv_sec - t0.tv_sec) +
+		(double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stdout, "%zu file(s) were added to the archive, %s "
+		"compressed to %s (%.1f%%) in %.2f s, %s/s.\n", added,
+		human_size(b1, sizeof(b1), in),
+		human_size(b2, sizeof(b2), out),
+		in ? (double)out * 100 / (double)in : 100.0, secs,
+		human_size(b3, sizeof(b3),
+			   (zip_uint64_t)(secs > 0 ? (double)in / secs : 0)));
+
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.cond);
+	for (i = 0; i < l.n; i++) {
+		free(l.v[i].path);
+		free(l.v[i].name);
+	}
+	free(l.v);
+	nametab_free(&seen);
+	free(pool.ring);
+	free(threads);
+	free(hdr);
+	free(zp.buf);
+	free(old_cdir);
+	cdir_free(cd);
+}
+
+static const char *const recomp_names[RECOMP_KINDS] = {
+	"kept", "stored", "deflate", "zstd"
+};
+
+static const zip_uint16_t recomp_methods[RECOMP_KINDS] = {
+	0, ZIP_CM_STORE, ZIP_CM_DEFLATE, ZIP_CM_ZSTD
+};
+
+/* Forget the new data of a member. */
+static void recomp_reset(struct recomp_job *job)
+{
+	free(job->buf);
+	job->buf = NULL;
+	job->len = job->cap = 0;
+	if (job->spill != -1)
+		close(job->spill);
+	job->spill = -1;
+	job->comp = 0;
+}
+
+/* Add to the new data of a member, which goes to an unlinked file next
+   to the archive once it doesn't fit in memory. */
+static int recomp_emit(struct recomp_job *job, const char *spill,
+		       const unsigned char *p, size_t n)
+{
+	unsigned char *buf;
+	char *path;
+	size_t cap;
+
+	job->comp += n;
+	if (job->spill != -1)
+		return (write_all(job->spill, p, n));
+
+	if (job->len + n > RECOMP_SPILL) {
+		path = strdup(spill);
+		if (path == NULL)
+			return (-1);
+		job->spill = mkstemp(path);
+		if (job->spill != -1)
+			unlink(path);
+		free(path);
+		if (job->spill == -1 ||
+		    write_all(job->spill, job->buf, job->len) == -1)
+			return (-1);
+		free(job->buf);
+		job->buf = NULL;
+		job->len = job->cap = 0;
+		return (write_all(job->spill, p, n));
+	}
+
+	if (job->len + n > job->cap) {
+		cap = job->cap ? job->cap : 64 * 1024;
+		while (cap < job->len + n)
+			cap *= 2;
+		buf = realloc(job->buf, cap);
+		if (buf == NULL)
+			return (-1);
+		job->buf = buf;
+		job->cap = cap;
+	}
+	memcpy(job->buf + job->len, p, n);
+	job->len += n;
+	return (0);
+}
+
+static int recomp_enc_init(struct recomp_enc *e, int kind, int level,
+			   zip_uint64_t size)
+{
+	memset(e, 0, sizeof(*e));
+	e->kind = kind;
+	e->out = malloc(RECOMP_OUT);
+	if (e->out == NULL)
+		return (-1);
+
+	switch (kind) {
+	case RECOMP_DEFLATE:
+		if (deflateInit2(&e->z, level, Z_DEFLATED, -MAX_WBITS, 8,
+				 Z_DEFAULT_STRATEGY) != Z_OK)
+			return (-1);
+		break;
+#ifdef HAVE_ZSTD
+	case RECOMP_ZSTD:
+		/* The size goes in the frame header. */
+		e->zc = ZSTD_createCCtx();
+		if (e->zc == NULL ||
+		    ZSTD_isError(ZSTD_CCtx_setParameter(e->zc,
+			ZSTD_c_compressionLevel, level)) ||
+		    ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(e->zc, size)))
+			return (-1);
+		break;
+#endif
+	default:
+		(void)level;
+		(void)size;
+		break;
+	}
+	return (0);
+}
+
+static void recomp_enc_end(struct recomp_enc *e)
+{
+	if (e->kind == RECOMP_DEFLATE)
+		deflateEnd(&e->z);
+#ifdef HAVE_ZSTD
+	if (e->kind == RECOMP_ZSTD)
+		ZSTD_freeCCtx(e->zc);
+#endif
+	free(e->out);
+}
+
+/* Compress a piece of a member, the last one with last. */
+static int recomp_enc_put(struct recomp_enc *e, struct recomp_job *job,
+			  const char *spill, const unsigned char *p, size_t n,
+			  int last)
+{
+	int r;
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	size_t left;
+#endif
+
+	switch (e->kind) {
+	case RECOMP_DEFLATE:
+		e->z.next_in = (unsigned char *)p;
+		e->z.avail_in = (uInt)n;
+		do {
+			e->z.next_out = e->out;
+			e->z.avail_out = RECOMP_OUT;
+			r = deflate(&e->z, last ? Z_FINISH : Z_NO_FLUSH);
+			if (r == Z_STREAM_ERROR ||
+			    recomp_emit(job, spill, e->out,
+					RECOMP_OUT - e->z.avail_out) == -1)
+				return (-1);
+		} while (last ? r != Z_STREAM_END : e->z.avail_out == 0);
+		return (0);
+#ifdef HAVE_ZSTD
+	case RECOMP_ZSTD:
+		zin.src = p;
+		zin.size = n;
+		zin.pos = 0;
+		do {
+			zout.dst = e->out;
+			zout.size = RECOMP_OUT;
+			zout.pos = 0;
+			left = ZSTD_compressStream2(e->zc, &zout, &zin,
+				last ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(left) ||
+			    recomp_emit(job, spill, e->out, zout.pos) == -1)
+				return (-1);
+		} while (last ? left != 0 : zin.pos < zin.size);
+		return (0);
+#endif
+	default:
+		(void)r;
+		return (recomp_emit(job, spill, p, n));
+	}
+}
+
+/* Read the new data of a member back, and make sure it gives the crc
+   and size of the central directory. */
+static int recomp_check(const struct recomp_job *job, int kind,
+			unsigned char *in, unsigned char *out)
+{
+	const unsigned char *p;
+	zip_uint64_t off, total;
+	z_stream z;
+	uLong crc;
+	size_t n;
+	int r, ended, ret;
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *zd;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	size_t left;
+
+	zd = NULL;
+	if (kind == RECOMP_ZSTD && (zd = ZSTD_createDCtx()) == NULL)
+		return (-1);
+#endif
+	memset(&z, 0, sizeof(z));
+	if (kind == RECOMP_DEFLATE && inflateInit2(&z, -MAX_WBITS) != Z_OK)
+		return (-1);
+
+	crc = 0;
+	total = 0;
+	ended = kind == RECOMP_STORE;
+	ret = 0;
+	for (off = 0; off < job->comp && ret == 0; off += n) {
+		n = job->comp - off < RECOMP_OUT ?
+			(size_t)(job->comp - off) : RECOMP_OUT;
+		if (job->spill == -1) {
+			p = job->buf + off;
+		} else if (pread_full(job->spill, in, n, off) == 0) {
+			p = in;
+		} else {
+			ret = -1;
+			break;
+		}
+
+		if (kind == RECOMP_STORE) {
+			crc = crc32_fast(crc, p, n);
+			total += n;
+		} else if (kind == RECOMP_DEFLATE) {
+			z.next_in = (unsigned char *)p;
+			z.avail_in = (uInt)n;
+			do {
+				z.next_out = out;
+				z.avail_out = RECOMP_OUT;
+				/* Z_BUF_ERROR is no progress: the output
+				   of the chunk was all taken, and the
+				   stream needs the next one. A stream
+				   that never ends fails below. */
+				r = inflate(&z, Z_NO_FLUSH);
+				if (r == Z_BUF_ERROR)
+					break;
+				if (r != Z_OK && r != Z_STREAM_END) {
+					ret = -1;
+					break;
+				}
+				crc = crc32_fast(crc, out,
+						 RECOMP_OUT - z.avail_out);
+				total += RECOMP_OUT - z.avail_out;
+				if (r == Z_STREAM_END) {
+					ended = 1;
+					break;
+				}
+			} while (z.avail_in > 0 || z.avail_out == 0);
+#ifdef HAVE_ZSTD
+		} else {
+			zin.src = p;
+			zin.size = n;
+			zin.pos = 0;
+			do {
+				zout.dst = out;
+				zout.size = RECOMP_OUT;
+				zout.pos = 0;
+				left = ZSTD_decompressStream(zd, &zout, &zin);
+				if (ZSTD_isError(left)) {
+					ret = -1;
+					break;
+				}
+				crc = crc32_fast(crc, out, zout.pos);
+				total += zout.pos;
+				ended = left == 0;
+			} while (zin.pos < zin.size || zout.pos == zout.size);
+#endif
+		}
+	}
+
+	if (kind == RECOMP_DEFLATE)
+		inflateEnd(&z);
+#ifdef HAVE_ZSTD
+	ZSTD_freeDCtx(zd);
+#endif
+	if (ret == 0 && (ended == 0 || total != job->ce->size ||
+			 (zip_uint32_t)crc != job->ce->crc))
+		ret = -1;
+	return (ret);
+}
+
+/* Whether the record of an entry has room for a compressed size. */
+static int recomp_fits(const struct cdir *cd, const struct cdir_entry *ce,
+		       zip_uint64_t comp)
+{
+	return (comp < 0xffffffff ||
+		get32(cd->raw + ce->rec + 20) == 0xffffffff);
+}
+
+/* Compress a member with the method of kind, storing it instead if
+   it doesn't shrink, and tell what it became. Members that look
+   incompressible, are encrypted or can't be read by libzip are kept
+   as they are. */
+static int recomp_entry(zip_t *zip, const struct recomp_pool *pool,
+			struct recomp_job *job, unsigned char *buf,
+			unsigned char *in)
+{
+	const struct cdir_entry *ce;
+	struct recomp_enc e;
+	zip_file_t *zfp;
+	zip_uint64_t total, t0;
+	zip_int64_t got;
+	size_t want;
+	int kind, ret;
+
+	ce = job->ce;
+	kind = pool->kind;
+	if (job->shared || (ce->flags & 1) || ce->size == 0 ||
+	    (kind == RECOMP_STORE && ce->method == ZIP_CM_STORE))
+		return (RECOMP_KEEP);
+
+	for (;;) {
+		zfp = zip_fopen_index(zip, job->idx, 0);
+		if (zfp == NULL)
+			return (RECOMP_KEEP);
+
+		/* The sample is the first read. */
+		want = ce->size < RECOMP_SAMPLE ?
+			(size_t)ce->size : RECOMP_SAMPLE;
+		t0 = clock_ns();
+		got = zip_fread(zfp, buf, want);
+		job->read_ns += clock_ns() - t0;
+		if (got != (zip_int64_t)want) {
+			zip_fclose(zfp);
+			job->error = "cannot be read";
+			return (-1);
+		}
+		if (kind != RECOMP_STORE &&
+		    byte_entropy(buf, want) >= RECOMP_ENTROPY) {
+			zip_fclose(zfp);
+			return (RECOMP_KEEP);
+		}
+
+		if (recomp_enc_init(&e, kind, pool->level, ce->size) == -1) {
+			recomp_enc_end(&e);
+			zip_fclose(zfp);
+			job->error = "cannot be compressed";
+			return (-1);
+		}
+		ret = 0;
+		for (total = want;; total += want) {
+			t0 = clock_ns();
+			ret = recomp_enc_put(&e, job, pool->spill, buf, want,
+					     total == ce->size);
+			job->encode_ns += clock_ns() - t0;
+			if (ret == -1 || total == ce->size)
+				break;
+
+			want = ce->size - total < ZBUF_DEFAULT ?
+				(size_t)(ce->size - total) : ZBUF_DEFAULT;
+			t0 = clock_ns();
+			got = zip_fread(zfp, buf, want);
+			job->read_ns += clock_ns() - t0;
+			if (got != (zip_int64_t)want) {
+				ret = -1;
+				break;
+			}
+		}
+		recomp_enc_end(&e);
+		zip_fclose(zfp);
+		if (ret == -1) {
+			job->error = "cannot be recompressed";
+			return (-1);
+		}
+
+		/* Small members often get bigger, they are stored then. */
+		if (kind == RECOMP_STORE || job->comp < ce->size)
+			break;
+		recomp_reset(job);
+		if (ce->method == ZIP_CM_STORE)
+			return (RECOMP_KEEP);
+		kind = RECOMP_STORE;
+	}
+
+	/* Nothing is gained, or the record can't take the size. */
+	if ((recomp_methods[kind] == ce->method &&
+	     job->comp >= ce->comp_size) || recomp_fits(pool->cd, ce,
+							job->comp) == 0) {
+		recomp_reset(job);
+		return (RECOMP_KEEP);
+	}
+
+	t0 = clock_ns();
+	ret = recomp_check(job, kind, in, buf);
+	job->check_ns += clock_ns() - t0;
+	if (ret == -1) {
+		job->error = "was not recompressed right";
+		return (-1);
+	}
+	return (kind);
+}
+
+/* Take the members in order, as long as the writer keeps up. */
+static void *recomp_worker(void *arg)
+{
+	struct recomp_pool *pool;
+	struct recomp_job *job;
+	unsigned char *buf, *in;
+	zip_t *zip;
+	int eptr, kind;
+
+	pool = arg;
+	buf = malloc(ZBUF_DEFAULT);
+	in = malloc(RECOMP_OUT);
+	zip = zip_open(pool->zfile, ZIP_RDONLY, &eptr);
+	if (buf == NULL || in == NULL || zip == NULL) {
+		if (zip == NULL)
+			warnx("error: %s", zip_proper_error[eptr]);
+		else
+			warn("malloc()");
+		pthread_mutex_lock(&pool->lock);
+		pool->failed = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+		free(buf);
+		free(in);
+		if (zip)
+			zip_discard(zip);
+		return (NULL);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->failed == 0 && pool->next < pool->njobs &&
+		       pool->next >= pool->written + pool->window)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->failed || pool->next == pool->njobs)
+			break;
+		job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		kind = recomp_entry(zip, pool, job, buf, in);
+
+		pthread_mutex_lock(&pool->lock);
+		job->kind = kind == -1 ? RECOMP_KEEP : kind;
+		job->done = 1;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	zip_discard(zip);
+	free(buf);
+	free(in);
+	return (NULL);
+}
+
+/* Lay out the local header of a recompressed member, with the name
+   and the time of its record. Returns the length. */
+static size_t recomp_local_header(unsigned char *h, const struct cdir *cd,
+				  const struct cdir_entry *ce,
+				  zip_uint16_t method, zip_uint64_t comp)
+{
+	const unsigned char *rec;
+	size_t nlen;
+	int big;
+
+	rec = cd->raw + ce->rec;
+	big = ce->size >= 0xffffffff || comp >= 0xffffffff;
+	nlen = strlen(ce->name);
+	put32(h, SIG_LOCAL);
+	put16(h + 4, method == ZIP_CM_ZSTD ? 63 : big ? 45 : 20);
+	put16(h + 6, get16(rec + 8) & 1 << 11);
+	put16(h + 8, method);
+	memcpy(h + 10, rec + 12, 4);
+	put32(h + 14, ce->crc);
+	put32(h + 18, big ? 0xffffffff : (zip_uint32_t)comp);
+	put32(h + 22, big ? 0xffffffff : (zip_uint32_t)ce->size);
+	put16(h + 26, (zip_uint16_t)nlen);
+	put16(h + 28, big ? 20 : 0);
+	memcpy(h + LOCAL_HDR_SIZE, ce->name, nlen);
+	if (big == 0)
+		return (LOCAL_HDR_SIZE + nlen);
+
+	h += LOCAL_HDR_SIZE + nlen;
+	put16(h, 0x0001);
+	put16(h + 2, 16);
+	put64(h + 4, ce->size);
+	put64(h + 12, comp);
+	return (LOCAL_HDR_SIZE + nlen + 20);
+}
+
+/* Give the record of a recompressed entry its method and compressed
+   size. Its data has no data descriptor any more (bit 3), nor the
+   deflate options (bits 1 and 2). */
+static void cdir_set_method(struct cdir *cd, struct cdir_entry *ce,
+			    zip_uint16_t method, zip_uint64_t comp)
+{
+	unsigned char *rec, *x, *end;
+	size_t off;
+
+	rec = cd->raw + ce->rec;
+	put16(rec + 8, get16(rec + 8) & ~(1 << 3 | 3 << 1));
+	put16(rec + 10, method);
+	if (method == ZIP_CM_ZSTD && (get16(rec + 6) & 0xff) < 63)
+		put16(rec + 6, 63);
+	ce->method = method;
+	ce->comp_size = comp;
+
+	if (get32(rec + 20) != 0xffffffff) {
+		put32(rec + 20, (zip_uint32_t)comp);
+		return;
+	}
+	x = rec + CENTRAL_HDR_SIZE + get16(rec + 28);
+	end = x + get16(rec + 30);
+	for (; x + 4 <= end; x += 4 + get16(x + 2)) {
+		if (get16(x) != 0x0001)
+			continue;
+		off = get32(rec + 24) == 0xffffffff ? 12 : 4;
+		if (off + 8 <= 4 + (size_t)get16(x + 2))
+			put64(x + off, comp);
+		return;
+	}
+}
+
+static int recomp_job_cmp(const void *a, const void *b)
+{
+	const struct recomp_job *ja, *jb;
+
+	ja = a;
+	jb = b;
+	if (ja->ce->lho != jb->ce->lho)
+		return (ja->ce->lho < jb->ce->lho ? -1 : 1);
+	return (ja->idx < jb->idx ? -1 : ja->idx > jb->idx);
+}
+
+/* Rewrite an archive with every member in the method that suits it:
+   kind for those that compress, and as they are for the others. The
+   members are read and compressed by jobs threads and written in
+   order into a temporary file that replaces the archive, like for
+   compact. Every new member is decompressed again before it is
+   written, and what each method did is reported at the end. */
+static void zip_archive_recompress(const char *zfile, long jobs, int kind,
+				   int level, int quiet)
+{
+	struct recomp_pool pool;
+	struct recomp_job *job, *prev;
+	struct cdir *cd;
+	struct unzip_opts opts;
+	struct unzip_io io;
+	struct stat st;
+	pthread_t *threads;
+	zip_uint64_t i, w, span, prev_to, start;
+	zip_uint64_t count[RECOMP_KINDS], before[RECOMP_KINDS];
+	zip_uint64_t after[RECOMP_KINDS], read_ns[RECOMP_KINDS];
+	zip_uint64_t encode_ns[RECOMP_KINDS], check_ns[RECOMP_KINDS];
+	unsigned char *buf, *hdr;
+	char *tmp, *spill, b1[32], b2[32];
+	size_t len, hlen;
+	long nthreads, t;
+	int fd, out, k, ok;
+
+	start = clock_ns();
+	fd = open(zfile, O_RDONLY);
+	if (fd == -1)
+		err(EXIT_FAILURE, "open(): %s", zfile);
+	if (fstat(fd, &st) == -1)
+		err(EXIT_FAILURE, "fstat(): %s", zfile);
+	cd = cdir_read(fd, 1);
+	if (cd == NULL)
+		errx(EXIT_FAILURE, "error: %s", zip_proper_error[ZIP_ER_NOZIP]);
+
+	/* Members in the order of their data, as for compact. */
+	memset(&pool, 0, sizeof(pool));
+	pool.jobs = calloc((size_t)cd->nentries + 1, sizeof(*pool.jobs));
+	len = strlen(zfile) + sizeof(".XXXXXX");
+	tmp = malloc(len);
+	spill = malloc(len);
+	hdr = malloc(LOCAL_HDR_SIZE + 0xffff + 20);
+	if (pool.jobs == NULL || tmp == NULL || spill == NULL || hdr == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	for (i = 0; i < cd->nentries; i++) {
+		pool.jobs[i].ce = &cd->e[i];
+		pool.jobs[i].idx = i;
+		pool.jobs[i].spill = -1;
+	}
+	qsort(pool.jobs, (size_t)cd->nentries, sizeof(*pool.jobs),
+	      recomp_job_cmp);
+	for (i = 1; i < cd->nentries; i++)
+		pool.jobs[i].shared = pool.jobs[i].ce->lho ==
+			pool.jobs[i - 1].ce->lho;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.bufsize = ZBUF_DEFAULT;
+	if (io_alloc(&io, &opts, stdout) == -1)
+		err(EXIT_FAILURE, "posix_memalign()");
+
+	snprintf(tmp, len, "%s.XXXXXX", zfile);
+	snprintf(spill, len, "%s.XXXXXX", zfile);
+	out = mkstemp(tmp);
+	if (out == -1)
+		err(EXIT_FAILURE, "mkstemp()");
+	if (fchmod(out, st.st_mode & 07777) == -1) {
+		unlink(tmp);
+		err(EXIT_FAILURE, "fchmod(): %s", tmp);
+	}
+
+	pool.zfile = zfile;
+	pool.spill = spill;
+	pool.cd = cd;
+	pool.njobs = (size_t)cd->nentries;
+	pool.kind = kind;
+	pool.level = level;
+	nthreads = jobs < (long)pool.njobs ? jobs : (long)pool.njobs;
+	if (nthreads < 1)
+		nthreads = 1;
+	pool.window = (size_t)nthreads * RECOMP_WINDOW;
+	threads = malloc((size_t)nthreads * sizeof(*threads));
+	if (threads == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t], NULL, recomp_worker,
+				   &pool) != 0)
+			errx(EXIT_FAILURE, "pthread_create() failed.");
+	}
+
+	memset(count, 0, sizeof(count));
+	memset(before, 0, sizeof(before));
+	memset(after, 0, sizeof(after));
+	memset(read_ns, 0, sizeof(read_ns));
+	memset(encode_ns, 0, sizeof(encode_ns));
+	memset(check_ns, 0, sizeof(check_ns));
+	w = 0;
+	prev = NULL;
+	prev_to = 0;
+	for (i = 0; i < pool.njobs; i++) {
+		job = &pool.jobs[i];
+		pthread_mutex_lock(&pool.lock);
+		while (job->done == 0 && pool.failed == 0)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		ok = job->done && job->error == NULL;
+		pthread_mutex_unlock(&pool.lock);
+		if (ok == 0) {
+			unlink(tmp);
+			errx(EXIT_FAILURE, "error: %s: %s", job->ce->name,
+			     job->error ? job->error :
+			     zip_proper_error[ZIP_ER_READ]);
+		}
+
+		/* Entries that share a local header keep sharing it. */
+		if (job->shared) {
+			cdir_set_lho(cd, job->ce, prev_to);
+			if (prev->kind != RECOMP_KEEP)
+				cdir_set_method(cd, job->ce,
+						recomp_methods[prev->kind],
+						prev->comp);
+		} else if (job->kind == RECOMP_KEEP) {
+			if (compact_entry(fd, job->ce, out, &io, &span) == -1) {
+				unlink(tmp);
+				errx(EXIT_FAILURE, "error: %s: %s",
+				     job->ce->name,
+				     zip_proper_error[ZIP_ER_READ]);
+			}
+			prev = job;
+			prev_to = w;
+			cdir_set_lho(cd, job->ce, w);
+			w += span;
+		} else {
+			hlen = recomp_local_header(hdr, cd, job->ce,
+						   recomp_methods[job->kind],
+						   job->comp);
+			if (write_all(out, hdr, hlen) == -1 ||
+			    (job->spill == -1 ?
+			     write_all(out, job->buf, job->len) :
+			     copy_archive_range(job->spill, 0, out, job->comp,
+						&io)) == -1) {
+				unlink(tmp);
+				err(EXIT_FAILURE, "cannot write '%s'", zfile);
+			}
+			prev = job;
+			prev_to = w;
+			cdir_set_lho(cd, job->ce, w);
+			w += hlen + job->comp;
+		}
+
+		if (job->shared == 0) {
+			k = job->kind;
+			count[k]++;
+			before[k] += job->ce->comp_size;
+			after[k] += k == RECOMP_KEEP ? job->ce->comp_size :
+				job->comp;
+			read_ns[k] += job->read_ns;
+			encode_ns[k] += job->encode_ns;
+			check_ns[k] += job->check_ns;
+			if (quiet == 0 && k == RECOMP_KEEP)
+				fprintf(stdout, "%8s: %s\n", recomp_names[k],
+					job->ce->name);
+			else if (quiet == 0)
+				fprintf(stdout, "%8s: %s (%s -> %s)\n",
+					recomp_names[k], job->ce->name,
+					human_size(b1, sizeof(b1),
+						   job->ce->comp_size),
+					human_size(b2, sizeof(b2), job->comp));
+			if (k != RECOMP_KEEP)
+				cdir_set_method(cd, job->ce,
+						recomp_methods[k], job->comp);
+		}
+		recomp_reset(job);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.written++;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+
+	buf = cdir_build(cd, w, &len);
+	if (buf == NULL || write_all(out, buf, len) == -1 || fsync(out) == -1 ||
+	    close(out) == -1 || rename(tmp, zfile) == -1) {
+		unlink(tmp);
+		err(EXIT_FAILURE, "cannot write '%s'", zfile);
+	}
+
+	/* Sizes are of the compressed data, times of reading the members
+	   before and after, and of compressing them. */
+	fprintf(stdout, "%-8s %8s %10s %10s %8s %9s %9s %9s\n", "method",
+		"members", "before", "after", "change", "encode",
+		"read old", "read new");
+	for (k = 0; k < RECOMP_KINDS; k++) {
+		if (count[k] == 0)
+			continue;
+		fprintf(stdout, "%-8s %8llu %10s %10s %+7.1f%%",
+			recomp_names[k], (unsigned long long)count[k],
+			human_size(b1, sizeof(b1), before[k]),
+			human_size(b2, sizeof(b2), after[k]),
+			before[k] ? ((double)after[k] - (double)before[k]) *
+			100 / (double)before[k] : 0.0);
+		if (k == RECOMP_KEEP)
+			fputc('\n', stdout);
+		else
+			fprintf(stdout, " %8.2fs %8.2fs %8.2fs\n",
+				(double)encode_ns[k] / 1e9,
+				(double)read_ns[k] / 1e9,
+				(double)check_ns[k] / 1e9);
+	}
+	fprintf(stdout, "%s: %s -> %s (%+.1f%%) in %.2f s.\n", zfile,
+		human_size(b1, sizeof(b1), (zip_uint64_t)st.st_size),
+		human_size(b2, sizeof(b2), w + len),
+		st.st_size ? ((double)(w + len) - (double)st.st_size) * 100 /
+		(double)st.st_size : 0.0,
+		(double)(clock_ns() - start) / 1e9);
+
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.cond);
+	free(buf);
+	free(threads);
+	io_free(&io);
+	free(pool.jobs);
+	free(hdr);
+	free(tmp);
+	free(spill);
+	cdir_free(cd);
+	close(fd);
+}
+
+/* Parse a number of bytes such as 512K, 4M or 1G. Returns -1 if it
+   isn't one, is zero or doesn't fit. */
+static int parse_bytes(const char *s, unsigned long long *out)
+{
+	char *end;
+	unsigned long long n, mult = 1;
+
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (errno == 0 && end != s) {
+		switch (*end) {
+		case 'k': case 'K':
+			mult = 1024;
+			end++;
+			break;
+		case 'm': case 'M':
+			mult = 1024 * 1024;
+			end++;
+			break;
+		case 'g': case 'G':
+			mult = 1024 * 1024 * 1024;
+			end++;
+			break;
+		}
+		if (n > ULLONG_MAX / mult)
+			errno = ERANGE;
+		n *= mult;
+	}
+	if (errno != 0 || end == s || *end != '\0' || n == 0 || s[0] == '-')
+		return (-1);
+	*out = n;
+	return (0);
+}
+
+/* Parse a size such as 512K, 4M or 1G, the argument of --buffer-size.
+   It is rounded up to the buffer alignment. */
+static size_t parse_size(const char *s)
+{
+	unsigned long long n;
+
+	if (s == NULL)
+		errx(EXIT_FAILURE, "buffer size is not provided.");
+
+	if (parse_bytes(s, &n) == -1 || n > ZBUF_LIMIT)
+		errx(EXIT_FAILURE, "invalid buffer size '%s'.", s);
+
+	return ((size_t)((n + ZBUF_ALIGN - 1) & ~(unsigned long long)(ZBUF_ALIGN - 1)));
+}
+
+/* Parse the argument of -j. Zero means one thread per online cpu. */
+static long parse_jobs(const char *s)
+{
+	char *end;
+	long n;
+
+	if (s == NULL)
+		errx(EXIT_FAILURE, "number of threads is not provided.");
+
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || n < 0)
+		errx(EXIT_FAILURE, "invalid number of threads '%s'.", s);
+
+	if (n == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n < 1)
+			n = 1;
+	}
+	return (n);
+}
+
+/* Parse the argument of --level, from 0 to max. */
+static int parse_level(const char *s, int max)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || n < 0 || n > max)
+		errx(EXIT_FAILURE, "invalid compression level '%s'.", s);
+	return ((int)n);
+}
+
+/* Parse the argument of --cache, a number of archives. */
+static size_t parse_cache(const char *s)
+{
+	char *end;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || n == 0 || s[0] == '-')
+		errx(EXIT_FAILURE, "invalid number of archives '%s'.", s);
+	return ((size_t)n);
+}
+
+/* Parse the argument of --cache-size, like --buffer-size. */
+static zip_uint64_t parse_cache_size(const char *s)
+{
+	unsigned long long n;
+
+	if (parse_bytes(s, &n) == -1)
+		errx(EXIT_FAILURE, "invalid cache size '%s'.", s);
+	return ((zip_uint64_t)n);
+}
+
+/* Remove a switch from the arguments, if it is there, and tell
+   whether it was. */
+static int take_flag(int *argc, char **argv, const char *flag)
+{
+	int i, found;
+
+	found = 0;
+	for (i = 2; i < *argc; i++) {
+		if (strcmp(argv[i], flag) == 0) {
+			memmove(argv + i, argv + i + 1,
+				(size_t)(*argc - i) * sizeof(*argv));
+			(*argc)--;
+			i--;
+			found = 1;
+		}
+	}
+	return (found);
+}
+
+/* Remove a switch and its argument from the arguments, as many times
+   as it is given, and collect the arguments. */
+static void take_values(int *argc, char **argv, const char *opt,
+			struct strlist *out)
+{
+	int i;
+
+	for (i = 2; i < *argc; i++) {
+		if (strcmp(argv[i], opt) != 0)
+			continue;
+		if (i + 1 == *argc)
+			errx(EXIT_FAILURE, "%s needs an argument.", opt);
+		if (strlist_add(out, argv[i + 1]) == -1)
+			err(EXIT_FAILURE, "realloc()");
+		memmove(argv + i, argv + i + 2,
+			(size_t)(*argc - i - 1) * sizeof(*argv));
+		*argc -= 2;
+		i--;
+	}
+}
+
+/* Take --password-fd and --password-file out of the arguments, and
+   return the password they, or the environment, give. */
+static char *take_password_args(int *argc, char **argv)
+{
+	struct strlist fds, files;
+	char *passw;
+
+	memset(&fds, 0, sizeof(fds));
+	memset(&files, 0, sizeof(files));
+	take_values(argc, argv, "--password-fd", &fds);
+	take_values(argc, argv, "--password-file", &files);
+	passw = take_password_source(fds.n > 0 ? fds.v[fds.n - 1] : NULL,
+				     files.n > 0 ? files.v[files.n - 1] : NULL);
+	free(fds.v);
+	free(files.v);
+	return (passw);
+}
+
+/* Set by SIGINT and SIGTERM, to stop the daemon. */
+static volatile sig_atomic_t serve_stopping;
+
+static void serve_signal(int sig)
+{
+	(void)sig;
+	serve_stopping = 1;
+}
+
+/* Tell the client about something, on its standard error. */
+static void serve_warn(const struct serve_conn *c, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void serve_warn(const struct serve_conn *c, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vdwarn(c->err, 0, fmt, ap);
+	va_end(ap);
+}
+
+/* A path given by the client, made absolute from where it runs. */
+static char *serve_path(const struct serve_conn *c, const char *path)
+{
+	char *p;
+
+	if (path[0] == '/')
+		return (strdup(path));
+	p = malloc(strlen(c->cwd) + strlen(path) + 2);
+	if (p)
+		sprintf(p, "%s/%s", c->cwd, path);
+	return (p);
+}
+
+/* What zip_stat_index() would tell about an entry of a central
+   directory read with its records. */
+static void cdir_stat(const struct cdir *cd, zip_uint64_t i, zip_stat_t *zs)
+{
+	const struct cdir_entry *ce;
+
+	ce = &cd->e[i];
+	zip_stat_init(zs);
+	zs->valid = ZIP_STAT_NAME | ZIP_STAT_INDEX | ZIP_STAT_SIZE |
+		ZIP_STAT_COMP_SIZE | ZIP_STAT_MTIME | ZIP_STAT_CRC |
+		ZIP_STAT_COMP_METHOD;
+	zs->name = ce->name;
+	zs->index = i;
+	zs->size = ce->size;
+	zs->comp_size = ce->comp_size;
+	zs->mtime = dos_mtime(get32(cd->raw + ce->rec + 12));
+	zs->crc = ce->crc;
+	zs->comp_method = ce->method;
+}
+
+static void serve_arc_free(struct serve_arc *a)
+{
+	size_t k;
+
+	for (k = 0; k < a->nzips; k++)
+		zip_close(a->zips[k]);
+	name_index_free(&a->ni);
+	cdir_free(a->cd);
+	close(a->zfd);
+	free(a->path);
+	free(a);
+}
+
+/* The cache is a list, most recently used first, that is only
+   touched with the lock held. */
+static void serve_unlink(struct serve *sv, struct serve_arc *a)
+{
+	if (a->prev)
+		a->prev->next = a->next;
+	else
+		sv->lru = a->next;
+	if (a->next)
+		a->next->prev = a->prev;
+	else
+		sv->tail = a->prev;
+}
+
+static void serve_front(struct serve *sv, struct serve_arc *a)
+{
+	a->prev = NULL;
+	a->next = sv->lru;
+	if (sv->lru)
+		sv->lru->prev = a;
+	else
+		sv->tail = a;
+	sv->lru = a;
+}
+
+/* Take an archive out of the cache. It is freed
+   once the requests using it are done. */
+static void serve_drop(struct serve *sv, struct serve_arc *a)
+{
+	serve_unlink(sv, a);
+	sv->narcs--;
+	sv->bytes -= a->bytes;
+	a->gone = 1;
+	if (a->refs == 0)
+		serve_arc_free(a);
+}
+
+/* Open an archive for the cache: the fd and central directory stay,
+   libzip is only opened when an entry needs it. Returns SERVE_LOCAL
+   for archives cdir_read() can't parse, libzip may still read them. */
+static int serve_arc_open(const struct serve_conn *c, const char *zfile,
+			  char *path, struct serve_arc **out)
+{
+	struct serve_arc *a;
+
+	a = calloc(1, sizeof(*a));
+	if (a == NULL) {
+		serve_warn(c, "error: calloc(): %s", strerror(errno));
+		free(path);
+		return (SERVE_FAILED);
+	}
+	a->path = path;
+	a->zfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (a->zfd == -1 || fstat(a->zfd, &a->st) == -1) {
+		serve_warn(c, "error: %s: %s", zfile, strerror(errno));
+		if (a->zfd != -1)
+			close(a->zfd);
+		free(path);
+		free(a);
+		return (SERVE_FAILED);
+	}
+	a->cd = cdir_read(a->zfd, 1);
+	if (a->cd == NULL || name_index_cdir(&a->ni, a->cd) == -1) {
+		serve_arc_free(a);
+		return (SERVE_LOCAL);
+	}
+
+	/* The records, their names and entries, and the name index. */
+	a->bytes = a->cd->size * 2 + a->cd->nentries *
+		(sizeof(struct cdir_entry) + sizeof(struct name_ent)) +
+		a->ni.tab.cap * sizeof(struct nameslot);
+	*out = a;
+	return (SERVE_OK);
+}
+
+/* Get an archive from the cache, or open it. One that changed since
+   it was opened, going by its inode, size and time, is opened again.
+   The least recently used archives are dropped to keep the cache
+   within --cache and --cache-size, even the one just opened if it
+   alone is bigger than that: it is then only kept for this request. */
+static int serve_arc_get(const struct serve_conn *c, const char *zfile,
+			 struct serve_arc **out)
+{
+	struct serve *sv;
+	struct serve_arc *a, *old;
+	struct stat st;
+	char *abs, *path;
+	int ret;
+
+	sv = c->sv;
+	abs = serve_path(c, zfile);
+	path = abs ? realpath(abs, NULL) : NULL;
+	free(abs);
+	if (path == NULL || stat(path, &st) == -1) {
+		serve_warn(c, "error: %s: %s", zfile, strerror(errno));
+		free(path);
+		return (SERVE_FAILED);
+	}
+
+	pthread_mutex_lock(&sv->lock);
+	for (a = sv->lru; a && strcmp(a->path, path) != 0; a = a->next)
+		;
+	if (a && a->st.st_dev == st.st_dev && a->st.st_ino == st.st_ino &&
+	    a->st.st_size == st.st_size &&
+	    a->st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+	    a->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+		sv->st.hits++;
+		a->refs++;
+		serve_unlink(sv, a);
+		serve_front(sv, a);
+		pthread_mutex_unlock(&sv->lock);
+		free(path);
+		*out = a;
+		return (SERVE_OK);
+	}
+	if (a) {
+		sv->st.reloads++;
+		serve_drop(sv, a);
+	}
+	sv->st.misses++;
+	pthread_mutex_unlock(&sv->lock);
+
+	ret = serve_arc_open(c, zfile, path, &a);
+	if (ret != SERVE_OK)
+		return (ret);
+
+	/* The newest one wins if another request opened it meanwhile. */
+	pthread_mutex_lock(&sv->lock);
+	for (old = sv->lru; old && strcmp(old->path, a->path) != 0;
+	     old = old->next)
+		;
+	if (old)
+		serve_drop(sv, old);
+	a->refs = 1;
+	serve_front(sv, a);
+	sv->narcs++;
+	sv->bytes += a->bytes;
+	while (sv->narcs > sv->max || sv->bytes > sv->max_bytes) {
+		sv->st.evictions++;
+		serve_drop(sv, sv->tail);
+	}
+	pthread_mutex_unlock(&sv->lock);
+	*out = a;
+	return (SERVE_OK);
+}
+
+static void serve_arc_put(struct serve *sv, struct serve_arc *a)
+{
+	int last;
+
+	pthread_mutex_lock(&sv->lock);
+	last = --a->refs == 0 && a->gone;
+	pthread_mutex_unlock(&sv->lock);
+	if (last)
+		serve_arc_free(a);
+}
+
+/* Get an idle libzip handle of an archive, or open one. It is opened
+   through the fd of the cache, so it reads the same file even if the
+   archive was replaced since. */
+static zip_t *serve_zip_take(const struct serve_conn *c, struct serve_arc *a)
+{
+	struct serve *sv;
+	zip_t *zip;
+	char proc[64];
+	int fd, eptr;
+
+	sv = c->sv;
+	zip = NULL;
+	pthread_mutex_lock(&sv->lock);
+	if (a->nzips > 0)
+		zip = a->zips[--a->nzips];
+	else
+		sv->st.handles++;
+	pthread_mutex_unlock(&sv->lock);
+	if (zip)
+		return (zip);
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", a->zfd);
+	fd = open(proc, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		serve_warn(c, "error: %s: %s", a->path, strerror(errno));
+		return (NULL);
+	}
+	zip = zip_fdopen(fd, 0, &eptr);
+	if (zip == NULL) {
+		close(fd);
+		serve_warn(c, "error: %s: %s", a->path,
+			   zip_proper_error[eptr]);
+	}
+	return (zip);
+}
+
+/* Give a handle back, to be kept for the next request if there is
+   room. */
+static void serve_zip_give(struct serve *sv, struct serve_arc *a, zip_t *zip)
+{
+	int keep;
+
+	if (zip == NULL)
+		return;
+	pthread_mutex_lock(&sv->lock);
+	keep = a->gone == 0 && a->nzips < SERVE_HANDLES;
+	if (keep)
+		a->zips[a->nzips++] = zip;
+	pthread_mutex_unlock(&sv->lock);
+	if (keep == 0)
+		zip_close(zip);
+}
+
+/* name_query_report(), to the client. */
+static size_t serve_query_report(const struct serve_conn *c,
+				 const struct name_query *q)
+{
+	size_t k, missed;
+
+	missed = 0;
+	for (k = 0; k < q->req.n; k++) {
+		if (q->hit[k])
+			continue;
+		if (is_glob(q->req.v[k]))
+			serve_warn(c, "no archived file matches '%s'.",
+				   q->req.v[k]);
+		else
+			serve_warn(c, "no archived file was found with "
+				   "name '%s'.", q->req.v[k]);
+		missed++;
+	}
+	return (missed);
+}
+
+/* Names that name_query_init() can't take without exiting, or reads
+   from files, are left to the client. */
+static int serve_names_ok(char **names, size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		if (names[k][0] == '\0' || names[k][0] == '@')
+			return (0);
+	}
+	return (1);
+}
+
+/* Release the archives taken by a request. */
+static void serve_arcs_put(struct serve *sv, struct serve_arc **arcs,
+			   size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		serve_arc_put(sv, arcs[k]);
+	free(arcs);
+}
+
+/* Take every archive of a request before anything is written, so
+   that the request can still be left to the client. */
+static int serve_arcs_get(const struct serve_conn *c, char **zfiles,
+			  size_t n, struct serve_arc ***out)
+{
+	struct serve_arc **arcs;
+	size_t k;
+	int ret;
+
+	arcs = calloc(n + 1, sizeof(*arcs));
+	if (arcs == NULL) {
+		serve_warn(c, "error: calloc(): %s", strerror(errno));
+		return (SERVE_FAILED);
+	}
+	for (k = 0; k < n; k++) {
+		ret = serve_arc_get(c, zfiles[k], &arcs[k]);
+		if (ret != SERVE_OK) {
+			serve_arcs_put(c->sv, arcs, k);
+			return (ret);
+		}
+	}
+	*out = arcs;
+	return (SERVE_OK);
+}
+
+/* l: list the archives, like zip_list_all_files(). */
+static int serve_list(struct serve_conn *c)
+{
+	struct serve_arc **arcs;
+	zip_uint64_t i;
+	zip_stat_t zs;
+	struct tm t;
+	char dfmt[11], tfmt[6];
+	char **zfiles;
+	size_t k, n;
+	FILE *out;
+	int fd, ret;
+
+	zfiles = c->argv + 2;
+	for (n = 0, k = 2; k < (size_t)c->argc; k++) {
+		if (strstr(c->argv[k], ".zip"))
+			zfiles[n++] = c->argv[k];
+	}
+	if (n == 0)
+		return (SERVE_LOCAL);
+	ret = serve_arcs_get(c, zfiles, n, &arcs);
+	if (ret != SERVE_OK)
+		return (ret);
+
+	fd = dup(c->out);
+	out = fd == -1 ? NULL : fdopen(fd, "w");
+	if (out == NULL) {
+		serve_warn(c, "error: fdopen(): %s", strerror(errno));
+		if (fd != -1)
+			close(fd);
+		serve_arcs_put(c->sv, arcs, n);
+		return (SERVE_FAILED);
+	}
+	setvbuf(out, NULL, _IOFBF, OUT_BUFFER);
+	for (k = 0; k < n; k++) {
+		for (i = 0; i < arcs[k]->cd->nentries; i++) {
+			cdir_stat(arcs[k]->cd, i, &zs);
+			if (zs.name[0] == '\0')
+				continue;
+
+			localtime_r(&zs.mtime, &t);
+			strftime(dfmt, sizeof(dfmt), "%Y-%m-%d", &t);
+			strftime(tfmt, sizeof(tfmt), "%H:%M", &t);
+			if (zs.name[strlen(zs.name) - 1] == '/')
+				fprintf(out, "%s %s %s (directory)\n",
+					dfmt, tfmt, zs.name);
+			else
+				fprintf(out, "%s %s %s (%zu bytes)\n",
+					dfmt, tfmt, zs.name, zs.size);
+		}
+	}
+	ret = fclose(out) == 0 ? SERVE_OK : SERVE_FAILED;
+	serve_arcs_put(c->sv, arcs, n);
+	return (ret);
+}
+
+/* p: extract members to the standard output of the client, like
+   zip_pipe_files(). */
+static int serve_pipe(struct serve_conn *c)
+{
+	static const char zero[TAR_BLOCK * 2];
+	struct serve_arc *a;
+	struct name_query q;
+	const struct cdir_entry *ce;
+	struct strlist bufsize;
+	zip_t *zip;
+	zip_uint64_t i;
+	zip_stat_t zs;
+	unsigned char *sel;
+	char **names;
+	size_t nnames, missed;
+	char type;
+	int k, to_tar, failed, ret;
+
+	/* The switches are taken out like in main(), the names follow
+	   the archive. The buffer size is the one of the worker. */
+	if (strcmp(c->argv[c->argc - 1], "--buffer-size") == 0)
+		return (SERVE_LOCAL);
+	/* The password switches name files and fds of the client. */
+	for (k = 2; k < c->argc; k++) {
+		if (strcmp(c->argv[k], "--password-fd") == 0 ||
+		    strcmp(c->argv[k], "--password-file") == 0)
+			return (SERVE_LOCAL);
+	}
+	memset(&bufsize, 0, sizeof(bufsize));
+	to_tar = take_flag(&c->argc, c->argv, "--to-tar");
+	take_flag(&c->argc, c->argv, "--index");
+	take_values(&c->argc, c->argv, "--buffer-size", &bufsize);
+	free(bufsize.v);
+	for (k = 2; k < c->argc && strstr(c->argv[k], ".zip") == NULL; k++)
+		;
+	if (k >= c->argc)
+		return (SERVE_LOCAL);
+	names = c->argv + k + 1;
+	nnames = (size_t)(c->argc - k - 1);
+	if (serve_names_ok(names, nnames) == 0)
+		return (SERVE_LOCAL);
+	ret = serve_arc_get(c, c->argv[k], &a);
+	if (ret != SERVE_OK)
+		return (ret);
+
+	sel = calloc((size_t)a->cd->nentries + 1, 1);
+	if (sel == NULL) {
+		serve_warn(c, "error: calloc(): %s", strerror(errno));
+		serve_arc_put(c->sv, a);
+		return (SERVE_FAILED);
+	}
+	missed = 0;
+	if (nnames > 0) {
+		name_query_init(&q, names, nnames, 0);
+		name_query_select(&q, &a->ni, sel);
+		missed = serve_query_report(c, &q);
+		name_query_free(&q);
+	} else {
+		memset(sel, 1, (size_t)a->cd->nentries);
+	}
+
+	/* Encrypted entries need the password of the client. */
+	for (i = 0; i < a->cd->nentries; i++) {
+		if (sel[i] && (a->cd->e[i].flags & 1)) {
+			free(sel);
+			serve_arc_put(c->sv, a);
+			return (SERVE_LOCAL);
+		}
+	}
+
+	c->zp.fd = c->out;
+	c->zp.len = 0;
+	zip = NULL;
+	failed = 0;
+	for (i = 0; i < a->cd->nentries && failed == 0; i++) {
+		if (sel[i] == 0)
+			continue;
+		cdir_stat(a->cd, i, &zs);
+		if (zs.name[0] == '\0')
+			continue;
+
+		type = zs.name[strlen(zs.name) - 1] == '/' ? '5' : '0';
+		if (to_tar && tar_entry_header(&c->zp, &zs,
+					       cdir_rec_mode(a->cd->raw +
+							     a->cd->e[i].rec),
+					       type) == -1) {
+			failed = 1;
+			break;
+		}
+		if (type == '5')
+			continue;
+
+		/* Stored and deflated entries are read straight from the
+		   archive, libzip is left for the others. */
+		ce = &a->cd->e[i];
+		if ((ce->flags & 1) == 0 && (ce->method == ZIP_CM_STORE ||
+					     ce->method == ZIP_CM_DEFLATE)) {
+			ret = pipe_raw_entry(&c->zp, a->zfd, ce, c->in,
+					     ZBUF_DEFAULT);
+		} else {
+			if (zip == NULL)
+				zip = serve_zip_take(c, a);
+			ret = zip ? pipe_entry(&c->zp, zip, &zs, i, NULL) : -1;
+		}
+		if (ret == -1 || (to_tar && tar_pad(&c->zp, zs.size) == -1))
+			failed = 1;
+	}
+
+	/* A tar stream ends with two empty blocks. */
+	if (to_tar && failed == 0 && pipe_put(&c->zp, zero, sizeof(zero)) == -1)
+		failed = 1;
+	if (pipe_flush(&c->zp) == -1)
+		failed = 1;
+	serve_zip_give(c->sv, a, zip);
+	serve_arc_put(c->sv, a);
+	free(sel);
+	return (failed || missed ? SERVE_FAILED : SERVE_OK);
+}
+
+/* Work out which entries of a cached archive x extracts, like
+   unzip_select(). Returns NULL (after telling why) on failure. */
+static unsigned char *serve_select(const struct serve_conn *c,
+				   const struct serve_arc *a,
+				   const struct unzip_opts *opts)
+{
+	unsigned char *sel, *out;
+	zip_uint64_t k;
+
+	sel = calloc((size_t)a->cd->nentries + 1, 1);
+	out = calloc((size_t)a->cd->nentries + 1, 1);
+	if (sel == NULL || out == NULL) {
+		serve_warn(c, "error: calloc(): %s", strerror(errno));
+		free(sel);
+		free(out);
+		return (NULL);
+	}
 
-	zip = zip_open(zfile, ZIP_NONE, &eptr);
-        if (zip == NULL)
-	        zip_basic_error_exit(NULL, eptr);
+	if (opts->include) {
+		memset(opts->include->hit, 0, opts->include->req.n);
+		name_query_select(opts->include, &a->ni, sel);
+		serve_query_report(c, opts->include);
+	} else {
+		memset(sel, 1, (size_t)a->cd->nentries);
+	}
+	if (opts->exclude)
+		name_query_select(opts->exclude, &a->ni, out);
+	for (k = 0; k < a->cd->nentries; k++)
+		sel[k] &= !out[k];
+	free(out);
+	return (sel);
+}
 
-	entries = zip_get_num_entries(zip, 0);
-	mlen = 0;
-        ret = rename_ok = 0;
-	in_loop = 1;
-	passw = NULL;
+/* Extract the selected entries of a cached archive to dpath, the way
+   unzip_zip_archive() does with -y, one entry after another. */
+static int serve_extract_archive(struct serve_conn *c, struct serve_arc *a,
+				 const char *dpath,
+				 const struct unzip_opts *opts,
+				 const unsigned char *sel, FILE *out)
+{
+	struct unzip_ctx ctx;
+	struct unzip_job job;
+	struct dircache dc;
+	zip_t *zip;
+	zip_uint64_t i;
+	const char *leaf;
+	char *p, *dir;
+	size_t zlen, dlen;
+	int dfd, ret;
 
-	for (i = 0; i < (zip_uint64_t)entries; i++) {
-		if (zip_stat_index(zip, i, 0, &zs) == 0) {
-			zlen = strlen(zs.name);
-			dlen = strlen(dpath);
-			tlen = zlen + dlen + 3;
-
-			if (mlen == 0) {
-				/* Allocate memory to keep the formatted path stored. */
-				tlen = (zlen + dlen + 4) * 4;
-				r = realloc(p, tlen);
-				if (r == NULL) {
-					/* Keeping open file descriptors are very costly.
-					   Ensure cleanup before exiting. */
-					zip_close(zip);
-					free(p);
-					err(EXIT_FAILURE, "realloc()");
-				}
+	if (dircache_init(&dc, dpath, ARCHIVE_DIRFDS) == -1) {
+		serve_warn(c, "error: open(): %s: %s", dpath, strerror(errno));
+		return (-1);
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.zfile = a->path;
+	ctx.opts = opts;
+	ctx.zfd = a->zfd;
+	ctx.cd = a->cd;
+	ctx.out = out;
 
-				p = r;
-				mlen = tlen;
-			} else {
-				/* Decrease for 1 time from the 4 times (x * 4). */
-				mlen -= tlen + 1;
+	zip = NULL;
+	dlen = strlen(dpath);
+	ret = 0;
+	for (i = 0; i < a->cd->nentries && ret == 0; i++) {
+		if (sel[i] == 0)
+			continue;
+		memset(&job, 0, sizeof(job));
+		cdir_stat(a->cd, i, &job.zs);
+		zlen = strlen(job.zs.name);
+		if (zlen == 0)
+			continue;
+		if (safe_name(job.zs.name) == 0) {
+			serve_warn(c, "skipping %s: unsafe path.", job.zs.name);
+			continue;
+		}
+
+		if (job.zs.name[zlen - 1] == '/') {
+			dir = strndup(job.zs.name, zlen - 1);
+			if (dir == NULL || dircache_dir(&dc, dir) == -1) {
+				serve_warn(c, "error: mkdir(): %s/%s: %s",
+					   dpath, job.zs.name, strerror(errno));
+				ret = -1;
 			}
+			free(dir);
+			continue;
+		}
+		dfd = dircache_place(&dc, job.zs.name, &leaf);
+		p = malloc(dlen + zlen + 2);
+		if (dfd == -1 || p == NULL) {
+			serve_warn(c, "error: mkdir(): %s/%s: %s", dpath,
+				   job.zs.name, strerror(errno));
+			free(p);
+			ret = -1;
+			break;
+		}
+		snprintf(p, dlen + zlen + 2, "%s/%s", dpath, job.zs.name);
 
-			/* Destination place where the file will be created. */
-			snprintf(p, tlen, "%s/%s", dpath, zs.name);
+		job.idx = i;
+		job.path = p;
+		job.dfd = dfd;
+		job.leaf = p + dlen + 1 + (leaf - job.zs.name);
+		job.label = job.zs.name;
 
-			/* If the file is a directory, create a directory for it. */
-			if (zs.name[zlen - 1] == '/') {
-				if (mkdir(p, 0777) == -1) {
-					if (errno != EEXIST) {
-						zip_close(zip);
-						free(p);
-						err(EXIT_FAILURE, "mkdir()");
-					}
-				}
-			} else {
-				/* For a file, create the file with proper permission bits,
-				   and write the contents to that file descriptor. Also,
-				   print the file name that's being inflated. */
-				if (all_ok == 0 && access(p, F_OK) == 0) {
-				        do {
-						fprintf(stdout,
-							"replace %s? [y]es, [n]o, [a]ll, "
-							"[r]ename, [e]xit: ",
-							zs.name);
-						fflush(stdout);
-						ret = take_stdin_args();
-						switch (ret) {
-						case REPLACE_ERROR:
-							/* An internal error occurred in libzip. */
-							zip_close(zip);
-							free(p);
-							errx(EXIT_FAILURE,
-							     "reading input stream failed.");
-							break;
-
-						case REPLACE_INVALID:
-							/* Invalid input was provided. */
-							fputs("invalid input, ignoring...\n",
-							      stderr);
-							break;
-
-						case REPLACE_ALL:
-							/* Assume other answers are always
-							   will be 'yes'. */
-							all_ok = 1;
-							ret = REPLACE_YES;
-							in_loop = 0;
-							break;
-
-						case REPLACE_RENAME:
-							/* Indicate that we need to rename
-							   the file, so we don't overwrite
-							   the original or already extracted
-							   file. */
-							rename_ok = 1;
-							ret = REPLACE_YES;
-							in_loop = 0;
-							break;
-
-						case REPLACE_OVERFLOW:
-							/* If we read more than we need to,
-							   free the buffers, and exit from
-							   the program. */
-						        zip_close(zip);
-							free(p);
-							errx(EXIT_FAILURE,
-							     "invalid input, exiting...\n");
-						        break;
-
-						default:
-							/* This case will be always unreachable
-							   as we handle invalid inputs, this is
-							   to satisfy the compiler. */ 
-							in_loop = 0;
-							break;
-						}
-				        } while (in_loop);
-			        }
+		/* Stored entries are copied from the fd of the cache,
+		   the others need a libzip handle. */
+		if (zip == NULL && stored_entry(&ctx, &job) == NULL) {
+			zip = serve_zip_take(c, a);
+			if (zip == NULL) {
+				free(p);
+				ret = -1;
+				break;
+			}
+		}
+		ret = extract_file_from_zip(zip, &ctx, &job, &c->io);
+		free(p);
+	}
 
-				switch (ret) {
-				case 0: /* This the default value of ret,
-					   only used if the previous access()
-					   call returns -1 (fails). */
-				case REPLACE_YES:
-					if (zs.encryption_method) {
-						fprintf(stdout, "[%s] %s password: ",
-							pathbase(zfile), zs.name);
-						fflush(stdout);
-						passw = take_stdin_password();
-						fputc('\n', stdout);
-					}
+	serve_zip_give(c->sv, a, zip);
+	dircache_free(&dc);
+	return (ret);
+}
 
-					/* extract the file from the archive. */
-					extract_file_from_zip(
-						zip, zs, i, zs.encryption_method,
-						rename_ok, passw, p);
-					rename_ok = 0;
-					if (passw) {
-						free(passw);
-						passw = NULL;
-					}
-				        break;
+/* x: extract archives, if the request is one the daemon can take:
+   with -y, since there is no terminal to ask on, and without the
+   switches it doesn't know. -j is left to the daemon, which serves
+   every request on one of its threads. */
+static int serve_extract(struct serve_conn *c)
+{
+	struct unzip_opts opts;
+	struct serve_arc **arcs;
+	struct strlist inc, exc, zfiles;
+	struct name_query incq, excq;
+	unsigned char **sels;
+	const char *dest;
+	char *dpath, *arg, *value;
+	zip_uint64_t j;
+	FILE *out;
+	size_t k;
+	int i, all_ok, ret, fd;
 
-				case REPLACE_EXIT:
-					zip_close(zip);
-					free(p);
-					exit(EXIT_SUCCESS);
-					/* unreachable. */
+	memset(&opts, 0, sizeof(opts));
+	memset(&inc, 0, sizeof(inc));
+	memset(&exc, 0, sizeof(exc));
+	memset(&zfiles, 0, sizeof(zfiles));
+	dest = ".";
+	all_ok = 0;
+	ret = SERVE_OK;
+	for (i = 2; i < c->argc && ret == SERVE_OK; i++) {
+		arg = c->argv[i];
+		value = c->argv[i + 1];
+		if (strcmp(arg, "-y") == 0) {
+			all_ok = 1;
+		} else if (strcmp(arg, "-q") == 0) {
+			opts.quiet = 1;
+		} else if (value && strcmp(arg, "-o") == 0) {
+			dest = value;
+			i++;
+		} else if (value && (strcmp(arg, "-j") == 0 ||
+				     strcmp(arg, "--buffer-size") == 0)) {
+			i++;
+		} else if (value && (strcmp(arg, "--include") == 0 ||
+				     strcmp(arg, "--exclude") == 0)) {
+			if (strlist_add(arg[2] == 'i' ? &inc : &exc,
+					value) == -1)
+				ret = SERVE_LOCAL;
+			i++;
+		} else if (arg[0] != '-' && strstr(arg, ".zip")) {
+			if (strlist_add(&zfiles, arg) == -1)
+				ret = SERVE_LOCAL;
+		} else {
+			ret = SERVE_LOCAL;
+		}
+	}
+	if (ret != SERVE_OK || all_ok == 0 || zfiles.n == 0 ||
+	    serve_names_ok(inc.v, inc.n) == 0 ||
+	    serve_names_ok(exc.v, exc.n) == 0) {
+		free(inc.v);
+		free(exc.v);
+		free(zfiles.v);
+		return (SERVE_LOCAL);
+	}
 
-				case REPLACE_NO:
-				default:
-					break;
-				}
-		        }
+	opts.all_ok = 1;
+	opts.jobs = 1;
+	opts.bufsize = c->io.size;
+	if (inc.n > 0) {
+		name_query_init(&incq, inc.v, inc.n, 0);
+		opts.include = &incq;
+	}
+	if (exc.n > 0) {
+		name_query_init(&excq, exc.v, exc.n, 0);
+		opts.exclude = &excq;
+	}
+
+	dpath = serve_path(c, dest);
+	sels = calloc(zfiles.n, sizeof(*sels));
+	arcs = NULL;
+	out = NULL;
+	if (dpath == NULL || sels == NULL) {
+		serve_warn(c, "error: malloc(): %s", strerror(errno));
+		ret = SERVE_FAILED;
+	} else if (access(dpath, F_OK) == -1) {
+		serve_warn(c, "error: destination path '%s' does not exists.",
+			   dest);
+		ret = SERVE_FAILED;
+	} else {
+		ret = serve_arcs_get(c, zfiles.v, zfiles.n, &arcs);
+	}
+
+	/* Encrypted entries need a password, which is asked for by the
+	   client. */
+	for (k = 0; k < zfiles.n && ret == SERVE_OK; k++) {
+		sels[k] = serve_select(c, arcs[k], &opts);
+		if (sels[k] == NULL) {
+			ret = SERVE_FAILED;
+			break;
+		}
+		for (j = 0; j < arcs[k]->cd->nentries; j++) {
+			if (sels[k][j] && (arcs[k]->cd->e[j].flags & 1)) {
+				ret = SERVE_LOCAL;
+				break;
+			}
 		}
 	}
 
-	free(p);
-	zip_close(zip);
+	if (ret == SERVE_OK) {
+		fd = dup(c->out);
+		out = fd == -1 ? NULL : fdopen(fd, "w");
+		if (out == NULL) {
+			serve_warn(c, "error: fdopen(): %s", strerror(errno));
+			if (fd != -1)
+				close(fd);
+			ret = SERVE_FAILED;
+		} else {
+			setvbuf(out, NULL, _IOFBF, OUT_BUFFER);
+		}
+	}
+	for (k = 0; k < zfiles.n && ret == SERVE_OK; k++) {
+		if ((opts.include || opts.exclude) &&
+		    memchr(sels[k], 1, (size_t)arcs[k]->cd->nentries) == NULL)
+			serve_warn(c, "nothing to extract from '%s'.",
+				   zfiles.v[k]);
+		else if (serve_extract_archive(c, arcs[k], dpath, &opts,
+					       sels[k], out) == -1)
+			ret = SERVE_FAILED;
+	}
+	if (out && fclose(out) != 0)
+		ret = SERVE_FAILED;
+
+	for (k = 0; sels && k < zfiles.n; k++)
+		free(sels[k]);
+	free(sels);
+	if (arcs)
+		serve_arcs_put(c->sv, arcs, zfiles.n);
+	if (opts.include)
+		name_query_free(opts.include);
+	if (opts.exclude)
+		name_query_free(opts.exclude);
+	free(dpath);
+	free(inc.v);
+	free(exc.v);
+	free(zfiles.v);
+	return (ret);
 }
 
-static void zip_list_all_files(const char *zfile)
+/* What the daemon did since it started. */
+static void serve_report(struct serve *sv, FILE *out)
 {
-	zip_t *zip;
-	zip_int64_t entries;
-	zip_uint64_t i;
-	zip_stat_t zs;
-	char dfmt[11], tfmt[6];
-	struct tm *t;
-	int eptr;
+	struct serve_stats st;
+	zip_uint64_t bytes;
+	size_t narcs;
+	char b1[32], b2[32];
 
-	zip = zip_open(zfile, ZIP_NONE, &eptr);
-	if (zip == NULL)
-		zip_basic_error_exit(NULL, eptr);
+	pthread_mutex_lock(&sv->lock);
+	st = sv->st;
+	narcs = sv->narcs;
+	bytes = sv->bytes;
+	pthread_mutex_unlock(&sv->lock);
 
-	entries = zip_get_num_entries(zip, ZIP_FL_NONE);
+	fprintf(out, "uptime: %.1f s, %ld thread(s)\n",
+		(double)(clock_ns() - sv->start) / 1e9, sv->nthreads);
+	fprintf(out, "requests: %llu, %llu failed, %llu left to the "
+		"client\n", (unsigned long long)st.requests,
+		(unsigned long long)st.failed, (unsigned long long)st.local);
+	fprintf(out, "cache: %zu of %zu archive(s) open, %s of %s, "
+		"%llu hit(s), %llu miss(es) (%.1f%% hits), %llu reloaded, "
+		"%llu evicted\n", narcs, sv->max,
+		human_size(b1, sizeof(b1), bytes),
+		human_size(b2, sizeof(b2), sv->max_bytes),
+		(unsigned long long)st.hits,
+		(unsigned long long)st.misses,
+		st.hits + st.misses ? (double)st.hits * 100 /
+		(double)(st.hits + st.misses) : 0.0,
+		(unsigned long long)st.reloads,
+		(unsigned long long)st.evictions);
+	fprintf(out, "libzip handles: %llu opened\n",
+		(unsigned long long)st.handles);
+}
 
-	/* Iterate over the entries. */
-	for (i = 0; i < (zip_uint64_t)entries; i++) {
-	        if (zip_stat_index(zip, i, 0, &zs) == -1)
-			zip_basic_error_exit(zip, 0);
+/* stats: the counters of the daemon, to the client. */
+static int serve_stats_cmd(struct serve_conn *c)
+{
+	FILE *out;
+	int fd;
 
-		t = localtime(&zs.mtime);
-		strftime(dfmt, sizeof(dfmt), "%Y-%m-%d", t);
-		strftime(tfmt, sizeof(tfmt), "%H:%M", t);
-		if (zs.name[strlen(zs.name) - 1] == '/')
-			fprintf(stdout, "%s %s %s (directory)\n",
-				dfmt, tfmt, zs.name);
-		else
-			fprintf(stdout, "%s %s %s (%zu bytes)\n",
-				dfmt, tfmt, zs.name, zs.size);
+	fd = dup(c->out);
+	out = fd == -1 ? NULL : fdopen(fd, "w");
+	if (out == NULL) {
+		if (fd != -1)
+			close(fd);
+		return (SERVE_FAILED);
 	}
+	serve_report(c->sv, out);
+	return (fclose(out) == 0 ? SERVE_OK : SERVE_FAILED);
+}
 
-	zip_close(zip);
+/* Read exactly len bytes of a request. */
+static int serve_read(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		buf = (char *)buf + n;
+		len -= (size_t)n;
+	}
+	return (0);
 }
 
-static void zip_archive_file_rename(const char *zfile, const char *old_name,
-				    const char *new_name)
+/* Take a request from a connection, with the standard output and
+   error of the client that come along with its head, and serve it.
+   Only requests of our own user are taken. */
+static void serve_request(struct serve_conn *c, int fd)
 {
-	zip_t *zip;
-	zip_int64_t entries;
-	zip_uint64_t i;
-	zip_stat_t zs;
-	int one_ok, eptr;
+	struct serve_req req;
+	struct ucred cred;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	struct timeval tv;
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	socklen_t clen;
+	zip_int32_t status;
+	char *buf, *s;
+	size_t k, got;
+	ssize_t n;
+	int fds[2];
 
-        /* No need to check for NULL, as we are sure that arguments
-	   will be passed, but we are not sure whether those arguments
-	   actually will have anything or not. */
-	if (strlen(old_name) == 0)
-	        errx(EXIT_FAILURE,
-		     "error: old file path cannot be an empty string.");
-	if (strlen(new_name) == 0)
-		errx(EXIT_FAILURE,
-		     "error: new file path cannot be an empty string.");
+	clen = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) == -1 ||
+	    cred.uid != geteuid())
+		return;
+	tv.tv_sec = SERVE_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-	zip = zip_open(zfile, ZIP_NONE, &eptr);
-	if (zip == NULL)
-		zip_basic_error_exit(NULL, eptr);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	do
+		n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	while (n == -1 && errno == EINTR);
+	if (n <= 0)
+		return;
 
-	/* Get the number of entries. */
-	entries = zip_get_num_entries(zip, ZIP_FL_NONE);
-	one_ok = 0;
-	for (i = 0; i < (zip_uint64_t)entries; i++) {
-		if (zip_stat_index(zip, i, 0, &zs) == -1)
-			zip_basic_error_exit(zip, 0);
+	fds[0] = fds[1] = -1;
+	cm = CMSG_FIRSTHDR(&msg);
+	if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+	    cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+		memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+	else if (cm && cm->cmsg_level == SOL_SOCKET &&
+		 cm->cmsg_type == SCM_RIGHTS) {
+		for (k = 0; k < (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int); k++)
+			close(((int *)CMSG_DATA(cm))[k]);
+	}
 
-		/* If the old name matches with the filename
-		   inside the zip archive, we can rename it. */
-		if (strncmp(zs.name, old_name, zs.size) == 0) {
-			one_ok = 1;
-			if (zip_file_rename(zip, i, new_name,
-					    ZIP_FL_ENC_GUESS) == -1)
-				zip_basic_error_exit(zip, 0);
-	        }
+	buf = NULL;
+	c->argv = NULL;
+	got = (size_t)n;
+	if (fds[0] == -1 ||
+	    serve_read(fd, (char *)&req + got, sizeof(req) - got) == -1 ||
+	    memcmp(req.magic, SERVE_MAGIC, sizeof(req.magic)) != 0 ||
+	    req.len == 0 || req.len > SERVE_REQ_MAX || req.argc < 2 ||
+	    req.argc > req.len)
+		goto done;
+	buf = malloc(req.len);
+	c->argv = calloc(req.argc + 1, sizeof(*c->argv));
+	if (buf == NULL || c->argv == NULL ||
+	    serve_read(fd, buf, req.len) == -1 || buf[req.len - 1] != '\0')
+		goto done;
+
+	/* The directory of the client, then its arguments. */
+	c->cwd = buf;
+	s = buf + strlen(buf) + 1;
+	for (k = 0; k < req.argc; k++) {
+		if (s >= buf + req.len)
+			goto done;
+		c->argv[k] = s;
+		s += strlen(s) + 1;
+	}
+	if (s != buf + req.len)
+		goto done;
+	c->argc = (int)req.argc;
+	c->out = fds[0];
+	c->err = fds[1];
+	c->zp.err = c->err;
+	c->io.err = c->err;
+
+	switch (c->argv[1][0]) {
+	case 'l':
+		status = serve_list(c);
+		break;
+	case 'p':
+		status = serve_pipe(c);
+		break;
+	case 'e':
+	case 'x':
+		status = serve_extract(c);
+		break;
+	default:
+		status = strcmp(c->argv[1], "stats") == 0 ?
+			serve_stats_cmd(c) : SERVE_LOCAL;
+		break;
+	}
+
+	pthread_mutex_lock(&c->sv->lock);
+	c->sv->st.requests++;
+	if (status == SERVE_FAILED)
+		c->sv->st.failed++;
+	if (status == SERVE_LOCAL)
+		c->sv->st.local++;
+	pthread_mutex_unlock(&c->sv->lock);
+	write_all(fd, &status, sizeof(status));
+
+done:
+	free(c->argv);
+	free(buf);
+	if (fds[0] != -1) {
+		close(fds[0]);
+		close(fds[1]);
 	}
-	
-	zip_close(zip);
-	if (one_ok == 0)
-		errx(EXIT_FAILURE,
-		     "error: no archived file was found with name '%s'.",
-		     old_name);
-	else
-	        fprintf(stdout, "changed from '%s' to '%s'.\n",
-			old_name, new_name);
 }
 
-static void zip_archive_file_delete(const char *zfile, const char *file_name)
+/* A worker of the daemon. Its buffers are taken once, so the memory
+   of the daemon only depends on the number of workers and the cache. */
+static void *serve_worker(void *arg)
 {
-	zip_t *zip;
-	zip_int64_t entries;
-	zip_uint64_t i;
-	zip_stat_t zs;
-	int one_ok, eptr;
+	struct serve_conn c;
+	struct unzip_opts opts;
+	int fd;
 
-	if (strlen(file_name) == 0)
-		errx(EXIT_FAILURE,
-		     "file path cannot be an empty string.");
+	memset(&c, 0, sizeof(c));
+	memset(&opts, 0, sizeof(opts));
+	c.sv = arg;
+	opts.bufsize = ZBUF_DEFAULT;
+	c.zp.size = ZBUF_DEFAULT;
+	c.in = malloc(ZBUF_DEFAULT);
+	if (c.in == NULL ||
+	    posix_memalign((void **)&c.zp.buf, ZBUF_ALIGN, c.zp.size) != 0 ||
+	    io_alloc(&c.io, &opts, NULL) == -1) {
+		warn("posix_memalign()");
+		free(c.in);
+		free(c.zp.buf);
+		return (NULL);
+	}
 
-	zip = zip_open(zfile, ZIP_NONE, &eptr);
-	if (zip == NULL)
-		zip_basic_error_exit(NULL, eptr);
+	for (;;) {
+		pthread_mutex_lock(&c.sv->lock);
+		while (c.sv->queued == 0 && c.sv->stop == 0)
+			pthread_cond_wait(&c.sv->ready, &c.sv->lock);
+		if (c.sv->queued == 0) {
+			pthread_mutex_unlock(&c.sv->lock);
+			break;
+		}
+		fd = c.sv->queue[c.sv->head];
+		c.sv->head = (c.sv->head + 1) % SERVE_QUEUE;
+		c.sv->queued--;
+		pthread_cond_signal(&c.sv->room);
+		pthread_mutex_unlock(&c.sv->lock);
 
-	one_ok = 0;
-	entries = zip_get_num_entries(zip, ZIP_FL_NONE);
+		serve_request(&c, fd);
+		close(fd);
+	}
 
-	/* Iterate over the file entries. */
-	for (i = 0; i < (zip_uint64_t)entries; i++) {
-		if (zip_stat_index(zip, i, 0, &zs) == -1)
-			zip_basic_error_exit(zip, 0);
+	io_free(&c.io);
+	free(c.in);
+	free(c.zp.buf);
+	return (NULL);
+}
 
-		/* If file name matches with the archive file name(s),
-		   delete that file from the archive. */
-	        if (strncmp(zs.name, file_name, zs.size) == 0) {
-			one_ok = 1;
-			if (zip_delete(zip, i) == -1)
-			        zip_basic_error_exit(zip, 0);
-        	}
+/* Listen on a Unix socket, that only our own user can connect to. A
+   socket left behind by a daemon that is gone is replaced. */
+static int serve_listen(const char *sock)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+	mode_t mask;
+	int fd, probe, ret;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(sock) >= sizeof(sa.sun_path))
+		errx(EXIT_FAILURE, "socket path '%s' is too long.", sock);
+	strcpy(sa.sun_path, sock);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		err(EXIT_FAILURE, "socket()");
+	mask = umask(077);
+	ret = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+	if (ret == -1 && errno == EADDRINUSE &&
+	    lstat(sock, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (probe != -1 && connect(probe, (struct sockaddr *)&sa,
+					   sizeof(sa)) == 0)
+			errx(EXIT_FAILURE, "a daemon already listens on '%s'.",
+			     sock);
+		if (probe != -1)
+			close(probe);
+		unlink(sock);
+		ret = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
 	}
+	umask(mask);
+	if (ret == -1 || listen(fd, SERVE_QUEUE) == -1)
+		err(EXIT_FAILURE, "cannot listen on '%s'", sock);
+	return (fd);
+}
 
-	zip_close(zip);
-	if (one_ok == 0)
-		errx(EXIT_FAILURE,
-		     "error: no archived file was found with name '%s'.",
-		     file_name);
-        else
-		fprintf(stdout, "file '%s' was deleted from the archive.\n",
-			file_name);
+/* Run the daemon: accept connections and queue them for nthreads
+   workers, until SIGINT or SIGTERM. The queue is bounded, once it is
+   full, new connections wait in the backlog of the socket. */
+static void serve(const char *sock, long nthreads, size_t max,
+		  zip_uint64_t max_bytes)
+{
+	struct serve sv;
+	struct serve_arc *a;
+	struct sigaction sa;
+	sigset_t stop, old;
+	pthread_t *tids;
+	long t, started;
+	char b1[32];
+	int fd;
+
+	memset(&sv, 0, sizeof(sv));
+	sv.lfd = serve_listen(sock);
+	sv.max = max;
+	sv.max_bytes = max_bytes;
+	sv.start = clock_ns();
+	pthread_mutex_init(&sv.lock, NULL);
+	pthread_cond_init(&sv.ready, NULL);
+	pthread_cond_init(&sv.room, NULL);
+
+	/* A client that goes away must not take the daemon with it, and
+	   only this thread takes the signals that stop it. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	sa.sa_handler = serve_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop, &old);
+
+	tids = calloc((size_t)nthreads, sizeof(*tids));
+	if (tids == NULL)
+		err(EXIT_FAILURE, "calloc()");
+	for (t = started = 0; t < nthreads; t++) {
+		if (pthread_create(&tids[started], NULL, serve_worker,
+				   &sv) != 0) {
+			warnx("pthread_create(): cannot start worker %ld", t);
+			continue;
+		}
+		started++;
+	}
+	if (started == 0)
+		errx(EXIT_FAILURE, "no worker could be started.");
+	sv.nthreads = started;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	fprintf(stdout, "listening on %s with %ld thread(s), %zu archive(s) "
+		"or %s cached.\n", sock, started, max,
+		human_size(b1, sizeof(b1), max_bytes));
+	fflush(stdout);
+
+	while (serve_stopping == 0) {
+		fd = accept4(sv.lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				warn("accept()");
+			if (errno == EMFILE || errno == ENFILE)
+				sleep(1);
+			continue;
+		}
+		pthread_mutex_lock(&sv.lock);
+		while (sv.queued == SERVE_QUEUE)
+			pthread_cond_wait(&sv.room, &sv.lock);
+		sv.queue[(sv.head + sv.queued) % SERVE_QUEUE] = fd;
+		sv.queued++;
+		pthread_cond_signal(&sv.ready);
+		pthread_mutex_unlock(&sv.lock);
+	}
+
+	/* The requests already taken are finished first. */
+	close(sv.lfd);
+	unlink(sock);
+	pthread_mutex_lock(&sv.lock);
+	sv.stop = 1;
+	pthread_cond_broadcast(&sv.ready);
+	pthread_mutex_unlock(&sv.lock);
+	for (t = 0; t < started; t++)
+		pthread_join(tids[t], NULL);
+
+	serve_report(&sv, stdout);
+	while ((a = sv.lru) != NULL)
+		serve_drop(&sv, a);
+	pthread_cond_destroy(&sv.room);
+	pthread_cond_destroy(&sv.ready);
+	pthread_mutex_destroy(&sv.lock);
+	free(tids);
+}
+
+/* Send a command to the daemon listening on sock, along with our
+   standard output and error, and wait for it to be done. Returns its
+   exit status, or -1 if it has to be run here: the daemon is not
+   there, or left it to us. */
+static int serve_client(const char *sock, int argc, char **argv)
+{
+	struct sockaddr_un sa;
+	struct serve_req req;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	zip_int32_t status;
+	char *cwd, *buf;
+	size_t len, at, n;
+	ssize_t sent;
+	int fd, i, fds[2];
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(sock) >= sizeof(sa.sun_path))
+		errx(EXIT_FAILURE, "socket path '%s' is too long.", sock);
+	strcpy(sa.sun_path, sock);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		warn("warning: cannot reach the daemon on '%s'", sock);
+		if (fd != -1)
+			close(fd);
+		return (-1);
+	}
+
+	cwd = getcwd(NULL, 0);
+	if (cwd == NULL)
+		err(EXIT_FAILURE, "getcwd()");
+	len = strlen(cwd) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > SERVE_REQ_MAX) {
+		free(cwd);
+		close(fd);
+		return (-1);
+	}
+	buf = malloc(len);
+	if (buf == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	n = strlen(cwd) + 1;
+	memcpy(buf, cwd, n);
+	for (at = n, i = 0; i < argc; i++, at += n) {
+		n = strlen(argv[i]) + 1;
+		memcpy(buf + at, argv[i], n);
+	}
+	free(cwd);
+
+	memset(&req, 0, sizeof(req));
+	memcpy(req.magic, SERVE_MAGIC, sizeof(req.magic));
+	req.argc = (zip_uint32_t)argc;
+	req.len = (zip_uint32_t)len;
+	fds[0] = STDOUT_FILENO;
+	fds[1] = STDERR_FILENO;
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	do
+		sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	while (sent == -1 && errno == EINTR);
+	if (sent != (ssize_t)sizeof(req) || write_all(fd, buf, len) == -1) {
+		warn("warning: cannot send to the daemon on '%s'", sock);
+		free(buf);
+		close(fd);
+		return (-1);
+	}
+	free(buf);
+
+	/* Once the daemon has the request, it may have written part of
+	   the output, so there is no going back. */
+	if (serve_read(fd, &status, sizeof(status)) == -1)
+		errx(EXIT_FAILURE, "the daemon on '%s' went away.", sock);
+	close(fd);
+	return (status == SERVE_LOCAL ? -1 : status);
 }
 
 NORETURN static void print_usage(int status)
@@ -724,31 +10215,168 @@ NORETURN static void print_usage(int status)
 		"Commands:\n"
 		" (e|x) - extract an zip archive\n"
 		" (l)   - list all files in that zip archive\n"
-		" (r)   - rename a file in that zip archive\n"
-		" (d)   - delete a file from that zip archive\n"
+		" (t)   - test the archives: inflate every file and check\n"
+		"         its crc and size, without writing anything\n"
+		" (p)   - write files of that zip archive to standard output,\n"
+		"         given like for d, or all of them\n"
+		" (r)   - rename a file in that zip archive, or a directory\n"
+		"         (name ending with /) with everything under it\n"
+		" (d)   - delete files from that zip archive, given by name,\n"
+		"         glob pattern or @file with one name per line\n"
+		" (a)   - add files and directories to that zip archive,\n"
+		"         which is created if it doesn't exist\n"
+		" (compact) - reclaim the space left by in-place edits\n"
+		" (c)   - recompress the archives, every file with the\n"
+		"         method that suits it\n"
+		" (serve) - run as a daemon on a Unix socket, keeping the\n"
+		"           archives open for l, p and x, see --socket\n"
+		" (stats) - with --socket, what the daemon did so far\n"
 		" (h)   - print this help menu\n\n"
 		"Switches:\n"
 		" (-y)  - assume 'yes' on archive extraction\n"
-		" (-o)  - output directory for the unarchived contents\n");
+		" (-o)  - output directory for the unarchived contents\n"
+		" (-j)  - number of threads used for extraction (0 = all cpus)\n"
+		"         or (re)compression\n"
+		" (--no-crc) - don't verify the crc of stored entries\n"
+		" (--buffer-size) - size of the I/O buffers, e.g. 4M (default 1M)\n"
+		" (--io-uring) - batch the writes of small files with io_uring\n"
+		" (--sparse) - leave blocks of zeros in the files as holes\n"
+		" (--update) - skip the files that exist with the same size\n"
+		"              and modification time as in the archive\n"
+		" (--freshen) - like --update, but only extract files that\n"
+		"               already exist\n"
+		" (--check-crc) - with --update or --freshen, also compare\n"
+		"                 the crc of the files\n"
+		" (--archives) - number of archives extracted at once, each\n"
+		"                with -j threads (0 = all cpus), needs -y\n"
+		" (--dedup) - inflate files with the same data once, and\n"
+		"             reflink (or copy) the others from it\n"
+		" (--dedup-link) - like --dedup, but with hard links\n"
+		" (-q)  - don't print a line for every file\n"
+		" (--progress) - instead of a line for every file, show the\n"
+		"                files, bytes, rate and time left on stderr\n"
+		" (--password-file) - read the password of encrypted files\n"
+		"                     from the first line of a file\n"
+		" (--password-fd) - read it from an open file descriptor,\n"
+		"                   otherwise it is taken from "
+		PASSWORD_ENV "\n"
+		"                   or asked once per archive\n"
+		" (--stats) - time every phase of the extraction and print\n"
+		"             them with histograms of the entries, also for t,\n"
+		"             --stats=json prints a line of JSON instead\n"
+		" (--include) - only extract the files matching a name, glob\n"
+		"               pattern or @file, can be given many times\n"
+		" (--exclude) - don't extract the files matching a name, glob\n"
+		"               pattern or @file, can be given many times\n"
+		" (--regex) - the patterns are extended regular expressions\n"
+		" (--to-tar) - with p, write a tar stream of the files\n"
+		" (--stream) - extract an archive read from standard input,\n"
+		"              same as giving - as the archive\n"
+		" (--in-place) - rename or delete by rewriting the central\n"
+		"                directory only, the data of deleted files stays\n"
+		"                until compact; a rename to a name of another\n"
+		"                length rewrites the archive instead\n"
+		" (--index) - with l or p, keep a sidecar index next to the\n"
+		"             archive (archive.zip" LZIDX_SUFFIX "), to read the\n"
+		"             entries from instead of the central directory\n"
+		" (--level) - with a, the deflate level, 0 (store) to 9,\n"
+		"             with c, the level of its method\n"
+		" (--method) - with c, what files that compress become:\n"
+		"              deflate, zstd, store or auto (the default,\n"
+		"              zstd if lounzip was built with it)\n"
+		" (--socket) - send l, p, x and stats to the daemon there\n"
+		"              (or at $" SERVE_SOCKET_ENV "), what it can't\n"
+		"              take runs here\n"
+		" (--cache) - with serve, number of archives kept open\n"
+		"             (default 256)\n"
+		" (--cache-size) - with serve, most memory the central\n"
+		"                  directories of these take, like\n"
+		"                  --buffer-size (default 1G)\n");
 	exit(status);
 }
 
 int main(int argc, char **argv)
 {
-	int i, j, all_ok, one_ok;
-	char *path;
+	int i, j, all_ok, one_ok, in_place, regex, to_tar, ret, level, kind;
+	int index;
+	size_t ntested, nbad, cache;
+	zip_uint64_t cache_bytes;
+	long narchives;
+	char *path, *sock;
+	struct unzip_opts opts;
+	struct strlist inc, exc, arcs;
+	struct name_query incq, excq;
 
 	if (argc < 2)
 		errx(EXIT_FAILURE, "no args");
 
-	one_ok = all_ok = i = j = 0;
+	one_ok = all_ok = in_place = i = j = 0;
 	path = "."; /* Default path. */
+	opts.jobs = 1;
+	opts.no_crc = 0;
+	opts.bufsize = ZBUF_DEFAULT;
+	opts.io_uring = 0;
+	opts.sparse = 0;
+	opts.update = UPDATE_NONE;
+	opts.check_crc = 0;
+	opts.test = 0;
+	opts.dedup = DEDUP_NONE;
+	opts.stats = STATS_NONE;
+	opts.quiet = 0;
+	opts.progress = 0;
+	opts.passw = NULL;
+	opts.include = opts.exclude = NULL;
+
+	/* l, p, x and stats go to the daemon listening on --socket, or on
+	   SERVE_SOCKET_ENV, and are only run here if it leaves them to
+	   us. */
+	memset(&arcs, 0, sizeof(arcs));
+	take_values(&argc, argv, "--socket", &arcs);
+	sock = arcs.n > 0 ? arcs.v[arcs.n - 1] : getenv(SERVE_SOCKET_ENV);
+	if (sock && sock[0] != '\0' && argv[1][0] != '\0' &&
+	    (strchr("elpx", argv[1][0]) || strcmp(argv[1], "stats") == 0)) {
+		ret = serve_client(sock, argc, argv);
+		if (ret >= 0)
+			exit(ret);
+	}
+	free(arcs.v);
 
 	/* TODO: Rename l to j and comments. */
 	switch (argv[1][0]) {
 	case 'e':
 	case 'x':
-		/* Option for extraction. */
+		/* Option for extraction. The filters are taken out first,
+		   as their patterns could look like anything else. */
+		setvbuf(stdout, NULL, _IOFBF, OUT_BUFFER);
+		opts.passw = take_password_args(&argc, argv);
+		memset(&inc, 0, sizeof(inc));
+		memset(&exc, 0, sizeof(exc));
+		take_values(&argc, argv, "--include", &inc);
+		take_values(&argc, argv, "--exclude", &exc);
+		regex = take_flag(&argc, argv, "--regex");
+		if (inc.n > 0) {
+			name_query_init(&incq, inc.v, inc.n, regex);
+			opts.include = &incq;
+		}
+		if (exc.n > 0) {
+			name_query_init(&excq, exc.v, exc.n, regex);
+			opts.exclude = &excq;
+		}
+
+		/* --stream is the same as an archive named -, which takes
+		   the place the switch leaves in argv. */
+		if (take_flag(&argc, argv, "--stream")) {
+			argv[argc++] = "-";
+			argv[argc] = NULL;
+		}
+
+		/* With --archives, the archives are only gathered here,
+		   and extracted together after the loop. */
+		memset(&arcs, 0, sizeof(arcs));
+		take_values(&argc, argv, "--archives", &arcs);
+		narchives = arcs.n > 0 ? parse_jobs(arcs.v[arcs.n - 1]) : 1;
+		arcs.n = 0;
+
 		for (i = 0; i < argc; i++) {
 			if (strstr(argv[i], "-y"))
 				all_ok = 1;
@@ -759,7 +10387,7 @@ int main(int argc, char **argv)
 					     "output path is not provided.");
 			}
 
-			if (strstr(argv[i], ".zip")) {
+			if (strstr(argv[i], ".zip") || strcmp(argv[i], "-") == 0) {
 				one_ok = 1;
 				for (j = 0; j < argc; j++) {
 					if (strstr(argv[j], "-y"))
@@ -770,22 +10398,129 @@ int main(int argc, char **argv)
 							errx(EXIT_FAILURE,
 							     "output path is not provided.");
 					}
+					if (strcmp(argv[j], "-j") == 0)
+						opts.jobs = parse_jobs(argv[j + 1]);
+					if (strcmp(argv[j], "--no-crc") == 0)
+						opts.no_crc = 1;
+					if (strcmp(argv[j], "--buffer-size") == 0)
+						opts.bufsize = parse_size(argv[j + 1]);
+					if (strcmp(argv[j], "--io-uring") == 0)
+						opts.io_uring = 1;
+					if (strcmp(argv[j], "--sparse") == 0)
+						opts.sparse = 1;
+					if (strcmp(argv[j], "--update") == 0)
+						opts.update = UPDATE_NEW;
+					if (strcmp(argv[j], "--freshen") == 0)
+						opts.update = UPDATE_FRESHEN;
+					if (strcmp(argv[j], "--check-crc") == 0)
+						opts.check_crc = 1;
+					if (strcmp(argv[j], "--dedup") == 0)
+						opts.dedup = DEDUP_CLONE;
+					if (strcmp(argv[j], "--dedup-link") == 0)
+						opts.dedup = DEDUP_LINK;
+					if (strcmp(argv[j], "--stats") == 0)
+						opts.stats = STATS_HUMAN;
+					if (strcmp(argv[j], "--stats=json") == 0)
+						opts.stats = STATS_JSON;
+					if (strcmp(argv[j], "-q") == 0)
+						opts.quiet = 1;
+					if (strcmp(argv[j], "--progress") == 0)
+						opts.quiet = opts.progress = 1;
+				}
+				opts.all_ok = all_ok;
+				if (opts.io_uring && uring_usable() == 0) {
+					warnx("io_uring is not available, "
+					      "using synchronous I/O.");
+					opts.io_uring = 0;
+				}
+				if (strcmp(argv[i], "-") == 0) {
+					unzip_zip_stream(path, &opts);
+				} else if (narchives > 1) {
+					if (strlist_add(&arcs, argv[i]) == -1)
+						err(EXIT_FAILURE, "realloc()");
+				} else {
+					ret = unzip_zip_archive(path, argv[i],
+								&opts, stdout);
+					if (ret == -1)
+						exit(EXIT_FAILURE);
+					if (ret == 1)
+						exit(EXIT_SUCCESS);
 				}
-				unzip_zip_archive(path, argv[i], all_ok);
 			}
 		}
 
 		if (one_ok == 0)
 			errx(EXIT_FAILURE,
 			     "no zip file archive was provided.");
+		if (arcs.n > 1 && opts.all_ok == 0)
+			errx(EXIT_FAILURE,
+			     "--archives needs -y, archives extracted at once "
+			     "can't ask about existing files.");
+		if (arcs.n == 1 &&
+		    unzip_zip_archive(path, arcs.v[0], &opts, stdout) == -1)
+			exit(EXIT_FAILURE);
+		if (arcs.n > 1 &&
+		    unzip_archives(path, arcs.v, arcs.n, &opts, narchives) > 0)
+			exit(EXIT_FAILURE);
+		free(arcs.v);
+		goto exit_ok;
+
+	case 'a':
+		/* Option for adding files to an archive, which is created
+		   if it doesn't exist. */
+		setvbuf(stdout, NULL, _IOFBF, OUT_BUFFER);
+		opts.quiet = take_flag(&argc, argv, "-q");
+		memset(&inc, 0, sizeof(inc));
+		memset(&exc, 0, sizeof(exc));
+		take_values(&argc, argv, "-j", &inc);
+		take_values(&argc, argv, "--level", &exc);
+		if (inc.n > 0)
+			opts.jobs = parse_jobs(inc.v[inc.n - 1]);
+		level = exc.n > 0 ? parse_level(exc.v[exc.n - 1], 9) :
+			Z_DEFAULT_COMPRESSION;
+		free(inc.v);
+		free(exc.v);
+		if (argc < 3)
+			errx(EXIT_FAILURE,
+			     "no zip file archive was provided.");
+		if (argc < 4)
+			errx(EXIT_FAILURE, "no file to add was provided.");
+		zip_archive_add(argv[2], argv + 3, (size_t)(argc - 3),
+				opts.jobs, level, opts.quiet);
 		goto exit_ok;
 
 	case 'l':
 		/* Option for listing files. */
+		index = take_flag(&argc, argv, "--index");
 		for (i = 0; i < argc; i++) {
 			if (strstr(argv[i], ".zip")) {
 				one_ok = 1;
-				zip_list_all_files(argv[i]);
+				zip_list_all_files(argv[i], index);
+			}
+		}
+
+		if (one_ok == 0)
+			errx(EXIT_FAILURE,
+			     "no zip file archive was provided.");
+		goto exit_ok;
+
+	case 'p':
+		/* Option for writing files to standard output. */
+		to_tar = take_flag(&argc, argv, "--to-tar");
+		index = take_flag(&argc, argv, "--index");
+		opts.passw = take_password_args(&argc, argv);
+		memset(&inc, 0, sizeof(inc));
+		take_values(&argc, argv, "--buffer-size", &inc);
+		if (inc.n > 0)
+			opts.bufsize = parse_size(inc.v[inc.n - 1]);
+		free(inc.v);
+		for (i = 2; i < argc; i++) {
+			if (strstr(argv[i], ".zip")) {
+				one_ok = 1;
+				zip_pipe_files(argv[i], argv + i + 1,
+					       (size_t)(argc - i - 1), to_tar,
+					       index, &opts);
+				goto exit_ok;
 			}
 		}
 
@@ -796,6 +10531,7 @@ int main(int argc, char **argv)
 
 	case 'r':
 		/* Option for renaming a file. */
+		in_place = take_flag(&argc, argv, "--in-place");
 		for (i = 0; i < argc; i++) {
 			if (strstr(argv[i], ".zip")) {
 				one_ok = 1;
@@ -807,7 +10543,7 @@ int main(int argc, char **argv)
 					     "new file name is required.");
 
 				zip_archive_file_rename(argv[i], argv[i + 1],
-							argv[i + 2]);
+							argv[i + 2], in_place);
 			}
 
 			if (one_ok)
@@ -821,17 +10557,38 @@ int main(int argc, char **argv)
 
 	case 'd':
 		/* Option for deleting a file. */
+		in_place = take_flag(&argc, argv, "--in-place");
 		for (i = 0; i < argc; i++) {
 			if (strstr(argv[i], ".zip")) {
 				if (argv[i + 1] == NULL)
 					errx(EXIT_FAILURE,
 					     "file name is required.");
-				for (j = 3; j < argc; j++) {
-					one_ok = 1;
-					zip_archive_file_delete(argv[i], argv[j]);
-				}
-				if (one_ok)
-					goto exit_ok;
+				/* Every name is deleted in one go. */
+				one_ok = 1;
+				zip_archive_file_delete(argv[i], argv + i + 1,
+							(size_t)(argc - i - 1),
+							in_place);
+				goto exit_ok;
+			}
+		}
+
+		if (one_ok == 0)
+			errx(EXIT_FAILURE,
+			     "no zip file archive was provided.");
+		goto exit_ok;
+
+	case 'c':
+		/* Option for compacting an archive, or for recompressing
+		   archives with c. */
+		if (strcmp(argv[1], "c") == 0)
+			goto recompress;
+		if (strcmp(argv[1], "compact") != 0)
+			errx(EXIT_FAILURE,
+			     "an unknown argument was provided.");
+		for (i = 2; i < argc; i++) {
+			if (strstr(argv[i], ".zip")) {
+				one_ok = 1;
+				zip_archive_compact(argv[i]);
 			}
 		}
 
@@ -840,6 +10597,130 @@ int main(int argc, char **argv)
 			     "no zip file archive was provided.");
 		goto exit_ok;
 
+	recompress:
+		/* Every argument that is not a switch is an archive. */
+		setvbuf(stdout, NULL, _IOFBF, OUT_BUFFER);
+		opts.quiet = take_flag(&argc, argv, "-q");
+		memset(&inc, 0, sizeof(inc));
+		memset(&exc, 0, sizeof(exc));
+		memset(&arcs, 0, sizeof(arcs));
+		take_values(&argc, argv, "-j", &inc);
+		take_values(&argc, argv, "--level", &exc);
+		take_values(&argc, argv, "--method", &arcs);
+		if (inc.n > 0)
+			opts.jobs = parse_jobs(inc.v[inc.n - 1]);
+#ifdef HAVE_ZSTD
+		kind = RECOMP_ZSTD;
+#else
+		kind = RECOMP_DEFLATE;
+#endif
+		if (arcs.n > 0 && strcmp(arcs.v[arcs.n - 1], "store") == 0)
+			kind = RECOMP_STORE;
+		else if (arcs.n > 0 &&
+			 strcmp(arcs.v[arcs.n - 1], "deflate") == 0)
+			kind = RECOMP_DEFLATE;
+		else if (arcs.n > 0 && strcmp(arcs.v[arcs.n - 1], "zstd") == 0)
+			kind = RECOMP_ZSTD;
+		else if (arcs.n > 0 && strcmp(arcs.v[arcs.n - 1], "auto") != 0)
+			errx(EXIT_FAILURE, "unknown method '%s'.",
+			     arcs.v[arcs.n - 1]);
+#ifndef HAVE_ZSTD
+		if (kind == RECOMP_ZSTD)
+			errx(EXIT_FAILURE, "lounzip was built without zstd.");
+		level = exc.n > 0 ? parse_level(exc.v[exc.n - 1], 9) :
+			Z_DEFAULT_COMPRESSION;
+#else
+		if (kind == RECOMP_ZSTD)
+			level = exc.n > 0 ? parse_level(exc.v[exc.n - 1],
+							ZSTD_maxCLevel()) :
+				ZSTD_CLEVEL_DEFAULT;
+		else
+			level = exc.n > 0 ? parse_level(exc.v[exc.n - 1], 9) :
+				Z_DEFAULT_COMPRESSION;
+#endif
+		free(inc.v);
+		free(exc.v);
+		free(arcs.v);
+		for (i = 2; i < argc; i++) {
+			one_ok = 1;
+			zip_archive_recompress(argv[i], opts.jobs, kind, level,
+					       opts.quiet);
+		}
+
+		if (one_ok == 0)
+			errx(EXIT_FAILURE,
+			     "no zip file archive was provided.");
+		goto exit_ok;
+
+	case 't':
+		/* Option for testing archives. Every argument that is
+		   not a switch is an archive, whatever its suffix. */
+		opts.test = 1;
+		setvbuf(stdout, NULL, _IOFBF, OUT_BUFFER);
+		opts.passw = take_password_args(&argc, argv);
+		if (take_flag(&argc, argv, "-q"))
+			opts.quiet = 1;
+		if (take_flag(&argc, argv, "--progress"))
+			opts.quiet = opts.progress = 1;
+		if (take_flag(&argc, argv, "--stats"))
+			opts.stats = STATS_HUMAN;
+		if (take_flag(&argc, argv, "--stats=json"))
+			opts.stats = STATS_JSON;
+		memset(&inc, 0, sizeof(inc));
+		memset(&exc, 0, sizeof(exc));
+		take_values(&argc, argv, "-j", &inc);
+		take_values(&argc, argv, "--buffer-size", &exc);
+		if (inc.n > 0)
+			opts.jobs = parse_jobs(inc.v[inc.n - 1]);
+		if (exc.n > 0)
+			opts.bufsize = parse_size(exc.v[exc.n - 1]);
+		free(inc.v);
+		free(exc.v);
+		ntested = nbad = 0;
+		for (i = 2; i < argc; i++) {
+			one_ok = 1;
+			ntested++;
+			if (test_zip_archive(argv[i], &opts) != 0)
+				nbad++;
+		}
+
+		if (one_ok == 0)
+			errx(EXIT_FAILURE,
+			     "no zip file archive was provided.");
+		if (ntested > 1)
+			fprintf(stdout, "%zu archive(s) tested, %zu failed.\n",
+				ntested, nbad);
+		if (nbad)
+			exit(EXIT_FAILURE);
+		goto exit_ok;
+
+	case 's':
+		/* Option for running the daemon, or asking it how it
+		   does with stats. */
+		if (strcmp(argv[1], "stats") == 0)
+			errx(EXIT_FAILURE,
+			     "stats needs a daemon, see --socket.");
+		if (strcmp(argv[1], "serve") != 0)
+			errx(EXIT_FAILURE,
+			     "an unknown argument was provided.");
+		memset(&inc, 0, sizeof(inc));
+		memset(&exc, 0, sizeof(exc));
+		take_values(&argc, argv, "-j", &inc);
+		take_values(&argc, argv, "--cache", &exc);
+		opts.jobs = parse_jobs(inc.n > 0 ? inc.v[inc.n - 1] : "0");
+		cache = exc.n > 0 ? parse_cache(exc.v[exc.n - 1]) :
+			SERVE_CACHE;
+		exc.n = 0;
+		take_values(&argc, argv, "--cache-size", &exc);
+		cache_bytes = exc.n > 0 ?
+			parse_cache_size(exc.v[exc.n - 1]) : SERVE_CACHE_BYTES;
+		free(inc.v);
+		free(exc.v);
+		if (argc < 3)
+			errx(EXIT_FAILURE, "no socket path was provided.");
+		serve(argv[2], opts.jobs, cache, cache_bytes);
+		goto exit_ok;
+
 	case 'h':
 		/* Option for display the usage. */
 	        print_usage(EXIT_SUCCESS);